@@ -38,7 +38,9 @@
 #include <inttypes.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <limits.h>
 #include <errno.h>
+#include <sched.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <linux/perf_event.h>
@@ -52,54 +54,273 @@
 
 #define PERF_INVALID     (~0ULL)
 
-#define PERF_INFO(type, config)	\
-	{ PERF_ ## config, PERF_TYPE_ ## type, PERF_COUNT_ ## config }
+#define PERF_INFO(name, label, unit, heading, field, type, config)	\
+	{ name, label, unit, heading, field, PERF_TYPE_ ## type, config }
 
-/* perf counters to be read */
-static const perf_info_t perf_info[PERF_MAX] = {
-	PERF_INFO(HARDWARE, HW_CPU_CYCLES),
-	PERF_INFO(HARDWARE, HW_INSTRUCTIONS),
+#define PERF_HW(name, label, unit, heading, field, config)		\
+	PERF_INFO(name, label, unit, heading, field, HARDWARE,		\
+		  PERF_COUNT_ ## config)
+
+#define PERF_LLC(name, label, unit, heading, field, result)		\
+	PERF_INFO(name, label, unit, heading, field, HW_CACHE,		\
+		  PERF_COUNT_HW_CACHE_LL |				\
+		  (PERF_COUNT_HW_CACHE_OP_READ << 8) |			\
+		  (PERF_COUNT_HW_CACHE_RESULT_ ## result << 16))
+
+/* perf events that can be selected with -P */
+static const perf_info_t perf_info[] = {
+	PERF_HW("cycles", "Cycl/s", "CPU cycle",
+		"cpu-cycle", "one-cpu-cycle-watt-seconds",
+		HW_CPU_CYCLES),
+	PERF_HW("instructions", "Inst/s", "CPU instruction",
+		"cpu-instruction", "on-cpu-instruction-watt-seconds",
+		HW_INSTRUCTIONS),
+	PERF_HW("cache-references", "CRef/s", "cache reference",
+		"cache-reference", "one-cache-reference-watt-seconds",
+		HW_CACHE_REFERENCES),
+	PERF_HW("cache-misses", "CMis/s", "cache miss",
+		"cache-miss", "one-cache-miss-watt-seconds",
+		HW_CACHE_MISSES),
+	PERF_HW("branches", "Brch/s", "branch",
+		"branch", "one-branch-watt-seconds",
+		HW_BRANCH_INSTRUCTIONS),
+	PERF_HW("branch-misses", "BMis/s", "branch miss",
+		"branch-miss", "one-branch-miss-watt-seconds",
+		HW_BRANCH_MISSES),
+	PERF_HW("bus-cycles", "BusC/s", "bus cycle",
+		"bus-cycle", "one-bus-cycle-watt-seconds",
+		HW_BUS_CYCLES),
+	PERF_HW("stalled-cycles-frontend", "StFE/s", "frontend stalled cycle",
+		"stalled-cycle-frontend", "one-stalled-cycle-frontend-watt-seconds",
+		HW_STALLED_CYCLES_FRONTEND),
+	PERF_HW("stalled-cycles-backend", "StBE/s", "backend stalled cycle",
+		"stalled-cycle-backend", "one-stalled-cycle-backend-watt-seconds",
+		HW_STALLED_CYCLES_BACKEND),
+	PERF_HW("ref-cycles", "RefC/s", "reference cycle",
+		"ref-cycle", "one-ref-cycle-watt-seconds",
+		HW_REF_CPU_CYCLES),
+	PERF_LLC("llc-references", "LRef/s", "LLC reference",
+		"llc-reference", "one-llc-reference-watt-seconds",
+		ACCESS),
+	PERF_LLC("llc-misses", "LMis/s", "LLC miss",
+		"llc-miss", "one-llc-miss-watt-seconds",
+		MISS),
 };
 
-int perf_start(perf_t *p, const pid_t pid)
+/* perf events selected to be read */
+static perf_info_t perf_events[PERF_MAX_EVENTS];
+static int perf_num = -1;
+
+/*
+ *  perf_events_show()
+ *	list the available perf events
+ */
+static void perf_events_show(void)
+{
+	size_t i;
+
+	(void)fprintf(stderr, "Available perf events:");
+	for (i = 0; i < sizeof(perf_info) / sizeof(perf_info[0]); i++)
+		(void)fprintf(stderr, " %s", perf_info[i].name);
+	(void)fprintf(stderr, " rNNNN (raw PMU event code in hex)\n");
+}
+
+/*
+ *  perf_event_raw()
+ *	parse a raw PMU event rNNNN into info
+ */
+static int perf_event_raw(const char *name, perf_info_t *info)
+{
+	unsigned long config;
+	char *endptr;
+
+	if (name[0] != 'r' || !isxdigit((int)name[1]))
+		return -1;
+	errno = 0;
+	config = strtoul(name + 1, &endptr, 16);
+	if (errno || *endptr)
+		return -1;
+
+	memset(info, 0, sizeof(*info));
+	(void)snprintf(info->name, sizeof(info->name), "%s", name);
+	(void)snprintf(info->label, sizeof(info->label), "%.6s", name);
+	(void)snprintf(info->unit, sizeof(info->unit), "raw event 0x%lx", config);
+	(void)snprintf(info->heading, sizeof(info->heading), "raw-0x%lx", config);
+	(void)snprintf(info->field, sizeof(info->field),
+		"one-raw-0x%lx-event-watt-seconds", config);
+	info->type = PERF_TYPE_RAW;
+	info->config = config;
+
+	return 0;
+}
+
+/*
+ *  perf_events_parse()
+ *	parse a comma separated list of perf events to read
+ */
+int perf_events_parse(const char *list)
+{
+	char *str, *token, *saveptr = NULL, *buf;
+	int n = 0;
+
+	if ((buf = strdup(list)) == NULL) {
+		(void)fprintf(stderr, "Out of memory parsing perf events.\n");
+		return -1;
+	}
+
+	for (str = buf; (token = strtok_r(str, ",", &saveptr)) != NULL; str = NULL) {
+		size_t i;
+
+		if (n >= PERF_MAX_EVENTS) {
+			(void)fprintf(stderr, "Too many perf events, maximum is %d.\n",
+				PERF_MAX_EVENTS);
+			goto err;
+		}
+		for (i = 0; i < sizeof(perf_info) / sizeof(perf_info[0]); i++) {
+			if (!strcmp(token, perf_info[i].name)) {
+				perf_events[n] = perf_info[i];
+				break;
+			}
+		}
+		if ((i == sizeof(perf_info) / sizeof(perf_info[0])) &&
+		    (perf_event_raw(token, &perf_events[n]) < 0)) {
+			(void)fprintf(stderr, "Unknown perf event '%s'.\n", token);
+			perf_events_show();
+			goto err;
+		}
+		n++;
+	}
+	if (!n) {
+		(void)fprintf(stderr, "No perf events given.\n");
+		perf_events_show();
+		goto err;
+	}
+	free(buf);
+	perf_num = n;
+
+	return 0;
+err:
+	free(buf);
+	return -1;
+}
+
+/*
+ *  perf_events_num()
+ *	number of perf events to read
+ */
+int perf_events_num(void)
+{
+	if (perf_num < 0)
+		(void)perf_events_parse(PERF_EVENTS_DEFAULT);
+	return perf_num;
+}
+
+/*
+ *  perf_event_info()
+ *	get info of the idx'th perf event
+ */
+const perf_info_t *perf_event_info(const int idx)
+{
+	if ((idx < 0) || (idx >= perf_events_num()))
+		return NULL;
+	return &perf_events[idx];
+}
+
+#if defined(__x86_64__) || defined(__x86_64) || \
+    defined(__i386__) || defined(__i386)
+#define PERF_RDPMC
+#endif
+
+/*
+ *  perf_close_counters()
+ *	close all opened counters
+ */
+static void perf_close_counters(perf_t *p)
+{
+	int i;
+
+	for (i = 0; i < perf_num; i++) {
+		if (p->perf_stat[i].fd > -1) {
+			(void)close(p->perf_stat[i].fd);
+			p->perf_stat[i].fd = -1;
+		}
+	}
+	p->perf_opened = 0;
+	p->group_fd = -1;
+}
+
+/*
+ *  perf_open_counters()
+ *	open, reset and enable counters on a pid and/or a cpu. Counters
+ *	on a cpu for all processes (pid -1) are put into one group so
+ *	they can be read back with a single read()
+ */
+static int perf_open_counters(perf_t *p, const pid_t pid, const int cpu)
 {
+	const bool group = (pid < 0) && (cpu >= 0);
 	int i;
 
+	/* Ensure the default perf events are selected if none were given */
+	(void)perf_events_num();
+
 	memset(p, 0, sizeof(perf_t));
 	p->perf_opened = 0;
+	p->cpu = cpu;
+	p->group_fd = -1;
+	p->group_nr = 0;
 
-	for (i = 0; i < PERF_MAX; i++) {
+	for (i = 0; i < perf_num; i++) {
 		p->perf_stat[i].fd = -1;
 		p->perf_stat[i].counter = 0;
+		p->perf_stat[i].group_idx = -1;
 	}
 
-	if (pid <= 0)
+	if ((pid <= 0) && (cpu < 0))
 		return 0;
 
-	for (i = 0; i < PERF_MAX; i++) {
+	for (i = 0; i < perf_num; i++) {
 		struct perf_event_attr attr;
+		int fd;
 
 		memset(&attr, 0, sizeof(attr));
-		attr.type = perf_info[i].type;
-		attr.config = perf_info[i].config;
-		attr.disabled = 1;
-		attr.inherit = 1;
+		attr.type = perf_events[i].type;
+		attr.config = perf_events[i].config;
+		/* Group members follow the group leader */
+		attr.disabled = group ? (p->group_fd < 0) : 1;
+		attr.inherit = (pid > 0);
 		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
 				   PERF_FORMAT_TOTAL_TIME_RUNNING;
+		if (group)
+			attr.read_format |= PERF_FORMAT_GROUP;
 		attr.size = sizeof(attr);
-		p->perf_stat[i].fd = syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0);
-		if (p->perf_stat[i].fd > -1)
+		fd = syscall(__NR_perf_event_open, &attr, pid, cpu,
+			group ? p->group_fd : -1, 0);
+		p->perf_stat[i].fd = fd;
+		if (fd > -1) {
 			p->perf_opened++;
-		else {
+			if (group) {
+				if (p->group_fd < 0)
+					p->group_fd = fd;
+				p->perf_stat[i].group_idx = p->group_nr++;
+			}
+		} else {
 			fprintf(stderr, "perf fail: %d %s\n", errno, strerror(errno));
 		}
 	}
-	if (!p->perf_opened) {
-		munmap(p, sizeof(perf_t));
+	if (!p->perf_opened)
 		return -1;
+
+	if (group) {
+		/* Reset and enable the whole group via the leader */
+		if ((ioctl(p->group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) < 0) ||
+		    (ioctl(p->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) < 0)) {
+			perf_close_counters(p);
+			return -1;
+		}
+		return 0;
 	}
 
-	for (i = 0; i < PERF_MAX; i++) {
+	for (i = 0; i < perf_num; i++) {
 		int fd = p->perf_stat[i].fd;
 
 		if (fd > -1) {
@@ -117,6 +338,15 @@ int perf_start(perf_t *p, const pid_t pid)
 	return 0;
 }
 
+/*
+ *  perf_start()
+ *	open and start counters on a pid
+ */
+int perf_start(perf_t *p, const pid_t pid)
+{
+	return perf_open_counters(p, pid, -1);
+}
+
 /*
  *  perf_stop()
  *	stop and read counters
@@ -140,7 +370,7 @@ int perf_stop(perf_t *p)
 	if (!p->perf_opened)
 		goto out_ok;
 
-	for (i = 0; i < PERF_MAX; i++) {
+	for (i = 0; i < (size_t)perf_num; i++) {
 		int fd = p->perf_stat[i].fd;
 
 		if (fd < 0) {
@@ -168,7 +398,7 @@ int perf_stop(perf_t *p)
 		p->perf_stat[i].fd = -1;
 	}
 out_ok:
-	for (; i < PERF_MAX; i++)
+	for (; i < (size_t)perf_num; i++)
 		p->perf_stat[i].counter = PERF_INVALID;
 
 	return 0;
@@ -176,24 +406,465 @@ out_ok:
 
 /*
  *  perf_counter
- *	fetch counter and index via perf ID
+ *	fetch counter of the idx'th perf event
  */
 void perf_counter(
 	const perf_t *p,
-	const int id,
+	const int idx,
 	double *counter)
 {
+	if ((idx < 0) || (idx >= perf_events_num()) ||
+	    (p->perf_stat[idx].counter == PERF_INVALID)) {
+		*counter = 0;
+	} else {
+		*counter = (double)p->perf_stat[idx].counter;
+	}
+}
+
+/*
+ *  perf_open()
+ *	open counters for persistent use, they stay enabled until
+ *	perf_close() and each perf_read() fetches the delta since
+ *	the previous read
+ */
+int perf_open(perf_t *p, const pid_t pid, const int cpu)
+{
+	const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
 	int i;
 
-	for (i = 0; i < PERF_MAX; i++) {
-		if (perf_info[i].id == id) {
-			if (p->perf_stat[i].counter == PERF_INVALID) {
-				*counter = 0;
-			} else {
-				*counter = (double)p->perf_stat[i].counter;
+	if (perf_open_counters(p, pid, cpu) < 0)
+		return -1;
+
+	for (i = 0; i < perf_num; i++) {
+		perf_stat_t *ps = &p->perf_stat[i];
+		void *page;
+
+		ps->page = NULL;
+		if (ps->fd < 0)
+			continue;
+		/* Just the control page, no sample data pages */
+		page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, ps->fd, 0);
+		if (page != MAP_FAILED)
+			ps->page = page;
+	}
+
+	/* Prime the last counter values */
+	(void)perf_read(p);
+	p->rdpmc_reads = 0;
+	p->syscall_reads = 0;
+
+	return 0;
+}
+
+#if defined(PERF_RDPMC)
+/*
+ *  perf_rdpmc()
+ *	read a performance monitoring counter
+ */
+static inline uint64_t perf_rdpmc(const uint32_t counter)
+{
+	uint32_t low, high;
+
+	__asm__ __volatile__("rdpmc" : "=a" (low), "=d" (high) : "c" (counter));
+
+	return (uint64_t)low | ((uint64_t)high << 32);
+}
+
+/*
+ *  perf_rdtsc()
+ *	read the time stamp counter
+ */
+static inline uint64_t perf_rdtsc(void)
+{
+	uint32_t low, high;
+
+	__asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
+
+	return (uint64_t)low | ((uint64_t)high << 32);
+}
+#endif
+
+/*
+ *  perf_read_user()
+ *	read a counter and its enabled and running times from user
+ *	space using rdpmc, rdtsc and the mmap'd perf page, returns
+ *	false if this is not possible. The hardware counter index is
+ *	only meaningful on the CPU the event is bound to, so counters
+ *	attached to processes (cpu -1, the default) always use read()
+ */
+static bool perf_read_user(
+	const perf_t *p,
+	const perf_stat_t *ps,
+	uint64_t *count,
+	uint64_t *enabled,
+	uint64_t *running)
+{
+#if defined(PERF_RDPMC)
+	volatile struct perf_event_mmap_page *pc = ps->page;
+	uint64_t value, time_enabled, time_running, cyc, time_offset;
+	uint32_t seq, time_mult;
+	uint16_t time_shift;
+
+	if (!pc || (p->cpu < 0) || (sched_getcpu() != p->cpu))
+		return false;
+
+	do {
+		uint32_t idx;
+		uint16_t width;
+		int64_t pmc;
+
+		seq = pc->lock;
+		__asm__ __volatile__("" ::: "memory");
+
+		idx = pc->index;
+		/* Without the TSC conversion the times would be stale */
+		if (!pc->cap_user_rdpmc || !pc->cap_user_time || !idx)
+			return false;
+		time_enabled = pc->time_enabled;
+		time_running = pc->time_running;
+		time_offset = pc->time_offset;
+		time_mult = pc->time_mult;
+		time_shift = pc->time_shift;
+		cyc = perf_rdtsc();
+		width = pc->pmc_width;
+		value = pc->offset;
+		pmc = (int64_t)perf_rdpmc(idx - 1);
+		/* Sign extend the counter to 64 bits */
+		pmc = (int64_t)((uint64_t)pmc << (64 - width));
+		pmc >>= 64 - width;
+		value += pmc;
+
+		__asm__ __volatile__("" ::: "memory");
+	} while (pc->lock != seq);
+
+	/* Migrated while reading? Then the value is bogus */
+	if (sched_getcpu() != p->cpu)
+		return false;
+
+	/* Add the time since the page was updated, the event is on the PMU */
+	if (time_shift < 64) {
+		const uint64_t quot = cyc >> time_shift;
+		const uint64_t rem = cyc & ((1ULL << time_shift) - 1);
+		const uint64_t delta = time_offset + (quot * time_mult) +
+			((rem * time_mult) >> time_shift);
+
+		time_enabled += delta;
+		time_running += delta;
+	}
+
+	*count = value;
+	*enabled = time_enabled;
+	*running = time_running;
+	return true;
+#else
+	(void)p;
+	(void)ps;
+	(void)count;
+	(void)enabled;
+	(void)running;
+
+	return false;
+#endif
+}
+
+/*
+ *  perf_read()
+ *	read persistent counters, the counter field is set to the
+ *	number of events since the previous perf_read(). Grouped
+ *	counters are all fetched with one read() of the group leader
+ */
+int perf_read(perf_t *p)
+{
+	/* perf data */
+	struct {
+		uint64_t counter;		/* perf counter */
+		uint64_t time_enabled;		/* perf time enabled */
+		uint64_t time_running;		/* perf time running */
+	} data;
+	/* perf group data, PERF_FORMAT_GROUP layout */
+	struct {
+		uint64_t nr;			/* number of counters */
+		uint64_t time_enabled;		/* perf time enabled */
+		uint64_t time_running;		/* perf time running */
+		uint64_t counter[PERF_MAX_EVENTS]; /* perf counters */
+	} group;
+	bool group_read = false, group_ok = false;
+	int i;
+
+	if (!p)
+		return -1;
+
+	for (i = 0; i < perf_num; i++) {
+		perf_stat_t *ps = &p->perf_stat[i];
+		uint64_t raw, count, enabled, running;
+		uint64_t delta_enabled, delta_running;
+		double scale;
+
+		if (ps->fd < 0) {
+			ps->counter = PERF_INVALID;
+			continue;
+		}
+		if (perf_read_user(p, ps, &raw, &enabled, &running)) {
+			p->rdpmc_reads++;
+		} else if ((ps->group_idx >= 0) && (p->group_fd > -1)) {
+			if (!group_read) {
+				ssize_t ret;
+
+				p->syscall_reads++;
+				ret = read(p->group_fd, &group, sizeof(group));
+				group_ok = (ret >= (ssize_t)(3 * sizeof(uint64_t)));
+				group_read = true;
+			}
+			if (!group_ok || ((uint64_t)ps->group_idx >= group.nr)) {
+				ps->counter = PERF_INVALID;
+				continue;
+			}
+			raw = group.counter[ps->group_idx];
+			enabled = group.time_enabled;
+			running = group.time_running;
+		} else {
+			p->syscall_reads++;
+			if (read(ps->fd, &data, sizeof(data)) != sizeof(data)) {
+				ps->counter = PERF_INVALID;
+				continue;
 			}
+			raw = data.counter;
+			enabled = data.time_enabled;
+			running = data.time_running;
 		}
+		count = raw - ps->last;
+		delta_enabled = enabled - ps->last_enabled;
+		delta_running = running - ps->last_running;
+		ps->last = raw;
+		ps->last_enabled = enabled;
+		ps->last_running = running;
+
+		/* Ensure we don't get division by zero */
+		if (delta_running == 0) {
+			scale = (delta_enabled == 0) ? 1.0 : 0.0;
+		} else {
+			scale = (double)delta_enabled / (double)delta_running;
+		}
+		ps->counter = (uint64_t)((double)count * scale);
+	}
+	return 0;
+}
+
+/*
+ *  perf_close()
+ *	disable, unmap and close persistent counters
+ */
+void perf_close(perf_t *p)
+{
+	const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	int i;
+
+	if (!p)
+		return;
+
+	for (i = 0; i < perf_num; i++) {
+		perf_stat_t *ps = &p->perf_stat[i];
+
+		if (ps->page) {
+			(void)munmap(ps->page, page_size);
+			ps->page = NULL;
+		}
+		if (ps->fd > -1)
+			(void)ioctl(ps->fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	}
+	perf_close_counters(p);
+}
+
+/*
+ *  perf_power_file()
+ *	read the first line of a file of the perf power PMU
+ */
+static int perf_power_file(const char *name, char *buf, const size_t len)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+
+	(void)snprintf(path, sizeof(path), "%s/%s", PERF_POWER_PMU, name);
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+	if (fgets(buf, (int)len, fp) == NULL) {
+		(void)fclose(fp);
+		return -1;
+	}
+	(void)fclose(fp);
+	buf[strcspn(buf, "\n")] = '\0';
+
+	return 0;
+}
+
+/*
+ *  perf_power_open()
+ *	discover the energy events of the perf power PMU and open
+ *	them as one group on one CPU of each package, returns the
+ *	number of packages or -1 on failure
+ */
+int perf_power_open(perf_power_t **power)
+{
+	static const char *events[] = {
+		"energy-pkg", "energy-cores", "energy-gpu",
+		"energy-ram", "energy-psys",
+	};
+	char buf[4096], *str, *token, *saveptr = NULL;
+	perf_power_event_t info[PERF_POWER_EVENTS_MAX];
+	unsigned long type;
+	int nr = 0, n = 0;
+	size_t i;
+
+	*power = NULL;
+	if (perf_power_file("type", buf, sizeof(buf)) < 0) {
+		(void)fprintf(stderr, "Cannot find the perf power PMU %s.\n", PERF_POWER_PMU);
+		return -1;
+	}
+	type = strtoul(buf, NULL, 10);
+
+	for (i = 0; (i < sizeof(events) / sizeof(events[0])) && (nr < PERF_POWER_EVENTS_MAX); i++) {
+		char name[64], *ptr;
+
+		(void)snprintf(name, sizeof(name), "events/%s", events[i]);
+		if (perf_power_file(name, buf, sizeof(buf)) < 0)
+			continue;
+		if ((ptr = strstr(buf, "event=")) == NULL)
+			continue;
+
+		memset(&info[nr], 0, sizeof(info[nr]));
+		(void)snprintf(info[nr].name, sizeof(info[nr].name), "%s", events[i]);
+		info[nr].config = strtoul(ptr + 6, NULL, 0);
+		info[nr].fd = -1;
+
+		(void)snprintf(name, sizeof(name), "events/%s.scale", events[i]);
+		info[nr].scale = (perf_power_file(name, buf, sizeof(buf)) < 0) ?
+			1.0 : strtod(buf, NULL);
+		(void)snprintf(name, sizeof(name), "events/%s.unit", events[i]);
+		if (perf_power_file(name, buf, sizeof(buf)) < 0)
+			(void)snprintf(buf, sizeof(buf), "Joules");
+		(void)snprintf(info[nr].unit, sizeof(info[nr].unit), "%.15s", buf);
+		nr++;
+	}
+	if (!nr) {
+		(void)fprintf(stderr, "No energy events found for the perf power PMU.\n");
+		return -1;
+	}
+
+	/* One CPU of each package is listed in the cpumask */
+	if (perf_power_file("cpumask", buf, sizeof(buf)) < 0)
+		(void)snprintf(buf, sizeof(buf), "0");
+
+	for (str = buf; (token = strtok_r(str, ",", &saveptr)) != NULL; str = NULL) {
+		int first, last, cpu;
+
+		if (sscanf(token, "%d-%d", &first, &last) != 2)
+			last = first = atoi(token);
+
+		for (cpu = first; cpu <= last; cpu++) {
+			perf_power_t *p, *tmp;
+			int j;
+
+			tmp = realloc(*power, sizeof(**power) * (n + 1));
+			if (!tmp) {
+				(void)fprintf(stderr, "Out of memory allocating perf power info.\n");
+				goto err;
+			}
+			*power = tmp;
+			p = &(*power)[n];
+			p->cpu = cpu;
+			p->group_fd = -1;
+			p->nr = 0;
+
+			for (j = 0; j < nr; j++) {
+				struct perf_event_attr attr;
+				int fd;
+
+				memset(&attr, 0, sizeof(attr));
+				attr.type = type;
+				attr.config = info[j].config;
+				attr.size = sizeof(attr);
+				attr.read_format = PERF_FORMAT_GROUP;
+				attr.disabled = (p->group_fd < 0);
+
+				fd = syscall(__NR_perf_event_open, &attr, -1, cpu, p->group_fd, 0);
+				if (fd < 0)
+					continue;
+				if (p->group_fd < 0)
+					p->group_fd = fd;
+				p->event[p->nr] = info[j];
+				p->event[p->nr].fd = fd;
+				p->nr++;
+			}
+			if (p->group_fd < 0) {
+				(void)fprintf(stderr, "Cannot open perf power events on CPU %d, "
+					"errno=%d (%s).\n", cpu, errno, strerror(errno));
+				continue;
+			}
+			if (ioctl(p->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) < 0) {
+				for (j = 0; j < p->nr; j++)
+					(void)close(p->event[j].fd);
+				continue;
+			}
+			n++;
+		}
+	}
+	if (!n)
+		goto err;
+
+	return n;
+err:
+	perf_power_close(*power, n);
+	*power = NULL;
+	return -1;
+}
+
+/*
+ *  perf_power_read()
+ *	read the energy of all the events of a package with one
+ *	read() of the group, energy[i] is the energy of the i'th
+ *	event in Joules since the counters were opened
+ */
+int perf_power_read(perf_power_t *p, double *energy)
+{
+	/* perf group data, PERF_FORMAT_GROUP layout */
+	struct {
+		uint64_t nr;			/* number of counters */
+		uint64_t counter[PERF_POWER_EVENTS_MAX]; /* perf counters */
+	} group;
+	ssize_t ret;
+	int i;
+
+	ret = read(p->group_fd, &group, sizeof(group));
+	if (ret < (ssize_t)sizeof(uint64_t))
+		return -1;
+	/* All the events must be read, a short group would leave stale energies */
+	if ((group.nr != (uint64_t)p->nr) ||
+	    ((size_t)ret < sizeof(group.nr) + ((size_t)p->nr * sizeof(uint64_t))))
+		return -1;
+
+	for (i = 0; i < p->nr; i++)
+		energy[i] = (double)group.counter[i] * p->event[i].scale;
+
+	return 0;
+}
+
+/*
+ *  perf_power_close()
+ *	close perf power PMU events
+ */
+void perf_power_close(perf_power_t *power, const int n)
+{
+	int i, j;
+
+	if (!power)
+		return;
+
+	for (i = 0; i < n; i++) {
+		/* Close group members before the group leader */
+		for (j = power[i].nr - 1; j >= 0; j--)
+			(void)close(power[i].event[j].fd);
 	}
+	free(power);
 }
 
 #endif
@@ -36,32 +36,80 @@
 #define PERF_ENABLED
 #endif
 
-enum {
-	PERF_HW_CPU_CYCLES = 0,
-	PERF_HW_INSTRUCTIONS,
-        PERF_MAX
-};
+#define PERF_MAX_EVENTS		(16)	/* maximum perf events, -P option */
+#define PERF_EVENTS_DEFAULT	"cycles,instructions"
+
+/*
+ *  syscalls made per counter per sample by perf_start() + perf_stop(),
+ *  open, reset, enable, disable, read and close
+ */
+#define PERF_SYSCALLS_PER_COUNTER	(6)
 
 /* per perf counter info */
 typedef struct {
 	uint64_t counter;               /* perf counter */
 	int      fd;                    /* perf per counter fd */
+	void	 *page;			/* mmap'd perf page, persistent mode */
+	uint64_t last;			/* last raw count, persistent mode */
+	uint64_t last_enabled;		/* last time enabled, persistent mode */
+	uint64_t last_running;		/* last time running, persistent mode */
+	int	 group_idx;		/* index in group read, -1 = not grouped */
 } perf_stat_t;
 
 typedef struct {
-	perf_stat_t	perf_stat[PERF_MAX]; /* perf counters */
+	perf_stat_t	perf_stat[PERF_MAX_EVENTS]; /* perf counters */
 	int		perf_opened;	/* count of opened counters */
+	int		cpu;		/* CPU counters are bound to, -1 = any */
+	int		group_fd;	/* group leader fd, -1 = not grouped */
+	int		group_nr;	/* number of counters in the group */
+	uint64_t	rdpmc_reads;	/* counters read with rdpmc */
+	uint64_t	syscall_reads;	/* counters read with read() */
 } perf_t;
 
 /* used for table of perf events to gather */
 typedef struct {
-	int id;				/* stress-ng perf ID */
+	char name[32];			/* event name, as used by -P */
+	char label[8];			/* stats column label */
+	char unit[32];			/* unit for trend output */
+	char heading[32];		/* YAML heading */
+	char field[64];			/* YAML field */
 	unsigned long type;		/* perf types */
 	unsigned long config;		/* perf type specific config */
 } perf_info_t;
 
+#define PERF_POWER_PMU		"/sys/bus/event_source/devices/power"
+#define PERF_POWER_EVENTS_MAX	(8)	/* maximum perf power PMU events */
+
+/* perf power PMU energy event */
+typedef struct {
+	char	name[32];		/* event name, e.g. energy-pkg */
+	char	unit[16];		/* unit after scaling, normally Joules */
+	uint64_t config;		/* perf power PMU event config */
+	double	scale;			/* scale of the raw counter to unit */
+	int	fd;			/* perf event fd */
+	double	last_energy;		/* energy at last sample */
+	double	t_last;			/* time of last sample */
+} perf_power_event_t;
+
+/* perf power PMU energy events of one package */
+typedef struct {
+	int	cpu;			/* CPU the events are opened on */
+	int	group_fd;		/* group leader fd */
+	int	nr;			/* number of events opened */
+	perf_power_event_t event[PERF_POWER_EVENTS_MAX]; /* energy events */
+} perf_power_t;
+
 extern int perf_start(perf_t *p, const pid_t pid);
 extern int perf_stop(perf_t *p);
-extern void perf_counter(const perf_t *p, const int id, double *counter);
+extern void perf_counter(const perf_t *p, const int idx, double *counter);
+extern int perf_events_parse(const char *list);
+extern int perf_events_num(void);
+extern const perf_info_t *perf_event_info(const int idx);
+extern int perf_open(perf_t *p, const pid_t pid, const int cpu);
+extern int perf_read(perf_t *p);
+extern void perf_close(perf_t *p);
+extern int perf_power_open(perf_power_t **power);
+extern int perf_power_read(perf_power_t *p, double *energy);
+extern void perf_power_close(perf_power_t *power, const int n);
 
 #endif
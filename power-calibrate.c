@@ -42,6 +42,9 @@
 #include <getopt.h>
 #include <fcntl.h>
 #include <sched.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 
 #include <sys/ioctl.h>
 #include <sys/time.h>
@@ -49,6 +52,7 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/prctl.h>
 #include <sys/wait.h>
 #include <sys/utsname.h>
@@ -62,7 +66,6 @@
 #define START_DELAY_RAPL    	(0)	/* Delay to wait before sampling */
 #define	RATE_ZERO_LIMIT		(0.001)	/* Less than this is a 0 power rate */
 #define MAX_CPU_LOAD		(100)	/* Maximum CPU load */
-#define DEFAULT_TIMEOUT		(10)	/* Zero load sleep duration */
 #define CPU_ANY			(-1)
 
 #define DETECT_DISCHARGING	(1)
@@ -71,9 +74,24 @@
 #define OPT_PROGRESS		(0x00000002)
 #define OPT_CALIBRATE_EACH_CPU	(0x00000004)
 #define OPT_RAPL		(0x00000008)
+#define OPT_PERF_PERSIST	(0x00000010)
+#define OPT_PERF_CPU		(0x00000020)
+#define OPT_RAPL_MSR		(0x00000040)
+#define OPT_PERF_POWER		(0x00000080)
+#define OPT_FREQ_SWEEP		(0x00000100)
+#define OPT_IDLE		(0x00000200)
+#define OPT_SIMULATE		(0x00000400)
+
+#define OPT_LONG_FREQ_SWEEP	(256)	/* long only options */
+#define OPT_LONG_TURBO		(257)
+#define OPT_LONG_IDLE		(258)
+#define OPT_LONG_SYSROOT	(259)
+#define OPT_LONG_SIMULATE	(260)
+#define OPT_LONG_ANALYZE	(261)
 
 #define MAX_POWER_DOMAINS	(16)
 #define MAX_POWER_VALUES	(MAX_POWER_DOMAINS + 1)
+#define MAX_CSTATES		(16)	/* cpuidle states sampled per CPU */
 
 #define CPU_USER		(0)
 #define CPU_NICE		(1)
@@ -92,28 +110,128 @@
 #define PROC_EXEC		(14)
 #define PROC_EXIT		(15)
 #define BOGO_OPS		(16)
-#define CPU_CYCLES		(17)
-#define CPU_INSTRUCTIONS	(18)
-#define POWER_NOW		(19)
-#define POWER_DOMAIN_0          (20)
-#define MAX_VALUES		(POWER_DOMAIN_0 + MAX_POWER_VALUES)
+#define POWER_PEAK		(17)
+#define POWER_STDDEV		(18)
+#define PERF_EVENT_0		(19)
+#define POWER_NOW		(PERF_EVENT_0 + PERF_MAX_EVENTS)
+#define POWER_DOMAIN_0          (POWER_NOW + 1)
+#define CSTATE_TIME_0		(POWER_DOMAIN_0 + MAX_POWER_VALUES)
+#define CSTATE_USAGE_0		(CSTATE_TIME_0 + MAX_CSTATES)
+#define MAX_VALUES		(CSTATE_USAGE_0 + MAX_CSTATES)
+
+#define LOAD_POOL_TIMEOUT	(5.0)	/* seconds to wait for load workers */
+#define LOAD_PERIOD_MS		(10)	/* default PWM load period, -L */
+#define LOAD_PERIOD_MAX_MS	(100)	/* maximum PWM load period */
+#define LOAD_SPIN_OPS		(1000)	/* bogo ops between clock checks */
+
+#define TELEMETRY_IDLE		(0)	/* load worker telemetry states */
+#define TELEMETRY_LOAD		(1)
+#define TELEMETRY_CPU_LOOPS	(64)	/* load loops between CPU time updates */
+
+#define MEM_BUFFER_MIN		(32 * 1024 * 1024) /* minimum memory buffer per worker */
+#define MEM_LINE_SIZE		(64)	/* bytes in a memory bogo op */
+#define MEM_MAX_NODES		(1024)	/* maximum NUMA nodes for mbind */
+#define SYS_NODE_ONLINE		"/sys/devices/system/node/online"
+
+#define CHASE_L1		(1)	/* pointer chase cache levels */
+#define CHASE_L2		(2)
+#define CHASE_LLC		(3)
+#define CHASE_DRAM		(4)
+#define CHASE_L1_DEFAULT	(32 * 1024)	/* cache sizes if not in /sys */
+#define CHASE_L2_DEFAULT	(256 * 1024)
+#define CHASE_LLC_DEFAULT	(8 * 1024 * 1024)
+#define CHASE_DRAM_MIN		(64 * 1024 * 1024) /* minimum DRAM working set */
+#define SYS_CPU0_CACHE		"/sys/devices/system/cpu/cpu0/cache"
+
+#define CTXT_SPIN_OPS		(16)	/* context switch round trips between clock checks */
+#define CTXT_PAIR_CPU		(0)	/* context switch pair placement, -C */
+#define CTXT_PAIR_SMT		(1)
+#define CTXT_PAIR_PACKAGE	(2)
+#define CTXT_TURN_WORKER	(0)	/* context switch token owner */
+#define CTXT_TURN_PARTNER	(1)
+
+#define SYS_CPU_VULNERABILITIES	"/sys/devices/system/cpu/vulnerabilities"
+
+#define SYS_CPUFREQ		"/sys/devices/system/cpu/cpu%d/cpufreq/%s"
+#define SYS_CPUFREQ_BOOST	"/sys/devices/system/cpu/cpufreq/boost"
+#define SYS_INTEL_NO_TURBO	"/sys/devices/system/cpu/intel_pstate/no_turbo"
+#define FREQ_SWEEP_MAX		(64)	/* maximum frequencies in a sweep */
+#define FREQ_SWEEP_STEPS	(5)	/* frequencies if none are listed */
+
+#define SYS_CPUIDLE		"/sys/devices/system/cpu/cpu%d/cpuidle/state%d/%s"
+#define DEV_CPU_DMA_LATENCY	"/dev/cpu_dma_latency"
+
+#define SIM_IDLE_WATTS		(2.0)	/* simulator model defaults, --simulate */
+#define SIM_CPU_WATTS		(5.0)
+#define SIM_NOISE		(0.0)
+
+#define WAKEUP_RATE_MIN		(10.0)	/* timer wakeup rate sweep, Hz */
+#define WAKEUP_RATE_MAX		(100000.0)
+
+#define RATE_CTXT		(1)	/* event rates power is fitted against */
+#define RATE_WAKEUP		(2)
+#define RATE_SYSCALL		(3)
+
+#define WORKLOAD_VEC_LEN	(64)	/* floats in a vector kernel bogo op */
+#define VEC_FLOATS		(16)	/* floats in a vec_float_t */
+
+/* Vector kernel is built for each instruction set and picked at run time */
+#if defined(__GNUC__) && !defined(__clang__) && (__GNUC__ >= 6) && \
+    defined(__x86_64__) && defined(__linux__)
+#define WORKLOAD_CLONES
+#define WORKLOAD_TARGET_CLONES	\
+	__attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define WORKLOAD_TARGET_CLONES
+#endif
+
+#define SAMPLER_RING_SIZE	(65536)	/* energy samples, must be power of 2 */
+#define SAMPLER_MAX_MS		(10)	/* maximum energy sampler interval */
+
+#define TRACE_MAGIC		"PCTRACE"	/* -t trace file magic, with the nul */
+#define TRACE_VERSION		(2)
+#define TRACE_BUFFER_RECORDS	(64)	/* trace records buffered per write */
+
+#define ANALYZE_FOLDS		(10)	/* --analyze cross-validation folds */
+#define ANALYZE_THREADS_MAX	(64)	/* --analyze cross-validation threads */
+#define ESTIMATOR_LEAST_SQUARES	(0)	/* --analyze model estimators */
+#define ESTIMATOR_THEIL_SEN	(1)
+#define ESTIMATORS		(2)
+
+#define PROC_STAT_BUF_SIZE	(65536)	/* /proc/stat read buffer size */
+#define PROC_STAT_CPU		(0x01)
+#define PROC_STAT_INTR		(0x02)
+#define PROC_STAT_CTXT		(0x04)
+#define PROC_STAT_PROCS_RUN	(0x08)
+#define PROC_STAT_PROCS_BLK	(0x10)
+#define PROC_STAT_ALL		(0x1f)
+
+#define CPU_UTIL_USER		(0)	/* user + nice */
+#define CPU_UTIL_SYS		(1)	/* system + irq + softirq */
+#define CPU_UTIL_IDLE		(2)
+#define CPU_UTIL_IOWAIT		(3)
+#define CPU_UTIL_FIELDS		(4)
+#define CPU_UTIL_ACTIVE		(5.0)	/* % busy for a CPU to count as active */
+#define CPU_UTIL_STRAY		(10.0)	/* % busy on an unloaded CPU to report */
 
 #define MWC_SEED_Z		(362436069UL)
 #define MWC_SEED_W		(521288629UL)
 
+#define MSR_RAPL_POWER_UNIT	(0x606)
+#define MSR_PKG_ENERGY_STATUS	(0x611)
+#define MSR_DRAM_ENERGY_STATUS	(0x619)
+#define MSR_PP0_ENERGY_STATUS	(0x639)
+#define MSR_PP1_ENERGY_STATUS	(0x641)
+#define MSR_DRAM_ENERGY_UNIT_UJ	(1000000.0 / 65536.0) /* fixed server DRAM unit */
+#define PROC_CPUINFO		"/proc/cpuinfo"
+#define DEV_CPU_MSR		"/dev/cpu/%d/msr"
+
 #define SYS_CLASS_POWER_SUPPLY	"/sys/class/power_supply"
 #define PROC_ACPI_BATTERY	"/proc/acpi/battery"
 
 #define FLOAT_TINY		(0.0000001)
 #define FLOAT_CMP(a, b)		(fabs(a - b) < FLOAT_TINY)
 
-#define SYS_FIELD_VOLTAGE_NOW		"POWER_SUPPLY_VOLTAGE_NOW="
-#define SYS_FIELD_POWER_NOW		"POWER_SUPPLY_POWER_NOW="
-#define SYS_FIELD_ENERGY_NOW		"POWER_SUPPLY_ENERGY_NOW="
-#define SYS_FIELD_CURRENT_NOW		"POWER_SUPPLY_CURRENT_NOW="
-#define SYS_FIELD_CHARGE_NOW		"POWER_SUPPLY_CHARGE_NOW="
-#define SYS_FIELD_STATUS_DISCHARGING  	"POWER_SUPPLY_STATUS=Discharging"
-
 
 #if defined(__x86_64__) || defined(__x86_64) || \
     defined(__i386__) || defined(__i386)
@@ -126,6 +244,16 @@ typedef struct {
 	bool	inaccurate[MAX_VALUES];
 } stats_t;
 
+/* synthetic power source, --simulate */
+typedef struct {
+	double	idle_watts;		/* power with no CPUs busy */
+	double	cpu_watts;		/* power added per busy CPU */
+	double	noise;			/* relative standard deviation of noise */
+	double	busy_last;		/* busy ticks at last sample */
+	double	t_last;			/* time of last sample, 0 = none */
+	int	fd;			/* /proc/stat, kept open */
+} sim_t;
+
 /* x,y data pair, for trend analysis */
 typedef struct {
 	double	x;
@@ -136,11 +264,26 @@ typedef struct {
 	int	cpus_used;
 } value_t;
 
-/* Bogo operation stats */
+/* predictor for the multivariate power model */
+typedef struct {
+	const char *name;	/* predictor name for output */
+	const char *heading;	/* YAML heading */
+	const char *field;	/* YAML field */
+	const value_t *values;	/* x values, y is power */
+} predictor_t;
+
+/*
+ *  Per load worker telemetry, each in its own page and written only
+ *  by its worker, published with a seqlock, seq is odd while the
+ *  worker is updating it
+ */
 typedef struct {
-	double	ops;
-	uint8_t	padding[64];	/* Make ops not align on cache boundary */
-} bogo_ops_t;
+	uint32_t	seq;		/* seqlock sequence */
+	uint32_t	state;		/* TELEMETRY_* worker state */
+	uint64_t	ops;		/* bogo ops */
+	uint64_t	busy_ns;	/* worker CPU time */
+	uint64_t	loops;		/* load loop iterations */
+} telemetry_t __attribute__((aligned(64)));
 
 /* CPUs to use from -n option */
 typedef struct cpu_info {
@@ -148,6 +291,12 @@ typedef struct cpu_info {
 	int		cpu_id;	/* CPU number, 0 = first CPU */
 	pid_t		pid;
 	perf_t		perf;
+	uint64_t	freq_min;	/* saved scaling_min_freq, kHz */
+	uint64_t	freq_max;	/* saved scaling_max_freq, kHz, 0 = not saved */
+	uint64_t	freq_hw_max;	/* cpuinfo_max_freq, kHz */
+	int		cstate_time_fd[MAX_CSTATES];	/* cpuidle stateK/time */
+	int		cstate_usage_fd[MAX_CSTATES];	/* cpuidle stateK/usage */
+	int		cstate_disable[MAX_CSTATES];	/* saved stateK/disable, -1 = none */
 } cpu_info_t;
 
 /* CPU list */
@@ -166,15 +315,217 @@ typedef struct rapl_info {
 	double 		last_energy_uj;
 	double 		t_last;
 	bool 		is_package;
+	bool		is_dram;	/* DRAM domain */
+	int		fd;		/* energy_uj or MSR fd, -1 if not open */
+	int64_t		msr;		/* energy status MSR, -1 = powercap */
+	double		energy_unit_uj;	/* MSR energy unit in microjoules */
 } rapl_info_t;
 
-typedef void (*func)(
-	uint64_t param, const int instance, bogo_ops_t *bogo_ops);
+/* Battery power supply, attributes are kept open */
+typedef struct battery_info {
+	struct battery_info *next;
+	char		*name;		/* power supply name */
+	int		status_fd;	/* status attribute */
+	int		power_now_fd;	/* power_now attribute, -1 if not present */
+	int		current_now_fd;	/* current_now attribute, -1 if not present */
+	int		voltage_now_fd;	/* voltage_now attribute, -1 if not present */
+} battery_info_t;
+
+/* High rate energy sample */
+typedef struct {
+	double	t;			/* CLOCK_MONOTONIC time in seconds */
+	double	energy_uj;		/* unwrapped package energy */
+} energy_sample_t;
+
+/* High rate energy sampler, single producer single consumer ring */
+typedef struct {
+	energy_sample_t	ring[SAMPLER_RING_SIZE];
+	uint32_t	head __attribute__((aligned(64))); /* sampler writes */
+	uint32_t	tail __attribute__((aligned(64))); /* monitor writes */
+	uint64_t	overruns;	/* samples dropped, ring was full */
+	volatile bool	stop;		/* stop the sampler thread */
+	pthread_t	thread;		/* sampler thread */
+	int		cpu;		/* housekeeping CPU, -1 = not pinned */
+	long		interval_ns;	/* sampling interval */
+	rapl_info_t	*rapl_list;	/* RAPL domains to sample */
+	double		last_uj[MAX_POWER_DOMAINS]; /* last raw energy */
+	double		wrap_uj[MAX_POWER_DOMAINS]; /* energy wrap offsets */
+	energy_sample_t	last;		/* last drained sample */
+	bool		have_last;	/* last is valid */
+} sampler_t;
+
+/* Raw sample trace file header, -t option, the records follow it */
+typedef struct {
+	char		magic[8];	/* TRACE_MAGIC */
+	uint32_t	version;	/* TRACE_VERSION */
+	uint32_t	header_size;	/* size of this header */
+	uint32_t	record_size;	/* size of each record */
+	uint32_t	max_values;	/* MAX_VALUES columns in a record */
+	uint32_t	max_domains;	/* MAX_POWER_DOMAINS energies in a record */
+	int32_t		max_cpus;	/* CPUs in the system */
+	int32_t		num_cpus;	/* CPUs that are loaded */
+	int32_t		sample_delay;	/* seconds between samples */
+	int32_t		perf_events;	/* perf event columns in use */
+	int32_t		rate;		/* workload RATE_* event rate */
+	uint32_t	flags;		/* command options */
+	uint32_t	reserved;	/* keeps the records 8 byte aligned */
+	char		workload[32];	/* workload kernel name */
+	char		perf_event[PERF_MAX_EVENTS][32]; /* perf event names */
+} trace_header_t;
+
+/* Raw sample trace record, one per sample */
+typedef struct {
+	double		t_start;	/* CLOCK_MONOTONIC start of the sample */
+	double		t_end;		/* CLOCK_MONOTONIC end of the sample */
+	uint32_t	step;		/* test step, from 0 */
+	uint32_t	sample;		/* sample in the step, from 0 */
+	uint32_t	cpus;		/* CPUs loaded in the step */
+	uint32_t	inaccurate;	/* power reading is inaccurate */
+	uint32_t	freq_khz;	/* pinned CPU frequency, 0 = not pinned */
+	int32_t		cstate;		/* deepest cpuidle state, -1 = not limited */
+	double		load;		/* % CPU load, or wakeups/s for wakeup */
+	double		energy[MAX_POWER_DOMAINS]; /* raw energy counters, Joules, NAN if none */
+	double		counter[MAX_VALUES];	/* raw counters at the sample end */
+	double		value[MAX_VALUES];	/* sample statistics, as averaged */
+} trace_record_t;
+
+/* Buffered raw sample trace writer */
+typedef struct {
+	trace_record_t	buffer[TRACE_BUFFER_RECORDS]; /* records not yet written */
+	uint32_t	n;		/* records in the buffer */
+	uint32_t	steps;		/* test steps started */
+	uint32_t	cpus;		/* CPUs loaded in the current step */
+	uint64_t	load;		/* load parameter of the current step */
+	uint32_t	freq_khz;	/* pinned CPU frequency of the current step */
+	int32_t		cstate;		/* deepest cpuidle state of the current step */
+	double		t_last;		/* CLOCK_MONOTONIC time of the last sample */
+	int		fd;		/* trace file */
+} trace_t;
+
+/* Single variable power model refitted by --analyze */
+typedef struct {
+	const char *unit;		/* unit for trend output */
+	const char *each;		/* one unit for trend output */
+	const char *heading;		/* YAML heading */
+	const char *field;		/* YAML field */
+	bool	power;			/* gradient is power, not energy */
+	value_t	*values;		/* x values of each step, y is power */
+	bool	valid;			/* fit to all the steps worked */
+} model_t;
+
+/* Cross-validation fold of a model with an estimator */
+typedef struct {
+	const model_t *model;		/* model to fit */
+	int	estimator;		/* ESTIMATOR_* */
+	int	fold;			/* steps order[i], i % folds == fold, are held out */
+	int	folds;			/* number of folds */
+	int	n;			/* number of steps */
+	const int *order;		/* shuffled step indices */
+	double	sse;			/* held out sum of squared errors */
+	double	sae;			/* held out sum of absolute errors */
+	int	tested;			/* held out steps predicted */
+} fold_t;
+
+/* Cross-validation thread pool work queue */
+typedef struct {
+	fold_t		*folds;		/* folds to run */
+	uint32_t	n;		/* number of folds */
+	uint32_t	next;		/* next fold to run, atomic */
+} fold_queue_t;
+
+/* Per-CPU utilisation matrix, max_cpus rows of CPU_UTIL_FIELDS columns */
+typedef struct {
+	int32_t		max_cpus;	/* number of rows */
+	int		cur;		/* ticks[cur] is the latest read */
+	uint64_t	*ticks[2];	/* raw /proc/stat ticks, last two reads */
+	double		*util;		/* summed % utilisation per sample */
+	uint32_t	*samples;	/* samples summed in util per CPU */
+} cpu_util_t;
+
+/* Per load worker state, shared with the parent */
+typedef struct {
+	uint32_t	ack;		/* generation the idle worker has seen */
+	double		duty;		/* % CPU time over wall time of last load */
+	double		loop_rate;	/* load loops per second of last load */
+	uint8_t		*mem;		/* memory workload buffer, NULL if none */
+	int		node;		/* NUMA node mem is bound to */
+	int		partner;	/* context switch partner CPU */
+} load_slot_t;
+
+/* Load worker pool control block, shared with the workers */
+typedef struct {
+	uint32_t	generation __attribute__((aligned(64))); /* bumped on each load change */
+	uint32_t	active;		/* workers 0..active-1 run the load */
+	uint64_t	param;		/* load function parameter */
+	uint64_t	period_ns;	/* PWM load period */
+	volatile bool	quit;		/* workers exit */
+	uint32_t	workers;	/* number of workers */
+	size_t		size;		/* size of the mapping */
+	telemetry_t	*telemetry;	/* per worker telemetry pages */
+	load_slot_t	slot[];		/* per worker state */
+} load_pool_t;
+
+/* Workload kernel, -w option */
+typedef struct {
+	const char *name;		/* kernel name */
+	const char *bogo_op;		/* what one bogo op is */
+	uint64_t (*run)(const uint32_t n); /* run up to n bogo ops, returns ops run, NULL = own load */
+	uint32_t bytes;			/* memory bytes per bogo op, 0 = CPU only */
+	int	chase;			/* pointer chase CHASE_* level, 0 = none */
+	int	rate;			/* RATE_* event rate to fit, 0 = none */
+} workload_t;
+
+typedef float vec_float_t __attribute__((vector_size(VEC_FLOATS * sizeof(float))));
+
+typedef void (*func)(uint64_t param, telemetry_t *telemetry);
 
 static volatile bool stop_flag;			/* sighandler stop flag */
 static int32_t opt_flags;			/* command options */
 static char *app_name = "power-calibrate";	/* application name */
 static bool perf_enabled = false;		/* true if we can access perf */
+static int perf_events;				/* number of perf events read */
+static sampler_t *energy_sampler;		/* high rate energy sampler */
+static trace_t *trace;				/* raw sample trace, -t */
+static double energy_counter[MAX_POWER_DOMAINS];	/* raw energy counters, Joules */
+static const char *const estimator_names[ESTIMATORS] = {
+	"least-squares", "theil-sen"
+};
+static cpu_util_t *cpu_util;			/* per-CPU utilisation */
+static load_pool_t *load_pool;			/* load worker pool */
+static const workload_t *workload;		/* load kernel */
+static bool mem_remote;				/* memory workload on a remote node */
+static bool power_dram;				/* add DRAM domain to package power */
+static uint8_t *mem_buf;			/* memory workload buffer, in a worker */
+static size_t mem_size;				/* size of each memory buffer */
+static size_t mem_pos;				/* memory workload position */
+static void **chase_ptr;			/* pointer chase position */
+static int ctxt_pair = CTXT_PAIR_CPU;		/* context switch pair placement */
+static const char *const ctxt_pair_names[] = { "cpu", "smt", "package" };
+static int ctxt_cpu;				/* context switch partner CPU, in a worker */
+static uint32_t ctxt_turn;			/* context switch token, in a worker */
+static int zero_fd = -1;			/* /dev/zero for syscall kernel, workers inherit it */
+static uint32_t load_generation;		/* load generation, in a worker */
+static size_t telemetry_size;			/* size of a telemetry page */
+static int turbo_saved = -1;			/* turbo state to restore, -1 = none */
+static int cstate_count;			/* cpuidle states sampled */
+static char cstate_name[MAX_CSTATES][16];	/* cpuidle state names */
+static uint64_t cstate_latency[MAX_CSTATES];	/* cpuidle exit latencies, us */
+static bool cstate_truncated;			/* more than MAX_CSTATES states */
+static int cstate_qos_fd = -1;			/* PM QoS CPU latency request */
+static const char *sysroot = "";		/* --sysroot prefix for /proc and /sys */
+static sim_t sim = {				/* simulated power model */
+	SIM_IDLE_WATTS, SIM_CPU_WATTS, SIM_NOISE, 0.0, 0.0, -1
+};
+static battery_info_t *battery_list;		/* batteries in /sys */
+static bool battery_sys_fs;			/* /sys/class/power_supply exists */
+#if defined(PERF_ENABLED)
+static perf_power_t *perf_power;		/* perf power PMU packages */
+static int perf_power_packages;			/* number of packages */
+#endif
+static uint64_t perf_samples;			/* samples using persistent perf */
+static uint64_t perf_syscalls_legacy;		/* syscalls perf_start/stop would use */
+static uint64_t perf_syscalls_used;		/* syscalls persistent perf used */
+static uint64_t perf_rdpmc_reads;		/* counters read via rdpmc */
 
 /*
  *  Attempt to catch a range of signals so
@@ -229,11 +580,58 @@ static const int signals[] = {
 	-1,
 };
 
+/*
+ *  sys_path()
+ *	prefix a /proc or /sys path with the --sysroot directory,
+ *	the path is returned as is if there is no sysroot
+ */
+static const char *sys_path(const char *path, char *buf, const size_t len)
+{
+	if (!*sysroot)
+		return path;
+	(void)snprintf(buf, len, "%s%s", sysroot, path);
+	return buf;
+}
+
+/*
+ *  sys_open()
+ *	open a /proc or /sys file under the sysroot
+ */
+static int sys_open(const char *path, const int flags)
+{
+	char buf[PATH_MAX];
+
+	return open(sys_path(path, buf, sizeof(buf)), flags);
+}
+
+/*
+ *  sys_fopen()
+ *	fopen a /proc or /sys file under the sysroot
+ */
+static FILE *sys_fopen(const char *path, const char *mode)
+{
+	char buf[PATH_MAX];
+
+	return fopen(sys_path(path, buf, sizeof(buf)), mode);
+}
+
+/*
+ *  sys_opendir()
+ *	open a /proc or /sys directory under the sysroot
+ */
+static DIR *sys_opendir(const char *path)
+{
+	char buf[PATH_MAX];
+
+	return opendir(sys_path(path, buf, sizeof(buf)));
+}
+
 /*
  *  perf_possible()
- *	check if perf can be run
+ *	check if perf can be run, level is the perf_event_paranoid
+ *	setting that must not be reached for non-root users
  */
-static bool perf_possible(void)
+static bool perf_possible(const int paranoid)
 {
 #if defined(PERF_ENABLED)
 	static const char *path = "/proc/sys/kernel/perf_event_paranoid";
@@ -243,7 +641,7 @@ static bool perf_possible(void)
 	if (geteuid() == 0)
 		return true;
 
-	if ((fp = fopen(path, "r")) == NULL)
+	if ((fp = sys_fopen(path, "r")) == NULL)
 		return false;
 	if (fscanf(fp, "%5d", &level) < 1) {
 		(void)fclose(fp);
@@ -251,8 +649,9 @@ static bool perf_possible(void)
 	}
 	(void)fclose(fp);
 
-	return (level < 2);
+	return (level < paranoid);
 #else
+	(void)paranoid;
 	return false;
 #endif
 }
@@ -388,1573 +787,5756 @@ static int set_affinity(const int cpu)
 }
 
 /*
- *  stress_cpu()
- *	stress CPU
+ *  file_get()
+ *	read a line from a /sys file
  */
-static void stress_cpu(
-	const uint64_t cpu_load,
-	const int instance,
-	bogo_ops_t *bogo_ops)
+static char *file_get(const char *const file)
 {
-	/*
-	 * Normal use case, 100% load, simple spinning on CPU
-	 */
-	if (cpu_load == 100) {
-		uint64_t i;
+	FILE *fp;
+	char buffer[4096];
 
-		for (;;) {
-			for (i = 0; i < 1000000; i++) {
-#if __GNUC__
-				/* Stop optimising out */
-				__asm__ __volatile__("");
-#endif
-				(void)mwc();
-				if (stop_flag) {
-					bogo_ops[instance].ops += i;
-					goto finish;
-				}
-			}
-			bogo_ops[instance].ops += i;
-		}
-	} else if (cpu_load == 0) {
-		for (;;) {
-			(void)sleep(DEFAULT_TIMEOUT);
-			if (stop_flag)
-				goto finish;
-		}
-	} else {
-		/*
-		 * More complex percentage CPU utilisation.  This is
-		 * not intended to be 100% accurate timing, it is good
-		 * enough for most purposes.
-		 */
-		for (;;) {
-			uint64_t i;
-			double time_start, delay;
-			struct timeval tv;
+	if ((fp = sys_fopen(file, "r")) == NULL)
+		return NULL;
 
-			time_start = gettime_to_double();
-			for (i = 0; i < 1000000; i++) {
-#if __GNUC__
-				/* Stop optimising out */
-				__asm__ __volatile__("");
-#endif
-				(void)mwc();
-				if (stop_flag) {
-					bogo_ops[instance].ops += i;
-					exit(EXIT_SUCCESS);
-				}
-			}
-			bogo_ops[instance].ops += i;
-			delay = gettime_to_double() - time_start;
-			/* Must not calculate this with zero % load */
-			delay *= (((100.0 / (double) cpu_load)) - 1.0);
-			tv = double_to_timeval(delay);
-			(void)select(0, NULL, NULL, NULL, &tv);
-		}
+	if (fgets(buffer, sizeof(buffer), fp) == NULL) {
+		(void)fclose(fp);
+		return NULL;
 	}
-finish:
-	exit(EXIT_SUCCESS);
+	(void)fclose(fp);
+
+	return strdup(buffer);
 }
 
 /*
- *  stop_load()
- *	kill load child processes
+ *  workload_read()
+ *	memory read kernel, one bogo op reads one cache line
  */
-static void stop_load(cpu_list_t *cpu_list, const int total_procs)
+static uint64_t workload_read(const uint32_t n)
 {
-	int i;
-	cpu_info_t *c;
-
-	/* Kill.. */
-	for (c = cpu_list->head, i = 0; c && i < total_procs; c = c->next, i++) {
-		if (c->pid > -1)
-			(void)kill(c->pid, SIGKILL);
-	}
-	/* And ensure we don't get zombies */
-	for (c = cpu_list->head, i = 0; c && i < total_procs; c = c->next, i++) {
-		if (c->pid > -1) {
-			int status;
+	uint64_t sum = 0;
+	uint32_t i;
 
-			(void)waitpid(c->pid, &status, 0);
-		}
-		c->pid = -1;
+	for (i = 0; i < n; i++) {
+		const uint64_t *ptr = (const uint64_t *)(mem_buf + mem_pos);
+		size_t j;
+
+		for (j = 0; j < MEM_LINE_SIZE / sizeof(uint64_t); j++)
+			sum += ptr[j];
+		mem_pos += MEM_LINE_SIZE;
+		if (mem_pos >= mem_size)
+			mem_pos = 0;
 	}
+#if __GNUC__
+	/* Stop optimising out */
+	__asm__ __volatile__("" : : "r"(sum));
+#endif
+	return n;
 }
 
 /*
- *  start_load()
- *	load system with some stress processes
+ *  workload_write()
+ *	memory write kernel, one bogo op writes one cache line
  */
-static void start_load(
-	cpu_list_t *cpu_list,
-	const int total_procs,
-	const func load_func,
-	const uint64_t param,
-	bogo_ops_t *bogo_ops)
+static uint64_t workload_write(const uint32_t n)
 {
-	int i;
-	struct sigaction new_action;
-	cpu_info_t *c;
-
-	memset(&new_action, 0, sizeof(new_action));
-	for (i = 0; signals[i] != -1; i++) {
-		new_action.sa_handler = handle_sig;
-		(void)sigemptyset(&new_action.sa_mask);
-		new_action.sa_flags = SA_RESTART;
+	uint32_t i;
 
-		(void)sigaction(signals[i], &new_action, NULL);
+	for (i = 0; i < n; i++) {
+		uint64_t *ptr = (uint64_t *)(mem_buf + mem_pos);
+		size_t j;
+
+		for (j = 0; j < MEM_LINE_SIZE / sizeof(uint64_t); j++)
+			ptr[j] = mem_pos + j;
+		mem_pos += MEM_LINE_SIZE;
+		if (mem_pos >= mem_size)
+			mem_pos = 0;
 	}
+#if __GNUC__
+	/* Stop optimising out */
+	__asm__ __volatile__("" : : : "memory");
+#endif
+	return n;
+}
 
-	for (c = cpu_list->head, i = 0;
-		c && i < total_procs; c = c->next, i++) {
-		c->pid = fork();
+/*
+ *  workload_copy()
+ *	memory copy kernel, one bogo op copies one cache line from
+ *	the first half of the buffer to the second half
+ */
+static uint64_t workload_copy(const uint32_t n)
+{
+	const size_t half = mem_size / 2;
+	uint32_t i;
 
-		switch (c->pid) {
-		case -1:
-			(void)fprintf(stderr, "Cannot fork, errno=%d (%s)\n",
-				errno, strerror(errno));
-			stop_load(cpu_list, i);
-			exit(EXIT_FAILURE);
-		case 0:
-			/* Child */
-			if (set_affinity(c->cpu_id) < 0)
-				exit(0);
-			load_func(param, i, bogo_ops);
-			exit(0);
-		default:
-			break;
-		}
+	for (i = 0; i < n; i++) {
+		(void)memcpy(mem_buf + half + mem_pos, mem_buf + mem_pos,
+			MEM_LINE_SIZE);
+		mem_pos += MEM_LINE_SIZE;
+		if (mem_pos >= half)
+			mem_pos = 0;
 	}
+#if __GNUC__
+	/* Stop optimising out */
+	__asm__ __volatile__("" : : : "memory");
+#endif
+	return n;
 }
 
 /*
- *  file_get()
- *	read a line from a /sys file
+ *  workload_chase()
+ *	pointer chase kernel, one bogo op is one dependent load from
+ *	a random cyclic chain of cache lines built by mem_chase_init()
  */
-static char *file_get(const char *const file)
+static uint64_t workload_chase(const uint32_t n)
 {
-	FILE *fp;
-	char buffer[4096];
-
-	if ((fp = fopen(file, "r")) == NULL)
-		return NULL;
+	void **ptr = chase_ptr ? chase_ptr : (void **)mem_buf;
+	uint32_t i;
 
-	if (fgets(buffer, sizeof(buffer), fp) == NULL) {
-		(void)fclose(fp);
-		return NULL;
-	}
-	(void)fclose(fp);
+	for (i = 0; i < n; i++)
+		ptr = (void **)*ptr;
+	chase_ptr = ptr;
 
-	return strdup(buffer);
+	return n;
 }
 
 /*
- *  get_time()
- *	Gather current time in buffer
+ *  workload_int()
+ *	integer ALU kernel, one bogo op is one mwc() call
  */
-static void get_time(char *const buffer, const size_t buflen)
+static uint64_t workload_int(const uint32_t n)
 {
-	struct tm tm;
-	time_t now;
+	uint32_t i;
 
-	now = time(NULL);
-	if (now == ((time_t) -1)) {
-		(void)snprintf(buffer, buflen, "--:--:-- ");
-	} else {
-		(void)localtime_r(&now, &tm);
-		(void)snprintf(buffer, buflen, "%2.2d:%2.2d:%2.2d ",
-			tm.tm_hour, tm.tm_min, tm.tm_sec);
+	for (i = 0; i < n; i++) {
+#if __GNUC__
+		/* Stop optimising out */
+		__asm__ __volatile__("");
+#endif
+		(void)mwc();
 	}
+	return n;
 }
 
 /*
- *  stats_clear()
- *	clear stats
+ *  workload_fp()
+ *	scalar double precision kernel, one bogo op is four
+ *	independent multiply-adds
  */
-static void stats_clear(stats_t *const stats)
+static uint64_t workload_fp(const uint32_t n)
 {
-	int i;
+	static double a = 1.0, b = 2.0, c = 3.0, d = 4.0;
+	uint32_t i;
 
-	for (i = 0; i < MAX_VALUES; i++) {
-		stats->value[i] = 0.0;
-		stats->inaccurate[i] = false;
+	for (i = 0; i < n; i++) {
+		a = (a * 0.999999) + 0.000001;
+		b = (b * 0.999998) + 0.000002;
+		c = (c * 0.999997) + 0.000003;
+		d = (d * 0.999996) + 0.000004;
+		/* Stop optimising out, keep the values in SSE registers on x86 */
+#if defined(__GNUC__) && defined(__SSE2__)
+		__asm__ __volatile__("" : "+x"(a), "+x"(b), "+x"(c), "+x"(d));
+#elif defined(__GNUC__)
+		__asm__ __volatile__("" : "+m"(a), "+m"(b), "+m"(c), "+m"(d));
+#endif
 	}
+	return n;
 }
 
 /*
- *  stats_clear_all()
- *	zero stats data
+ *  workload_vector()
+ *	vector single precision kernel, one bogo op is y = y * a + x
+ *	over WORKLOAD_VEC_LEN floats using GCC vector extensions, which
+ *	are specialised at build time for each instruction set
  */
-static void stats_clear_all(stats_t *const stats, const int n)
+WORKLOAD_TARGET_CLONES
+static uint64_t workload_vector(const uint32_t n)
 {
-	int i;
-
-	for (i = 0; i < n; i++)
-		stats_clear(&stats[i]);
+	static vec_float_t x[WORKLOAD_VEC_LEN / VEC_FLOATS];
+	static vec_float_t y[WORKLOAD_VEC_LEN / VEC_FLOATS];
+	static bool init;
+	uint32_t i;
+	size_t j;
+
+	/* x is never zero, so y does not decay into slow denormals */
+	if (!init) {
+		for (j = 0; j < WORKLOAD_VEC_LEN / VEC_FLOATS; j++) {
+			size_t k;
+
+			for (k = 0; k < VEC_FLOATS; k++) {
+				x[j][k] = 0.001f * (float)(k + 1);
+				y[j][k] = (float)j;
+			}
+		}
+		init = true;
+	}
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < WORKLOAD_VEC_LEN / VEC_FLOATS; j++)
+			y[j] = (y[j] * 0.999f) + x[j];
+#if __GNUC__
+		/* Stop optimising out */
+		__asm__ __volatile__("" : : "r"(y) : "memory");
+#endif
+	}
+	return n;
 }
 
+/*
+ *  workload_mixed()
+ *	mixed kernel, one bogo op is one integer, one scalar
+ *	floating point and one vector bogo op
+ */
+static uint64_t workload_mixed(const uint32_t n)
+{
+	(void)workload_int(n);
+	(void)workload_fp(n);
+	(void)workload_vector(n);
+	return n;
+}
 
 /*
- *  stats_read()
- *	gather pertinent /proc/stat data
+ *  ctxt_futex_wait()
+ *	wait while the context switch token is still owned by turn
  */
-static int stats_read(
-	const int32_t num_cpus,
-	stats_t *const stats,
-	bogo_ops_t *bogo_ops)
+static inline void ctxt_futex_wait(const uint32_t turn)
 {
-	FILE *fp;
-	char buf[4096];
-	int i, j;
+	(void)syscall(SYS_futex, &ctxt_turn, FUTEX_WAIT_PRIVATE,
+		turn, NULL, NULL, 0);
+}
 
-	static const int indices[] = {
-		CPU_USER, CPU_NICE, CPU_SYS, CPU_IDLE,
-		CPU_IOWAIT, CPU_IRQ, CPU_SOFTIRQ, CPU_CTXT,
-		CPU_INTR, CPU_PROCS_RUN, CPU_PROCS_BLK, -1
-	};
+/*
+ *  ctxt_futex_wake()
+ *	wake the other thread of the context switch pair
+ */
+static inline void ctxt_futex_wake(void)
+{
+	(void)syscall(SYS_futex, &ctxt_turn, FUTEX_WAKE_PRIVATE,
+		1, NULL, NULL, 0);
+}
 
-	for (i = 0; (j = indices[i]) != -1; i++) {
-		stats->value[j] = 0.0;
-		stats->inaccurate[j] = true;
-	}
+/*
+ *  ctxt_partner()
+ *	context switch partner thread, pinned to the partner CPU,
+ *	hands the token straight back each time it is woken
+ */
+static void *ctxt_partner(void *arg)
+{
+	(void)arg;
 
-	if ((fp = fopen("/proc/stat", "r")) == NULL) {
-		(void)fprintf(stderr, "Cannot read /proc/stat, errno=%d (%s).\n",
-			errno, strerror(errno));
-		return -1;
+	if (set_affinity(ctxt_cpu) < 0)
+		return NULL;
+	for (;;) {
+		while (__atomic_load_n(&ctxt_turn, __ATOMIC_ACQUIRE) != CTXT_TURN_PARTNER)
+			ctxt_futex_wait(CTXT_TURN_WORKER);
+		__atomic_store_n(&ctxt_turn, CTXT_TURN_WORKER, __ATOMIC_RELEASE);
+		ctxt_futex_wake();
 	}
+	return NULL;
+}
 
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
-		if (strncmp(buf, "cpu ", 4) == 0)
-			if (sscanf(buf, "%*s %15lf %15lf %15lf %15lf %15lf %15lf %15lf",
-			    &(stats->value[CPU_USER]),
-			    &(stats->value[CPU_NICE]),
-			    &(stats->value[CPU_SYS]),
-			    &(stats->value[CPU_IDLE]),
-			    &(stats->value[CPU_IOWAIT]),
-			    &(stats->value[CPU_IRQ]),
-			    &(stats->value[CPU_SOFTIRQ])) == 7) {
-				stats->inaccurate[CPU_USER] = false;
-				stats->inaccurate[CPU_NICE] = false;
-				stats->inaccurate[CPU_SYS] = false;
-				stats->inaccurate[CPU_IDLE] = false;
-				stats->inaccurate[CPU_IOWAIT] = false;
-				stats->inaccurate[CPU_IRQ] = false;
-				stats->inaccurate[CPU_SOFTIRQ] = false;
-			}
-		if (strncmp(buf, "ctxt ", 5) == 0)
-			if (sscanf(buf, "%*s %15lf", &(stats->value[CPU_CTXT])) == 1)
-				stats->inaccurate[CPU_CTXT] = false;
-		if (strncmp(buf, "intr ", 5) == 0)
-			if (sscanf(buf, "%*s %15lf", &(stats->value[CPU_INTR])) == 1)
-				stats->inaccurate[CPU_INTR] = false;
-		if (strncmp(buf, "procs_running ", 14) == 0)
-			if (sscanf(buf, "%*s %15lf",
-				   &(stats->value[CPU_PROCS_RUN])) == 1)
-				stats->inaccurate[CPU_PROCS_RUN] = false;
-		if (strncmp(buf, "procs_blocked ", 14) == 0)
-			if (sscanf(buf, "%*s %15lf",
-				   &(stats->value[CPU_PROCS_BLK])) == 1)
-				stats->inaccurate[CPU_PROCS_BLK] = false;
+/*
+ *  workload_ctxt()
+ *	context switch kernel, one bogo op is a futex ping-pong round
+ *	trip with the partner thread, two context switches. The partner
+ *	is started on first use and only runs up to CTXT_SPIN_OPS round
+ *	trips per call so partial loads keep their duty cycle.
+ */
+static uint64_t workload_ctxt(const uint32_t n)
+{
+	static bool started, failed;
+	uint32_t i;
+
+	if (!started) {
+		pthread_t thread;
+		int ret;
+
+		if (failed)
+			return 0;
+		ret = pthread_create(&thread, NULL, ctxt_partner, NULL);
+		if (ret) {
+			(void)fprintf(stderr, "Cannot create context switch partner "
+				"thread, errno=%d (%s).\n", ret, strerror(ret));
+			failed = true;
+			return 0;
+		}
+		(void)pthread_detach(thread);
+		started = true;
 	}
-	(void)fclose(fp);
 
-	stats->value[BOGO_OPS] = 0;
-	stats->inaccurate[BOGO_OPS] = false;
-	for (i = 0; i < num_cpus; i++) {
-		stats->value[BOGO_OPS] += bogo_ops[i].ops;
+	for (i = 0; (i < n) && (i < CTXT_SPIN_OPS); i++) {
+		__atomic_store_n(&ctxt_turn, CTXT_TURN_PARTNER, __ATOMIC_RELEASE);
+		ctxt_futex_wake();
+		while (__atomic_load_n(&ctxt_turn, __ATOMIC_ACQUIRE) != CTXT_TURN_WORKER)
+			ctxt_futex_wait(CTXT_TURN_PARTNER);
 	}
-
-	return 0;
+	return i;
 }
 
 /*
- *  stats_sane()
- *	check if stats are accurate and calculate a
- *	sane -ve delta
+ *  workload_syscall()
+ *	system call kernel, one bogo op is one cheap system call, in
+ *	turn getppid(), clock_gettime() bypassing the vDSO and an 8 byte
+ *	read of /dev/zero
  */
-static double stats_sane(
-	const stats_t *const s1,
-	const stats_t *const s2,
-	const int index)
+static uint64_t workload_syscall(const uint32_t n)
 {
-	double ret;
+	uint32_t i;
 
-	/* Discard inaccurate or empty stats */
-	if (s1->inaccurate[index] || s2->inaccurate[index])
-		return 0.0;
+	for (i = 0; i < n; i++) {
+		struct timespec ts;
+		uint64_t val;
 
-	/*
-	 *  On Nexus 4 we occasionally get idle time going backwards so
-	 *  work around this by ensuring we don't get -ve deltas.
-	 */
-	ret = s2->value[index] - s1->value[index];
-	return ret < 0.0 ? 0.0 : ret;
-}
+		switch (i % 3) {
+		case 0:
+			(void)getppid();
+			break;
+		case 1:
+			(void)syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+			break;
+		default:
+			(void)read(zero_fd, &val, sizeof(val));
+			break;
+		}
+	}
+	return n;
+}
 
-#define INACCURATE(s1, s2, index)       \
-	(s1->inaccurate[index] | s2->inaccurate[index])
+/*
+ *  workload_vector_isa()
+ *	instruction set the vector kernel runs with
+ */
+static const char *workload_vector_isa(void)
+{
+#if defined(WORKLOAD_CLONES)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return "AVX-512";
+	if (__builtin_cpu_supports("avx2"))
+		return "AVX2";
+	return "SSE2";
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+	return "NEON";
+#else
+	return "generic";
+#endif
+}
+
+/* Workload kernels, -w option */
+static const workload_t workloads[] = {
+	{ "int",	"one multiply-with-carry random number",	workload_int,	0, 0, 0 },
+	{ "fp",		"four double precision multiply-adds",		workload_fp,	0, 0, 0 },
+	{ "vector",	"a single precision multiply-add over 64 floats", workload_vector, 0, 0, 0 },
+	{ "mixed",	"one int, one fp and one vector bogo op",	workload_mixed,	0, 0, 0 },
+	{ "read",	"a 64 byte cache line read from memory",	workload_read,	MEM_LINE_SIZE, 0, 0 },
+	{ "write",	"a 64 byte cache line written to memory",	workload_write,	MEM_LINE_SIZE, 0, 0 },
+	{ "copy",	"a 64 byte cache line copied in memory",	workload_copy,	2 * MEM_LINE_SIZE, 0, 0 },
+	{ "chase-l1",	"one dependent load from the L1 cache",		workload_chase,	0, CHASE_L1, 0 },
+	{ "chase-l2",	"one dependent load from the L2 cache",		workload_chase,	0, CHASE_L2, 0 },
+	{ "chase-llc",	"one dependent load from the last level cache",	workload_chase,	0, CHASE_LLC, 0 },
+	{ "chase-dram",	"one dependent load from DRAM",			workload_chase,	0, CHASE_DRAM, 0 },
+	{ "ctxt",	"a futex ping-pong round trip, two context switches", workload_ctxt, 0, 0, RATE_CTXT },
+	{ "wakeup",	"one timerfd wakeup doing no work",		NULL,		0, 0, RATE_WAKEUP },
+	{ "syscall",	"one getppid, clock_gettime or /dev/zero read system call", workload_syscall, 0, 0, RATE_SYSCALL },
+};
+
+/* Event rates from /proc/stat the power is fitted against, RATE_* */
+static const struct {
+	int	stat;			/* stats_t value */
+	const char *unit;		/* unit for trend output */
+	const char *each;		/* one unit for trend output */
+	const char *heading;		/* YAML heading */
+	const char *field;		/* YAML field */
+} rates[] = {
+	{ 0, NULL, NULL, NULL, NULL },
+	{ CPU_CTXT, "context switches/s", "1 context switch/s",
+	  "context-switch", "watts-per-context-switch-per-second" },
+	{ CPU_INTR, "interrupts/s", "1 interrupt/s",
+	  "interrupt", "watts-per-interrupt-per-second" },
+	{ CPU_SYS, "% sys load", "1% sys load",
+	  "sys-load", "one-percent-sys-load-watts" },
+};
 
 /*
- *  stats_gather()
- *	gather up delta between last stats and current to get
- * 	some form of per sample accounting calculated.
+ *  workload_find()
+ *	find a workload kernel by name
  */
-static bool stats_gather(
-	cpu_list_t *cpu_list,
-	const uint32_t sample_delay,
-	const stats_t *const s1,
-	const stats_t *const s2,
-	stats_t *const res)
+static const workload_t *workload_find(const char *name)
 {
-	double total;
-	int i, j;
-	bool inaccurate = false;
+	size_t i;
 
-	static const int indices[] = {
-		CPU_USER, CPU_NICE, CPU_SYS, CPU_IDLE,
-		CPU_IOWAIT, -1
-	};
+	for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		if (!strcmp(workloads[i].name, name))
+			return &workloads[i];
+	}
+	return NULL;
+}
 
-	res->value[CPU_USER]    = stats_sane(s1, s2, CPU_USER);
-	res->value[CPU_NICE]    = stats_sane(s1, s2, CPU_NICE);
-	res->value[CPU_SYS]     = stats_sane(s1, s2, CPU_SYS);
-	res->value[CPU_IDLE]    = stats_sane(s1, s2, CPU_IDLE);
-	res->value[CPU_IOWAIT]  = stats_sane(s1, s2, CPU_IOWAIT);
-	res->value[CPU_IRQ]     = stats_sane(s1, s2, CPU_IRQ);
-	res->value[CPU_SOFTIRQ] = stats_sane(s1, s2, CPU_SOFTIRQ);
-	res->value[CPU_CTXT]	= stats_sane(s1, s2, CPU_CTXT);
-	res->value[CPU_INTR]	= stats_sane(s1, s2, CPU_INTR);
-	res->value[BOGO_OPS]	= stats_sane(s1, s2, BOGO_OPS);
+/*
+ *  gettime_ns()
+ *	get time from a clock in nanoseconds
+ */
+static inline uint64_t gettime_ns(const clockid_t clock_id)
+{
+	struct timespec ts;
 
-	res->value[CPU_CYCLES]  = 0.0;
-	res->inaccurate[CPU_CYCLES] = false;
-	res->value[CPU_INSTRUCTIONS]  = 0.0;
-	res->inaccurate[CPU_INSTRUCTIONS] = false;
+	(void)clock_gettime(clock_id, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
 
-#if defined(PERF_ENABLED)
-	if (perf_enabled) {
-		cpu_info_t *c;
+/*
+ *  load_futex_wait()
+ *	wait until the load generation changes from gen
+ */
+static inline void load_futex_wait(const uint32_t gen)
+{
+	(void)syscall(SYS_futex, &load_pool->generation, FUTEX_WAIT,
+		gen, NULL, NULL, 0);
+}
 
-		for (c = cpu_list->head; c; c = c->next) {
-			double value;
+/*
+ *  load_futex_wake()
+ *	wake all the workers waiting on the load generation
+ */
+static inline void load_futex_wake(void)
+{
+	(void)syscall(SYS_futex, &load_pool->generation, FUTEX_WAKE,
+		INT_MAX, NULL, NULL, 0);
+}
 
-			perf_counter(&c->perf, PERF_HW_CPU_CYCLES, &value);
-			if (value > 0.0)
-				res->value[CPU_CYCLES] += value;
-			perf_counter(&c->perf, PERF_HW_INSTRUCTIONS, &value);
-			if (value > 0.0)
-				res->value[CPU_INSTRUCTIONS] += value;
-		}
-	}
-#else
-	(void)cpu_list;
-#endif
+/*
+ *  load_stop()
+ *	true if a load function should return, the load has
+ *	been changed or we have been signalled to stop
+ */
+static inline bool load_stop(void)
+{
+	return stop_flag ||
+		(__atomic_load_n(&load_pool->generation, __ATOMIC_ACQUIRE) !=
+		 load_generation);
+}
 
-	for (i = 0; (j = indices[i]) != -1; i++)
-		inaccurate |= (s1->inaccurate[j] | s2->inaccurate[j]);
+/*
+ *  telemetry_get()
+ *	telemetry page of a load worker
+ */
+static inline telemetry_t *telemetry_get(telemetry_t *telemetry, const uint32_t instance)
+{
+	return (telemetry_t *)((uint8_t *)telemetry + (instance * telemetry_size));
+}
 
-	total = res->value[CPU_USER] + res->value[CPU_NICE] +
-		res->value[CPU_SYS] + res->value[CPU_IDLE] +
-		res->value[CPU_IOWAIT];
+/*
+ *  telemetry_publish()
+ *	add ops and a loop iteration to the telemetry of this worker,
+ *	the CPU time is read every TELEMETRY_CPU_LOOPS loops or when
+ *	the state changes, state is the new TELEMETRY_* state
+ */
+static inline void telemetry_publish(
+	telemetry_t *t,
+	const uint64_t ops,
+	const uint32_t state)
+{
+	const uint32_t seq = t->seq;
+	const uint64_t loops = t->loops + (ops ? 1 : 0);
+
+	__atomic_store_n(&t->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&t->ops, t->ops + ops, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->loops, loops, __ATOMIC_RELAXED);
+	if ((state != t->state) || !(loops % TELEMETRY_CPU_LOOPS))
+		__atomic_store_n(&t->busy_ns,
+			gettime_ns(CLOCK_PROCESS_CPUTIME_ID), __ATOMIC_RELAXED);
+	__atomic_store_n(&t->state, state, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->seq, seq + 2, __ATOMIC_RELEASE);
+}
 
+/*
+ *  telemetry_read()
+ *	read a consistent snapshot of the telemetry of a worker
+ */
+static void telemetry_read(const telemetry_t *t, telemetry_t *snapshot)
+{
+	uint32_t seq;
+
+	do {
+		/* The worker may be preempted on our CPU mid update */
+		while ((seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE)) & 1)
+			(void)sched_yield();
+		snapshot->state = __atomic_load_n(&t->state, __ATOMIC_RELAXED);
+		snapshot->ops = __atomic_load_n(&t->ops, __ATOMIC_RELAXED);
+		snapshot->busy_ns = __atomic_load_n(&t->busy_ns, __ATOMIC_RELAXED);
+		snapshot->loops = __atomic_load_n(&t->loops, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&t->seq, __ATOMIC_RELAXED) != seq);
+	snapshot->seq = seq;
+}
+
+/*
+ *  stress_cpu()
+ *	stress CPU until the load is changed
+ */
+static void stress_cpu(const uint64_t cpu_load, telemetry_t *telemetry)
+{
 	/*
-	 * This should not happen, but we need to avoid division
-	 * by zero or weird results if the data is deemed valid
+	 * Normal use case, 100% load, simple spinning on CPU
 	 */
-	if (!inaccurate && total <= 0.0)
-		return false;
+	if (cpu_load == 100) {
+		do {
+			telemetry_publish(telemetry,
+				workload->run(LOAD_SPIN_OPS), TELEMETRY_LOAD);
+		} while (!load_stop());
+	} else if (cpu_load == 0) {
+		while (!load_stop())
+			load_futex_wait(load_generation);
+	} else {
+		/*
+		 * Partial load, pulse width modulated over a fixed period.
+		 * The clock is checked while busy and the idle part of each
+		 * period sleeps to an absolute deadline, so the duty cycle
+		 * does not drift with CPU speed or oversleeping. The busy
+		 * part is timed from the start of the period, so a late
+		 * wakeup shortens it rather than adding to it.
+		 */
+		const uint64_t period_ns = load_pool->period_ns;
+		const uint64_t busy_ns = (period_ns * cpu_load) / 100;
+		uint64_t start = gettime_ns(CLOCK_MONOTONIC);
+		uint64_t now = start;
 
-	for (i = 0; (j = indices[i]) != -1; i++) {
-		res->value[j] = (INACCURATE(s1, s2, j) || (total <= 0.0)) ?
-		NAN : (100.0 * res->value[j]) / total;
+		for (;;) {
+			const uint64_t busy_end = start + busy_ns;
+			struct timespec ts;
+
+			do {
+				telemetry_publish(telemetry,
+					workload->run(LOAD_SPIN_OPS), TELEMETRY_LOAD);
+				if (load_stop())
+					return;
+				now = gettime_ns(CLOCK_MONOTONIC);
+			} while (now < busy_end);
+
+			start += period_ns;
+			/* Overran a whole period, restart from now */
+			if (now > start)
+				start = now;
+			ts.tv_sec = (time_t)(start / 1000000000ULL);
+			ts.tv_nsec = (long)(start % 1000000000ULL);
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &ts, NULL) == EINTR) {
+				if (load_stop())
+					return;
+			}
+			if (load_stop())
+				return;
+		}
 	}
-	res->value[CPU_CTXT] = (INACCURATE(s1, s2, CPU_CTXT) ||
-				(sample_delay <= 0.0)) ?
-		NAN : res->value[CPU_CTXT] / sample_delay;
-	res->value[CPU_INTR] = (INACCURATE(s1, s2, CPU_INTR) ||
-				(sample_delay <= 0.0)) ?
-		NAN : res->value[CPU_INTR] / sample_delay;
-	res->value[BOGO_OPS] = (INACCURATE(s1, s2, BOGO_OPS) ||
-				(sample_delay <= 0.0)) ?
-		NAN : res->value[BOGO_OPS] / sample_delay;
-	res->value[CPU_PROCS_RUN] = s2->inaccurate[CPU_PROCS_RUN] ?
-		NAN : s2->value[CPU_PROCS_RUN];
-	res->value[CPU_PROCS_BLK] = s2->inaccurate[CPU_PROCS_BLK] ?
-		NAN : s2->value[CPU_PROCS_BLK];
+}
 
-	return true;
+/*
+ *  wakeup_rate()
+ *	timer wakeup rate for a load level, swept logarithmically from
+ *	WAKEUP_RATE_MIN at just over 0% to WAKEUP_RATE_MAX at 100%
+ */
+static uint64_t wakeup_rate(const int cpu_load)
+{
+	if (cpu_load <= 0)
+		return 0;
+	return (uint64_t)((WAKEUP_RATE_MIN *
+		pow(WAKEUP_RATE_MAX / WAKEUP_RATE_MIN, cpu_load / 100.0)) + 0.5);
 }
 
 /*
- *  stats_headings()
- *	dump heading columns
+ *  stress_wakeup()
+ *	wake up from a periodic timerfd at rate Hz until the load is
+ *	changed, nothing else is done so the cost is just the timer
+ *	interrupt and idle state exit. One bogo op is one completed
+ *	wakeup, expirations that were missed while the worker was
+ *	running did not wake the CPU and are not counted.
  */
-static void stats_headings(const char *test)
+static void stress_wakeup(const uint64_t rate, telemetry_t *telemetry)
 {
-#if defined(PERF_ENABLED)
-	if (perf_enabled) {
-		(void)printf("%10.10s  User   Sys  Idle  Run  Ctxt/s  IRQ/s  Ops/s "
-			"Cycl/s Inst/s Watts\n", test);
-	} else
-#endif
-	{
-		(void)printf("%10.10s  User   Sys  Idle  Run  Ctxt/s  IRQ/s  Ops/s "
-			" Watts\n", test);
+	struct itimerspec its;
+	uint64_t interval_ns;
+	int fd = -1;
+
+	if (rate) {
+		interval_ns = 1000000000ULL / rate;
+		its.it_interval.tv_sec = (time_t)(interval_ns / 1000000000ULL);
+		its.it_interval.tv_nsec = (long)(interval_ns % 1000000000ULL);
+		its.it_value = its.it_interval;
+
+		fd = timerfd_create(CLOCK_MONOTONIC, 0);
+		if (fd < 0) {
+			(void)fprintf(stderr, "timerfd_create failed, errno=%d (%s).\n",
+				errno, strerror(errno));
+		} else if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+			(void)fprintf(stderr, "timerfd_settime failed, errno=%d (%s).\n",
+				errno, strerror(errno));
+			(void)close(fd);
+			fd = -1;
+		}
+	}
+	if (fd < 0) {
+		while (!load_stop())
+			load_futex_wait(load_generation);
+		return;
 	}
+
+	do {
+		uint64_t expirations;
+
+		/* One wakeup however many expirations it collected */
+		if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+			telemetry_publish(telemetry, 1, TELEMETRY_LOAD);
+	} while (!load_stop());
+	(void)close(fd);
 }
 
 /*
- *  stats_print()
- *	print out statistics with accuracy depending if it's a summary or not
+ *  show_mitigations()
+ *	show the CPU vulnerability mitigations, such as KPTI, that add
+ *	to the cost of entering the kernel, to stdout or as YAML
  */
-static void stats_print(
-	const char *const prefix,
-	const bool summary,
-	const stats_t *const s)
+static void show_mitigations(FILE *yaml)
 {
-	char buf[10], bogo_ops[10];
-	char *fmt;
-
-	if (summary) {
-		if (s->inaccurate[POWER_NOW])
-			(void)snprintf(buf, sizeof(buf), "-N/A-");
-		else
-			(void)snprintf(buf, sizeof(buf), "%6.3f", s->value[POWER_NOW]);
-	} else {
-		(void)snprintf(buf, sizeof(buf), "%6.3f%s", s->value[POWER_NOW],
-			s->inaccurate[POWER_NOW] ? "E" : "");
+	struct dirent **namelist;
+	char root_path[PATH_MAX];
+	int i, n;
+
+	n = scandir(sys_path(SYS_CPU_VULNERABILITIES, root_path, sizeof(root_path)),
+		&namelist, NULL, alphasort);
+	if (n < 0) {
+		if (!yaml)
+			(void)printf("CPU vulnerability mitigations are not known\n");
+		return;
 	}
-
-	value_to_str(s->value[BOGO_OPS], s->inaccurate[BOGO_OPS],
-		bogo_ops, sizeof(bogo_ops));
-	if (perf_enabled) {
-		char cpu_cycles[10], cpu_instr[10];
-
-		value_to_str(s->value[CPU_CYCLES], s->inaccurate[CPU_CYCLES],
-			cpu_cycles, sizeof(cpu_cycles));
-		value_to_str(s->value[CPU_INSTRUCTIONS], s->inaccurate[CPU_INSTRUCTIONS],
-			cpu_instr, sizeof(cpu_instr));
-		fmt = summary ?
-			"%10.10s %5.1f %5.1f %5.1f %4.1f %7.1f %6.1f %6s %6s %6s %s\n" :
-			"%10.10s %5.1f %5.1f %5.1f %4.0f %7.0f %6.0f %6s %6s %6s %s\n";
-		(void)printf(fmt,
-			prefix,
-			s->value[CPU_USER], s->value[CPU_SYS], s->value[CPU_IDLE],
-			s->value[CPU_PROCS_RUN], s->value[CPU_CTXT],
-			s->value[CPU_INTR], bogo_ops, cpu_cycles, cpu_instr, buf);
-	} else {
-		fmt = summary ?
-			"%10.10s %5.1f %5.1f %5.1f %4.1f %7.1f %6.1f %6s %s\n" :
-			"%10.10s %5.1f %5.1f %5.1f %4.0f %7.0f %6.0f %6s %s\n";
-		(void)printf(fmt,
-			prefix,
-			s->value[CPU_USER], s->value[CPU_SYS], s->value[CPU_IDLE],
-			s->value[CPU_PROCS_RUN], s->value[CPU_CTXT],
-			s->value[CPU_INTR], bogo_ops, buf);
+	if (yaml)
+		(void)fprintf(yaml, "    mitigations:\n");
+	else
+		(void)printf("CPU vulnerability mitigations:\n");
+	for (i = 0; i < n; i++) {
+		char path[PATH_MAX], *data, *ptr;
+
+		if (namelist[i]->d_name[0] == '.')
+			goto next;
+		(void)snprintf(path, sizeof(path), "%s/%s",
+			SYS_CPU_VULNERABILITIES, namelist[i]->d_name);
+		if ((data = file_get(path)) == NULL)
+			goto next;
+		if ((ptr = strchr(data, '\n')) != NULL)
+			*ptr = '\0';
+		if (yaml)
+			(void)fprintf(yaml, "      %s: \"%s\"\n",
+				namelist[i]->d_name, data);
+		else
+			(void)printf("  %-28s %s\n", namelist[i]->d_name, data);
+		free(data);
+next:
+		free(namelist[i]);
 	}
+	free(namelist);
 }
 
 /*
- *  stats_average_stddev_min_max()
- *	calculate average, std deviation, min and max
+ *  load_worker()
+ *	pinned load worker, runs the load function while it is one of
+ *	the active workers and waits on the control block otherwise
  */
-static void stats_average_stddev_min_max(
-	const stats_t *const stats,
-	const int num,
-	stats_t *const average,
-	stats_t *const stddev)
+static void load_worker(const func load_func, const uint32_t instance)
 {
-	int i, j, valid;
-
-	for (j = 0; j < MAX_VALUES; j++) {
-		double total = 0.0;
+	telemetry_t *telemetry = telemetry_get(load_pool->telemetry, instance);
 
-		for (valid = 0, i = 0; i < num; i++) {
-			if (!stats[i].inaccurate[j]) {
-				total += stats[i].value[j];
-				valid++;
-			}
-		}
+	mem_buf = load_pool->slot[instance].mem;
+	ctxt_cpu = load_pool->slot[instance].partner;
+	while (!stop_flag) {
+		const uint32_t gen = __atomic_load_n(&load_pool->generation,
+			__ATOMIC_ACQUIRE);
 
-		if (valid) {
-			average->value[j] = total / (double)valid;
-			total = 0.0;
-			for (i = 0; i < num; i++) {
-				if (!stats[i].inaccurate[j]) {
-					double diff = (double)stats[i].value[j]
-						- average->value[j];
-					diff = diff * diff;
-					total += diff;
-				}
-			}
-			stddev->value[j] = total / (double)num;
-			stddev->value[j] = sqrt(stddev->value[j]);
+		if (load_pool->quit)
+			break;
+		load_generation = gen;
+		if (instance < load_pool->active) {
+			const uint64_t t_start = gettime_ns(CLOCK_MONOTONIC);
+			uint64_t t, cpu_start, loops_start;
+
+			telemetry_publish(telemetry, 0, TELEMETRY_LOAD);
+			cpu_start = telemetry->busy_ns;
+			loops_start = telemetry->loops;
+			load_func(load_pool->param, telemetry);
+			telemetry_publish(telemetry, 0, TELEMETRY_IDLE);
+
+			/* Duty cycle achieved, CPU time used over wall time */
+			t = gettime_ns(CLOCK_MONOTONIC) - t_start;
+			load_pool->slot[instance].duty = t ? 100.0 *
+				(double)(telemetry->busy_ns - cpu_start) / (double)t : 0.0;
+			load_pool->slot[instance].loop_rate = t ? 1000000000.0 *
+				(double)(telemetry->loops - loops_start) / (double)t : 0.0;
 		} else {
-			average->inaccurate[j] = true;
-			stddev->inaccurate[j] = true;
-
-			average->value[j] = 0.0;
-			stddev->value[j] = 0.0;
+			__atomic_store_n(&load_pool->slot[instance].ack, gen,
+				__ATOMIC_RELEASE);
+			load_futex_wait(gen);
 		}
 	}
+	_exit(EXIT_SUCCESS);
 }
 
 /*
- *  power_get_sys_fs()
- *	get power discharge rate from battery via /sys interface
+ *  load_pool_set()
+ *	set the load and the number of active workers and wake the
+ *	workers up
  */
-static int power_get_sys_fs(
-	stats_t *stats,
-	bool *const discharging,
-	bool *const inaccurate)
+static void load_pool_set(const uint32_t active, const uint64_t param)
 {
-	DIR *dir;
-	struct dirent *dirent;
-	double total_watts = 0.0;
-	double average_voltage = 0.0;
-	int n = 0;
-
-	stats->value[POWER_NOW] = 0.0;
-	stats->value[VOLTAGE_NOW] = 0.0;
-	stats->value[CURRENT_NOW] = 0.0;
-	*discharging = false;
-	*inaccurate = true;
+	load_pool->param = param;
+	load_pool->active = active;
+	(void)__atomic_add_fetch(&load_pool->generation, 1, __ATOMIC_RELEASE);
+	load_futex_wake();
+}
 
-	if ((dir = opendir(SYS_CLASS_POWER_SUPPLY)) == NULL) {
-		(void)fprintf(stderr, "Machine does not have %s, cannot run the test.\n",
-			SYS_CLASS_POWER_SUPPLY);
-		return -1;
-	}
+/*
+ *  stop_load()
+ *	idle all the load workers, wait for them to acknowledge,
+ *	returns -1 if a worker is still loading its CPU
+ */
+static int stop_load(void)
+{
+	const double timeout = gettime_to_double() + LOAD_POOL_TIMEOUT;
+	uint32_t gen, i;
 
-	do {
-		dirent = readdir(dir);
-		if (dirent && strlen(dirent->d_name) > 2) {
-			char path[PATH_MAX];
-			char *data;
-			int  val;
-			FILE *fp;
-
-			/* Check that type field matches the expected type */
-			(void)snprintf(path, sizeof(path), "%s/%s/type",
-				SYS_CLASS_POWER_SUPPLY, dirent->d_name);
-			if ((data = file_get(path)) != NULL) {
-				bool mismatch = (strstr(data, "Battery") == NULL);
-				free(data);
-				if (mismatch)
-					continue;	/* type don't match, skip this entry */
-			} else
-				continue;		/* can't check type, skip this entry */
-
-			snprintf(path, sizeof(path), "%s/%s/uevent",
-				SYS_CLASS_POWER_SUPPLY, dirent->d_name);
-			if ((fp = fopen(path, "r")) == NULL) {
-				(void)fprintf(stderr, "Battery %s present but under supported - "
-					"no state present.", dirent->d_name);
-				(void)closedir(dir);
-				return -1;
-			} else {
-				char buffer[4096];
-				double voltage = 0.0;
-				double amps_rate = 0.0;
-				double watts_rate = 0.0;
-
-				while (fgets(buffer, sizeof(buffer)-1, fp) != NULL) {
-					int rc;
-
-					if (strstr(buffer, SYS_FIELD_STATUS_DISCHARGING))
-						*discharging = true;
-
-					if (strstr(buffer, SYS_FIELD_CURRENT_NOW) &&
-					    strlen(buffer) > sizeof(SYS_FIELD_CURRENT_NOW) - 1) {
-						rc = sscanf(buffer + sizeof(SYS_FIELD_CURRENT_NOW) - 1, "%12d", &val);
-						if (rc == 1)
-							amps_rate = (double)val / 1000000.0;
-					}
+	if (!load_pool)
+		return 0;
 
-					if (strstr(buffer, SYS_FIELD_POWER_NOW) &&
-					    strlen(buffer) > sizeof(SYS_FIELD_POWER_NOW) - 1) {
-						rc = sscanf(buffer + sizeof(SYS_FIELD_POWER_NOW) - 1, "%12d", &val);
-						if (rc == 1)
-							watts_rate = (double)val / 1000000.0;
-					}
+	load_pool_set(0, 0);
+	gen = __atomic_load_n(&load_pool->generation, __ATOMIC_ACQUIRE);
+	for (i = 0; i < load_pool->workers; i++) {
+		while (__atomic_load_n(&load_pool->slot[i].ack, __ATOMIC_ACQUIRE) != gen) {
+			const struct timespec ts = { 0, 1000000 };
 
-					if (strstr(buffer, SYS_FIELD_VOLTAGE_NOW) &&
-					    strlen(buffer) > sizeof(SYS_FIELD_VOLTAGE_NOW) - 1) {
-						rc = sscanf(buffer + sizeof(SYS_FIELD_VOLTAGE_NOW) - 1, "%12d", &val);
-						if (rc == 1)
-							voltage = (double)val / 1000000.0;
-					}
-				}
-				average_voltage += voltage;
-				total_watts     += watts_rate + voltage * amps_rate;
-				n++;
-				(void)fclose(fp);
+			if (stop_flag)
+				return 0;
+			if (gettime_to_double() > timeout) {
+				telemetry_t snapshot;
+
+				telemetry_read(telemetry_get(load_pool->telemetry, i), &snapshot);
+				(void)fprintf(stderr, "Load worker %" PRIu32 " did not "
+					"stop within %.0f seconds, it is %s after %" PRIu64
+					" load loops.\n", i, LOAD_POOL_TIMEOUT,
+					(snapshot.state == TELEMETRY_LOAD) ?
+					"still loading its CPU" : "idle but not acknowledging",
+					snapshot.loops);
+				return -1;
 			}
+			(void)nanosleep(&ts, NULL);
 		}
-	} while (dirent);
+	}
+	return 0;
+}
 
-	(void)closedir(dir);
+/*
+ *  show_duty_cycle()
+ *	show the duty cycle and load loop rate each worker achieved
+ *	in the last load, only valid after stop_load()
+ */
+static void show_duty_cycle(cpu_list_t *cpu_list, const uint32_t total_procs)
+{
+	cpu_info_t *c;
+	uint32_t i;
 
-#if DETECT_DISCHARGING
-	if (! *discharging) {
-		(void)printf("Machine is not discharging, cannot measure power usage.\n");
-#if defined(RAPL_X86)
-		(void)printf("Alternatively, use the RAPL power measuring option '-R'.\n");
-#endif
-		return -1;
+	(void)printf("%10.10s duty cycle:", "");
+	for (c = cpu_list->head, i = 0; c && (i < total_procs); c = c->next, i++)
+		(void)printf(" CPU%d %.1f%% %.0f loops/s", c->cpu_id,
+			load_pool->slot[i].duty, load_pool->slot[i].loop_rate);
+	(void)printf("\n");
+}
+
+/*
+ *  trace_time()
+ *	CLOCK_MONOTONIC time in seconds for trace records
+ */
+static double trace_time(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+/*
+ *  trace_write()
+ *	write all of buf to the trace file
+ */
+static int trace_write(const int fd, const void *buf, size_t len)
+{
+	const uint8_t *ptr = buf;
+
+	while (len > 0) {
+		const ssize_t ret = write(fd, ptr, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		ptr += ret;
+		len -= (size_t)ret;
+	}
+	return 0;
+}
+
+/*
+ *  trace_open()
+ *	create a raw sample trace file and write its header
+ */
+static trace_t *trace_open(
+	const char *filename,
+	const int32_t num_cpus,
+	const int32_t max_cpus,
+	const int32_t sample_delay)
+{
+	trace_t *t;
+	trace_header_t header;
+	int i;
+
+	t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (t == MAP_FAILED) {
+		(void)fprintf(stderr, "Cannot allocate trace buffer.\n");
+		return NULL;
+	}
+	if ((t->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		(void)fprintf(stderr, "Cannot create trace file '%s', errno=%d (%s).\n",
+			filename, errno, strerror(errno));
+		(void)munmap(t, sizeof(*t));
+		return NULL;
 	}
+	t->cstate = -1;
+
+	(void)memset(&header, 0, sizeof(header));
+	(void)memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.header_size = sizeof(trace_header_t);
+	header.record_size = sizeof(trace_record_t);
+	header.max_values = MAX_VALUES;
+	header.max_domains = MAX_POWER_DOMAINS;
+	header.max_cpus = max_cpus;
+	header.num_cpus = num_cpus;
+	header.sample_delay = sample_delay;
+	header.perf_events = perf_events;
+	header.rate = workload->rate;
+	header.flags = (uint32_t)opt_flags;
+	(void)snprintf(header.workload, sizeof(header.workload), "%s", workload->name);
+#if defined(PERF_ENABLED)
+	for (i = 0; i < perf_events; i++)
+		(void)snprintf(header.perf_event[i], sizeof(header.perf_event[i]),
+			"%s", perf_event_info(i)->name);
 #else
-	*discharging = true;
+	(void)i;
 #endif
+	if (trace_write(t->fd, &header, sizeof(header)) < 0) {
+		(void)fprintf(stderr, "Cannot write trace file '%s', errno=%d (%s).\n",
+			filename, errno, strerror(errno));
+		(void)close(t->fd);
+		(void)munmap(t, sizeof(*t));
+		return NULL;
+	}
+	return t;
+}
 
-	/*
- 	 *  If the battery is helpful it supplies the rate already, in which case
-	 *  we know the results from the battery are as good as we can and we don't
-	 *  have to figure out anything from capacity change over time.
-	 */
-	if (total_watts > RATE_ZERO_LIMIT) {
-		stats->value[POWER_NOW] = total_watts;
-		stats->value[VOLTAGE_NOW] = average_voltage / (double)n;
-		stats->value[CURRENT_NOW] = total_watts / average_voltage;
-		*inaccurate = (total_watts < 0.0);
+/*
+ *  trace_flush()
+ *	write the buffered records to the trace file
+ */
+static int trace_flush(trace_t *t)
+{
+	if (!t || !t->n)
 		return 0;
+	if (trace_write(t->fd, t->buffer, t->n * sizeof(trace_record_t)) < 0) {
+		(void)fprintf(stderr, "Cannot write trace file, errno=%d (%s).\n",
+			errno, strerror(errno));
+		return -1;
 	}
+	t->n = 0;
+	return 0;
+}
 
-	/*
-	 *  Rate not known, battery is less than useful.  We could
-	 *  calculate it from delta in charge, but that is not accurate
-	 *  for this kind of use case, so error out instead.
-	 */
-	(void)fprintf(stderr, "The battery just provided charge data which is not accurate enough.\n");
-	return -1;
+/*
+ *  trace_close()
+ *	flush and close the trace file
+ */
+static void trace_close(trace_t *t)
+{
+	if (!t)
+		return;
+	(void)trace_flush(t);
+	(void)close(t->fd);
+	(void)munmap(t, sizeof(*t));
 }
 
 /*
- *  power_get_proc_acpi()
- *	get power discharge rate from battery via /proc/acpi interface
+ *  trace_mark()
+ *	mark the start of the next sample
  */
-static int power_get_proc_acpi(
-	stats_t *stats,
-	bool *const discharging,
-	bool *const inaccurate)
+static inline void trace_mark(trace_t *t)
 {
-	DIR *dir;
-	FILE *file;
-	struct dirent *dirent;
-	char filename[PATH_MAX];
-	double total_watts = 0.0;
-	double average_voltage = 0.0;
-	int n = 0;
+	if (t)
+		t->t_last = trace_time();
+}
 
-	stats->value[POWER_NOW] = 0.0;
-	stats->value[VOLTAGE_NOW] = 0.0;
-	stats->value[CURRENT_NOW] = 0.0;
-	*discharging = false;
-	*inaccurate = true;
+/*
+ *  trace_context()
+ *	set the CPU frequency and deepest idle state the following
+ *	test steps run at, 0 and -1 if they are not set
+ */
+static inline void trace_context(trace_t *t, const uint64_t freq_khz, const int cstate)
+{
+	if (t) {
+		t->freq_khz = (uint32_t)freq_khz;
+		t->cstate = cstate;
+	}
+}
 
-	if ((dir = opendir(PROC_ACPI_BATTERY)) == NULL) {
-		(void)fprintf(stderr, "Machine does not have %s, cannot run the test.\n",
-			PROC_ACPI_BATTERY);
+/*
+ *  trace_sample()
+ *	buffer a record of a sample, with the raw counters it was
+ *	computed from, the records are only written once the buffer
+ *	is full or at the end of a test step so no I/O is done
+ *	between most samples
+ */
+static int trace_sample(
+	trace_t *t,
+	const uint32_t sample,
+	const stats_t *counters,
+	const stats_t *stats)
+{
+	trace_record_t *r;
+	double t_now;
+
+	if (!t)
+		return 0;
+	if ((t->n >= TRACE_BUFFER_RECORDS) && (trace_flush(t) < 0))
 		return -1;
-	}
 
-	while ((dirent = readdir(dir))) {
-		double voltage = 0.0;
-		double amps_rate = 0.0;
-		double watts_rate = 0.0;
-		char buffer[4096];
-		char *ptr;
+	t_now = trace_time();
+	r = &t->buffer[t->n++];
+	r->t_start = t->t_last;
+	r->t_end = t_now;
+	r->step = t->steps ? t->steps - 1 : 0;
+	r->sample = sample;
+	r->cpus = t->cpus;
+	r->inaccurate = stats->inaccurate[POWER_NOW];
+	r->freq_khz = t->freq_khz;
+	r->cstate = t->cstate;
+	r->load = (double)t->load;
+	(void)memcpy(r->energy, energy_counter, sizeof(r->energy));
+	(void)memcpy(r->counter, counters->value, sizeof(r->counter));
+	(void)memcpy(r->value, stats->value, sizeof(r->value));
+	t->t_last = t_now;
 
-		if (strlen(dirent->d_name) < 3)
-			continue;
+	return 0;
+}
 
-		(void)sprintf(filename, "/proc/acpi/battery/%s/state", dirent->d_name);
-		if ((file = fopen(filename, "r")) == NULL)
-			continue;
+/*
+ *  start_load()
+ *	load the first total_procs CPUs of the worker pool,
+ *	this starts a new test step in the trace
+ */
+static void start_load(const uint32_t total_procs, const uint64_t param)
+{
+	load_pool_set(total_procs, param);
+	if (trace) {
+		trace->steps++;
+		trace->cpus = total_procs;
+		trace->load = param;
+	}
+}
 
-		(void)memset(buffer, 0, sizeof(buffer));
-		while (fgets(buffer, sizeof(buffer), file) != NULL) {
-			if (strstr(buffer, "present:") &&
-			    strstr(buffer, "no"))
+/*
+ *  numa_online()
+ *	parse the online NUMA node list, e.g. 0-3 or 0,2-3, into a
+ *	node mask, returns the number of online nodes, 1 if not known
+ */
+static int numa_online(unsigned long *mask)
+{
+	const size_t bits = 8 * sizeof(unsigned long);
+	char *data, *ptr;
+	int nodes = 0;
+
+	(void)memset(mask, 0, MEM_MAX_NODES / 8);
+	if ((data = file_get(SYS_NODE_ONLINE)) == NULL)
+		goto unknown;
+	for (ptr = data; *ptr; ) {
+		char *end;
+		long lo, hi, n;
+
+		lo = strtol(ptr, &end, 10);
+		if (end == ptr)
+			break;
+		hi = lo;
+		if (*end == '-') {
+			ptr = end + 1;
+			hi = strtol(ptr, &end, 10);
+			if (end == ptr)
 				break;
+		}
+		for (n = lo; (n <= hi) && (n < MEM_MAX_NODES); n++) {
+			if (n >= 0 && !(mask[n / bits] & (1UL << (n % bits)))) {
+				mask[n / bits] |= 1UL << (n % bits);
+				nodes++;
+			}
+		}
+		if (*end != ',')
+			break;
+		ptr = end + 1;
+	}
+	free(data);
+	if (nodes)
+		return nodes;
+unknown:
+	mask[0] = 1UL;
+	return 1;
+}
 
-			if (strstr(buffer, "charging state:") &&
-			    (strstr(buffer, "discharging") || strstr(buffer, "critical")))
-				*discharging = true;
+/*
+ *  numa_nodes()
+ *	number of online NUMA nodes
+ */
+static int numa_nodes(void)
+{
+	unsigned long mask[MEM_MAX_NODES / (8 * sizeof(unsigned long))];
 
-			ptr = strchr(buffer, ':');
-			if (ptr) {
-				ptr++;
-				if (strstr(buffer, "present voltage"))
-					voltage = strtoull(ptr, NULL, 10) / 1000.0;
+	return numa_online(mask);
+}
 
-				if (strstr(buffer, "present rate")) {
-					if (strstr(ptr, "mW"))
-						watts_rate = strtoull(ptr, NULL, 10) / 1000.0 ;
-					if (strstr(ptr, "mA"))
-						amps_rate = strtoull(ptr, NULL, 10) / 1000.0;
-				}
-			}
-		}
-		(void)fclose(file);
+/*
+ *  numa_next_node()
+ *	the next online NUMA node after a node, wrapping around to
+ *	the first, node IDs need not be contiguous
+ */
+static int numa_next_node(const int node)
+{
+	const int bits = 8 * sizeof(unsigned long);
+	unsigned long mask[MEM_MAX_NODES / (8 * sizeof(unsigned long))];
+	int i;
 
-		/*
-		 * Some HP firmware is broken and has an undefined
-		 * 'present voltage' field and instead returns this in
-		 * the design_voltage field, so work around this.
-		 */
-		if (FLOAT_CMP(voltage, 0.0)) {
-			sprintf(filename, "/proc/acpi/battery/%s/info",
-				dirent->d_name);
-			if ((file = fopen(filename, "r")) != NULL) {
-				while (fgets(buffer, sizeof(buffer), file) != NULL) {
-					ptr = strchr(buffer, ':');
-					if (ptr) {
-						ptr++;
-						if (strstr(buffer, "design voltage:")) {
-							voltage = strtoull(ptr, NULL, 10) / 1000.0;
-							break;
-						}
-					}
-				}
-				(void)fclose(file);
-			}
-		}
+	(void)numa_online(mask);
+	for (i = 1; i <= MEM_MAX_NODES; i++) {
+		const int n = (node + i) % MEM_MAX_NODES;
 
-		average_voltage += voltage;
-		total_watts     += watts_rate + voltage * amps_rate;
-		n++;
+		if (mask[n / bits] & (1UL << (n % bits)))
+			return n;
 	}
-	(void)closedir(dir);
+	return node;
+}
 
-#if DETECT_DISCHARGING
-	if (! *discharging) {
-		printf("Machine is indicating it is not discharging and hence "
-		       "we cannot measure power usage.\n");
-		return -1;
-	}
-#else
-	*discharging = true;
-#endif
+/*
+ *  numa_cpu_node()
+ *	find the NUMA node of a CPU, 0 if not known
+ */
+static int numa_cpu_node(const int cpu)
+{
+	char path[PATH_MAX];
+	DIR *dir;
+	struct dirent *dirent;
+	int node = 0;
 
-	/*
- 	 * If the battery is helpful it supplies the rate already, in which
-	 * case we know the results from the battery are as good as we can
-	 * and we don't have to figure out anything from capacity change over
-	 * time.
-	 */
-	if (total_watts > RATE_ZERO_LIMIT) {
-		stats->value[POWER_NOW] = total_watts;
-		stats->value[VOLTAGE_NOW] = average_voltage / (double)n;
-		stats->value[CURRENT_NOW] = total_watts / average_voltage;
-		*inaccurate = (total_watts < 0.0);
+	(void)snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	if ((dir = sys_opendir(path)) == NULL)
 		return 0;
+	while ((dirent = readdir(dir)) != NULL) {
+		if (!strncmp(dirent->d_name, "node", 4) &&
+		    isdigit((unsigned char)dirent->d_name[4])) {
+			node = atoi(dirent->d_name + 4);
+			break;
+		}
 	}
+	(void)closedir(dir);
 
-	/*
-	 *  Rate not known, battery is less than useful.  We could
-	 *  calculate it from delta in charge, but that is not accurate
-	 *  for this kind of use case, so error out instead.
-	 */
-	(void)fprintf(stderr, "The battery just provided charge data which is not accurate enough.\n");
-	return -1;
+	return node;
 }
 
-#if defined(RAPL_X86)
-
 /*
- *  rapl_free_list()
- *	free RAPL list
+ *  cpu_package()
+ *	find the physical package of a CPU, -1 if not known
  */
-static void rapl_free_list(rapl_info_t *rapl_list)
+static int cpu_package(const int cpu)
 {
-	rapl_info_t *rapl = rapl_list;
+	char path[PATH_MAX], *data;
+	int package;
 
-	while (rapl) {
-		rapl_info_t *next = rapl->next;
+	(void)snprintf(path, sizeof(path),
+		"/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+	if ((data = file_get(path)) == NULL)
+		return -1;
+	package = atoi(data);
+	free(data);
 
-		free(rapl->name);
-		free(rapl->domain_name);
-		free(rapl);
-		rapl = next;
-	}
+	return package;
 }
 
 /*
- *  rapl_get_domains()
+ *  cpu_smt_sibling()
+ *	find the first SMT sibling of a CPU, -1 if it has none
  */
-static int rapl_get_domains(rapl_info_t **rapl_list)
+static int cpu_smt_sibling(const int cpu)
 {
-	DIR *dir;
-        struct dirent *entry;
-	int n = 0;
+	char path[PATH_MAX], *data, *ptr;
+	int sibling = -1;
 
-	dir = opendir("/sys/class/powercap");
-	if (dir == NULL) {
-		printf("Cannot open /sys/class/powercap, cannot measure power usage, try running as root.\n");
+	(void)snprintf(path, sizeof(path),
+		"/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+	if ((data = file_get(path)) == NULL)
 		return -1;
+	/* List of CPUs and ranges, e.g. 0,64 or 0-1 */
+	for (ptr = data; (sibling < 0) && isdigit((unsigned char)*ptr); ) {
+		char *end;
+		long lo, hi, i;
+
+		lo = hi = strtol(ptr, &end, 10);
+		if ((*end == '-') && isdigit((unsigned char)end[1]))
+			hi = strtol(end + 1, &end, 10);
+		for (i = lo; i <= hi; i++) {
+			if (i != cpu) {
+				sibling = (int)i;
+				break;
+			}
+		}
+		if (*end != ',')
+			break;
+		ptr = end + 1;
 	}
+	free(data);
 
-	while ((entry = readdir(dir)) != NULL) {
-		char path[PATH_MAX];
-		FILE *fp;
-		rapl_info_t *rapl;
+	return sibling;
+}
 
-		/* Ignore non Intel RAPL interfaces */
-		if (strncmp(entry->d_name, "intel-rapl", 10))
-			continue;
+/*
+ *  ctxt_partner_cpu()
+ *	find the CPU the context switch partner of a worker runs on
+ *	for the -C placement, -1 if there is no such CPU. Cross
+ *	package partners are searched for from the opposite side of
+ *	the CPU numbering so the workers' partners are spread out.
+ */
+static int ctxt_partner_cpu(const int cpu, const int max_cpus)
+{
+	int package, i;
 
-		if ((rapl = calloc(1, sizeof(*rapl))) == NULL) {
-			fprintf(stderr, "Cannot allocate RAPL information.\n");
-			closedir(dir);
+	switch (ctxt_pair) {
+	case CTXT_PAIR_SMT:
+		return cpu_smt_sibling(cpu);
+	case CTXT_PAIR_PACKAGE:
+		if ((package = cpu_package(cpu)) < 0)
+			return -1;
+		for (i = 0; i < max_cpus; i++) {
+			const int other = (cpu + (max_cpus / 2) + i) % max_cpus;
+			const int other_package = cpu_package(other);
+
+			if ((other_package >= 0) && (other_package != package))
+				return other;
+		}
+		return -1;
+	default:
+		return cpu;
+	}
+}
+
+/*
+ *  cache_size()
+ *	size in bytes of a data or unified cache level of CPU 0,
+ *	level 0 is the last level cache, returns 0 if not known
+ */
+static size_t cache_size(const int level)
+{
+	char path[PATH_MAX], *data;
+	int i, max_level = 0;
+	size_t size = 0;
+
+	for (i = 0; ; i++) {
+		int this_level;
+		size_t this_size;
+		bool instruction;
+
+		(void)snprintf(path, sizeof(path), "%s/index%d/level", SYS_CPU0_CACHE, i);
+		if ((data = file_get(path)) == NULL)
+			break;
+		this_level = atoi(data);
+		free(data);
+
+		(void)snprintf(path, sizeof(path), "%s/index%d/type", SYS_CPU0_CACHE, i);
+		if ((data = file_get(path)) == NULL)
+			continue;
+		instruction = !strncmp(data, "Instruction", 11);
+		free(data);
+		if (instruction)
+			continue;
+
+		(void)snprintf(path, sizeof(path), "%s/index%d/size", SYS_CPU0_CACHE, i);
+		if ((data = file_get(path)) == NULL)
+			continue;
+		this_size = (size_t)strtoul(data, NULL, 10);
+		if (strchr(data, 'K'))
+			this_size *= 1024;
+		else if (strchr(data, 'M'))
+			this_size *= 1024 * 1024;
+		free(data);
+
+		if (level ? (this_level == level) : (this_level > max_level)) {
+			max_level = this_level;
+			size = this_size;
+		}
+	}
+	return size;
+}
+
+/*
+ *  chase_size()
+ *	pointer chase working set per worker for a cache level, half of
+ *	L1 or L2, an even share of half the LLC and for DRAM enough for
+ *	all the workers together to be well over the LLC size
+ */
+static size_t chase_size(const int chase, const uint32_t workers)
+{
+	size_t l1 = cache_size(1), l2 = cache_size(2), llc = cache_size(0);
+	size_t size;
+
+	if (!l1)
+		l1 = CHASE_L1_DEFAULT;
+	if (!l2)
+		l2 = CHASE_L2_DEFAULT;
+	if (!llc)
+		llc = CHASE_LLC_DEFAULT;
+
+	switch (chase) {
+	case CHASE_L1:
+		return l1 / 2;
+	case CHASE_L2:
+		return l2 / 2;
+	case CHASE_LLC:
+		size = llc / (2 * workers);
+		return (size < 2 * l2) ? 2 * l2 : size;
+	default:
+		size = (4 * llc) / workers;
+		return (size < CHASE_DRAM_MIN) ? CHASE_DRAM_MIN : size;
+	}
+}
+
+/*
+ *  mem_buffer_size()
+ *	streaming buffer per worker, an even share of 4 times the LLC
+ *	so the workers together always miss in the cache
+ */
+static size_t mem_buffer_size(const uint32_t workers)
+{
+	size_t llc = cache_size(0), size;
+
+	if (!llc)
+		llc = CHASE_LLC_DEFAULT;
+	size = (4 * llc) / (workers ? workers : 1);
+	/* Whole cache lines in each half for the copy kernel */
+	size = (size + 2 * MEM_LINE_SIZE - 1) & ~((size_t)2 * MEM_LINE_SIZE - 1);
+
+	return (size < MEM_BUFFER_MIN) ? MEM_BUFFER_MIN : size;
+}
+
+/*
+ *  mem_chase_init()
+ *	link the cache lines of a buffer into one randomly ordered
+ *	cycle, so the hardware prefetchers cannot predict the next load
+ */
+static int mem_chase_init(uint8_t *buf, const size_t size)
+{
+	const size_t lines = size / MEM_LINE_SIZE;
+	size_t *order, i;
+
+	if ((order = calloc(lines, sizeof(*order))) == NULL) {
+		(void)fprintf(stderr, "Cannot allocate pointer chase order.\n");
+		return -1;
+	}
+	for (i = 0; i < lines; i++)
+		order[i] = i;
+	for (i = lines - 1; i > 0; i--) {
+		const size_t j = (((uint64_t)mwc() << 32) | mwc()) % (i + 1);
+		const size_t tmp = order[i];
+
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	for (i = 0; i < lines; i++) {
+		void **line = (void **)(buf + (order[i] * MEM_LINE_SIZE));
+
+		*line = buf + (order[(i + 1) % lines] * MEM_LINE_SIZE);
+	}
+	free(order);
+
+	return 0;
+}
+
+/*
+ *  mem_buffers_free()
+ *	free the memory workload buffers
+ */
+static void mem_buffers_free(load_pool_t *pool)
+{
+	uint32_t i;
+
+	for (i = 0; i < pool->workers; i++) {
+		if (pool->slot[i].mem) {
+			(void)munmap(pool->slot[i].mem, mem_size);
+			pool->slot[i].mem = NULL;
+		}
+	}
+}
+
+/*
+ *  mem_buffers_alloc()
+ *	allocate a buffer for each load worker, bound to the NUMA node
+ *	of the worker's CPU or, for remote access, the next node. The
+ *	buffers are faulted in before the workers are forked.
+ */
+static int mem_buffers_alloc(load_pool_t *pool, cpu_list_t *cpu_list)
+{
+	const int nodes = numa_nodes();
+	cpu_info_t *c;
+	uint32_t i;
+
+	for (c = cpu_list->head, i = 0; c; c = c->next, i++) {
+		unsigned long mask[MEM_MAX_NODES / (8 * sizeof(unsigned long))];
+		const int local = numa_cpu_node(c->cpu_id);
+		const int node = mem_remote ? numa_next_node(local) : local;
+		uint8_t *buf;
+
+		/*
+		 *  The pointer chase is read only so it can use private
+		 *  transparent huge pages, which keeps TLB misses out of the
+		 *  cost of a cache level, without copy on write faults
+		 */
+		buf = mmap(NULL, mem_size, PROT_READ | PROT_WRITE,
+			(workload->chase ? MAP_PRIVATE : MAP_SHARED) | MAP_ANONYMOUS,
+			-1, 0);
+		if (buf == MAP_FAILED) {
+			(void)fprintf(stderr, "Cannot allocate memory workload buffer.\n");
+			goto err;
+		}
+#if defined(MADV_HUGEPAGE)
+		if (workload->chase)
+			(void)madvise(buf, mem_size, MADV_HUGEPAGE);
+#endif
+		pool->slot[i].mem = buf;
+		pool->slot[i].node = node;
+
+		(void)memset(mask, 0, sizeof(mask));
+		if (node < MEM_MAX_NODES)
+			mask[node / (8 * sizeof(unsigned long))] |=
+				1UL << (node % (8 * sizeof(unsigned long)));
+		if ((syscall(SYS_mbind, buf, mem_size, MPOL_BIND, mask,
+			     MEM_MAX_NODES + 1, 0) < 0) && (nodes > 1)) {
+			(void)fprintf(stderr, "Cannot bind memory workload buffer "
+				"to NUMA node %d, errno=%d (%s).\n",
+				node, errno, strerror(errno));
+			goto err;
+		}
+		(void)memset(buf, 0x5a, mem_size);
+		if (workload->chase && (mem_chase_init(buf, mem_size) < 0))
+			goto err;
+	}
+	return 0;
+err:
+	mem_buffers_free(pool);
+	return -1;
+}
+
+/*
+ *  load_pool_destroy()
+ *	make the load workers exit and reap them
+ */
+static void load_pool_destroy(cpu_list_t *cpu_list)
+{
+	cpu_info_t *c;
+
+	if (!load_pool)
+		return;
+
+	load_pool->quit = true;
+	load_pool_set(0, 0);
+	for (c = cpu_list->head; c; c = c->next) {
+		if (c->pid > -1) {
+			const double timeout = gettime_to_double() + LOAD_POOL_TIMEOUT;
+
+			/* Give each worker a chance to exit, then kill it */
+			while (waitpid(c->pid, NULL, WNOHANG) == 0) {
+				const struct timespec ts = { 0, 1000000 };
+
+				if (gettime_to_double() > timeout) {
+					(void)kill(c->pid, SIGKILL);
+					(void)waitpid(c->pid, NULL, 0);
+					break;
+				}
+				(void)nanosleep(&ts, NULL);
+			}
+		}
+		c->pid = -1;
+	}
+	mem_buffers_free(load_pool);
+	if (zero_fd > -1) {
+		(void)close(zero_fd);
+		zero_fd = -1;
+	}
+	(void)munmap(load_pool, load_pool->size);
+	load_pool = NULL;
+}
+
+/*
+ *  load_pool_create()
+ *	fork a load worker pinned to each CPU in the CPU list, the
+ *	workers stay idle until start_load() is called
+ */
+static int load_pool_create(
+	cpu_list_t *cpu_list,
+	const func load_func,
+	const uint32_t period_ms,
+	telemetry_t *telemetry)
+{
+	const size_t size = sizeof(load_pool_t) +
+		(cpu_list->count * sizeof(load_slot_t));
+	load_pool_t *pool;
+	cpu_info_t *c;
+	uint32_t i;
+
+	pool = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (pool == MAP_FAILED) {
+		(void)fprintf(stderr, "Cannot allocate load worker pool.\n");
+		return -1;
+	}
+	pool->size = size;
+	pool->workers = cpu_list->count;
+	pool->period_ns = (uint64_t)period_ms * 1000000ULL;
+	pool->telemetry = telemetry;
+	load_pool = pool;
+
+	if ((workload->bytes || workload->chase) &&
+	    (mem_buffers_alloc(pool, cpu_list) < 0)) {
+		(void)munmap(pool, size);
+		load_pool = NULL;
+		return -1;
+	}
+	if (workload->rate == RATE_CTXT) {
+		const int max_cpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+
+		for (c = cpu_list->head, i = 0; c; c = c->next, i++) {
+			pool->slot[i].partner = ctxt_partner_cpu(c->cpu_id, max_cpus);
+			if (pool->slot[i].partner < 0) {
+				(void)fprintf(stderr, "CPU %d has no %s to run its "
+					"context switch partner on.\n", c->cpu_id,
+					(ctxt_pair == CTXT_PAIR_SMT) ?
+					"SMT sibling" : "CPU in another package");
+				(void)munmap(pool, size);
+				load_pool = NULL;
+				return -1;
+			}
+		}
+	}
+	/* Open before forking so a syscall kernel never reads a bad fd */
+	if (workload->rate == RATE_SYSCALL) {
+		if ((zero_fd = open("/dev/zero", O_RDONLY)) < 0) {
+			(void)fprintf(stderr, "Cannot open /dev/zero for the syscall "
+				"workload, errno=%d (%s).\n", errno, strerror(errno));
+			(void)munmap(pool, size);
+			load_pool = NULL;
+			return -1;
+		}
+	}
+
+	/* Don't let the workers inherit copies of pending output, they _exit() */
+	(void)fflush(NULL);
+	for (c = cpu_list->head, i = 0; c; c = c->next, i++) {
+		c->pid = fork();
+
+		switch (c->pid) {
+		case -1:
+			(void)fprintf(stderr, "Cannot fork, errno=%d (%s)\n",
+				errno, strerror(errno));
+			load_pool_destroy(cpu_list);
 			return -1;
+		case 0:
+			/* Child, don't outlive the parent */
+			(void)prctl(PR_SET_PDEATHSIG, SIGKILL);
+			/* Wake from the duty cycle sleeps on time, default slack is 50 us */
+			(void)prctl(PR_SET_TIMERSLACK, 1UL);
+			if (set_affinity(c->cpu_id) < 0)
+				_exit(0);
+			load_worker(load_func, i);
+			_exit(0);
+		default:
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ *  parse_uint64()
+ *	parse an unsigned decimal integer, skipping leading white
+ *	space, returns a pointer to the first character after the
+ *	digits or NULL if there are no digits
+ */
+static inline const char *parse_uint64(const char *ptr, uint64_t *val)
+{
+	uint64_t v = 0;
+
+	while ((*ptr == ' ') || (*ptr == '\t'))
+		ptr++;
+	if ((*ptr < '0') || (*ptr > '9'))
+		return NULL;
+	while ((*ptr >= '0') && (*ptr <= '9')) {
+		v = (v * 10) + (uint64_t)(*ptr - '0');
+		ptr++;
+	}
+	*val = v;
+	return ptr;
+}
+
+/*
+ *  pread_uint64()
+ *	read an unsigned decimal integer from the start of an
+ *	open /sys file
+ */
+static int pread_uint64(const int fd, uint64_t *val)
+{
+	char buf[32];
+	ssize_t ret;
+
+	ret = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (ret <= 0)
+		return -1;
+	buf[ret] = '\0';
+
+	return parse_uint64(buf, val) ? 0 : -1;
+}
+
+/*
+ *  pread_int64()
+ *	read a signed decimal integer from the start of an
+ *	open /sys file
+ */
+static int pread_int64(const int fd, int64_t *val)
+{
+	char buf[32];
+	const char *ptr = buf;
+	ssize_t ret;
+	uint64_t v;
+
+	ret = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (ret <= 0)
+		return -1;
+	buf[ret] = '\0';
+
+	if (*ptr == '-')
+		ptr++;
+	if (!parse_uint64(ptr, &v))
+		return -1;
+	*val = (ptr == buf) ? (int64_t)v : -(int64_t)v;
+	return 0;
+}
+
+/*
+ *  get_time()
+ *	Gather current time in buffer
+ */
+static void get_time(char *const buffer, const size_t buflen)
+{
+	struct tm tm;
+	time_t now;
+
+	now = time(NULL);
+	if (now == ((time_t) -1)) {
+		(void)snprintf(buffer, buflen, "--:--:-- ");
+	} else {
+		(void)localtime_r(&now, &tm);
+		(void)snprintf(buffer, buflen, "%2.2d:%2.2d:%2.2d ",
+			tm.tm_hour, tm.tm_min, tm.tm_sec);
+	}
+}
+
+/*
+ *  stats_clear()
+ *	clear stats
+ */
+static void stats_clear(stats_t *const stats)
+{
+	int i;
+
+	for (i = 0; i < MAX_VALUES; i++) {
+		stats->value[i] = 0.0;
+		stats->inaccurate[i] = false;
+	}
+}
+
+/*
+ *  stats_clear_all()
+ *	zero stats data
+ */
+static void stats_clear_all(stats_t *const stats, const int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		stats_clear(&stats[i]);
+}
+
+/*
+ *  cpu_util_alloc()
+ *	allocate the per-CPU utilisation matrix
+ */
+static cpu_util_t *cpu_util_alloc(const int32_t max_cpus)
+{
+	cpu_util_t *util;
+	const size_t n = (size_t)max_cpus * CPU_UTIL_FIELDS;
+
+	if ((util = calloc(1, sizeof(*util))) == NULL)
+		goto err;
+	util->max_cpus = max_cpus;
+	util->ticks[0] = calloc(2 * n, sizeof(uint64_t));
+	util->util = calloc(n, sizeof(double));
+	util->samples = calloc((size_t)max_cpus, sizeof(uint32_t));
+	if (!util->ticks[0] || !util->util || !util->samples) {
+		free(util->ticks[0]);
+		free(util->util);
+		free(util->samples);
+		free(util);
+		goto err;
+	}
+	util->ticks[1] = util->ticks[0] + n;
+	return util;
+err:
+	(void)fprintf(stderr, "Cannot allocate per-CPU utilisation matrix.\n");
+	return NULL;
+}
+
+/*
+ *  cpu_util_free()
+ *	free the per-CPU utilisation matrix
+ */
+static void cpu_util_free(cpu_util_t *util)
+{
+	if (!util)
+		return;
+	free(util->ticks[0]);
+	free(util->util);
+	free(util->samples);
+	free(util);
+}
+
+/*
+ *  cpu_util_reset()
+ *	zero the summed per-CPU utilisation
+ */
+static void cpu_util_reset(cpu_util_t *util)
+{
+	if (!util)
+		return;
+	(void)memset(util->util, 0,
+		sizeof(double) * util->max_cpus * CPU_UTIL_FIELDS);
+	(void)memset(util->samples, 0, sizeof(uint32_t) * util->max_cpus);
+}
+
+/*
+ *  cpu_util_gather()
+ *	add the % utilisation of each CPU between the last two
+ *	/proc/stat reads, CPUs missing from either read are skipped
+ */
+static void cpu_util_gather(cpu_util_t *util)
+{
+	const uint64_t *t1, *t2;
+	int32_t cpu;
+
+	if (!util)
+		return;
+
+	t1 = util->ticks[util->cur ^ 1];
+	t2 = util->ticks[util->cur];
+	for (cpu = 0; cpu < util->max_cpus; cpu++) {
+		double delta[CPU_UTIL_FIELDS], total = 0.0;
+		int i;
+
+		for (i = 0; i < CPU_UTIL_FIELDS; i++) {
+			/* Ticks can go backwards, see stats_sane() */
+			delta[i] = (t2[i] > t1[i]) ? (double)(t2[i] - t1[i]) : 0.0;
+			total += delta[i];
+		}
+		if ((total > 0.0) && (t1[CPU_UTIL_IDLE] > 0)) {
+			for (i = 0; i < CPU_UTIL_FIELDS; i++)
+				util->util[(cpu * CPU_UTIL_FIELDS) + i] +=
+					100.0 * delta[i] / total;
+			util->samples[cpu]++;
+		}
+		t1 += CPU_UTIL_FIELDS;
+		t2 += CPU_UTIL_FIELDS;
+	}
+}
+
+/*
+ *  cpu_util_busy()
+ *	average % busy (user + sys) of a CPU since the last reset,
+ *	returns NAN if the CPU was not sampled
+ */
+static double cpu_util_busy(const cpu_util_t *util, const int32_t cpu)
+{
+	const double *u;
+
+	if (!util || (cpu >= util->max_cpus) || !util->samples[cpu])
+		return NAN;
+
+	u = util->util + (cpu * CPU_UTIL_FIELDS);
+	return (u[CPU_UTIL_USER] + u[CPU_UTIL_SYS]) / util->samples[cpu];
+}
+
+
+/*
+ *  proc_stat_line()
+ *	parse a /proc/stat line, returns the PROC_STAT_* field
+ *	found or 0 if the line is not of interest. The cpuN
+ *	lines are stored in the per-CPU utilisation matrix.
+ */
+static int proc_stat_line(const char *buf, stats_t *const stats)
+{
+	static const struct {
+		const char *key;	/* line prefix */
+		size_t	len;		/* prefix length */
+		int	index;		/* stats index */
+		int	field;		/* PROC_STAT_* field */
+	} keys[] = {
+		{ "intr ",		5,	CPU_INTR,	PROC_STAT_INTR },
+		{ "ctxt ",		5,	CPU_CTXT,	PROC_STAT_CTXT },
+		{ "procs_running ",	14,	CPU_PROCS_RUN,	PROC_STAT_PROCS_RUN },
+		{ "procs_blocked ",	14,	CPU_PROCS_BLK,	PROC_STAT_PROCS_BLK },
+	};
+	static const int cpu_indices[] = {
+		CPU_USER, CPU_NICE, CPU_SYS, CPU_IDLE,
+		CPU_IOWAIT, CPU_IRQ, CPU_SOFTIRQ,
+	};
+	const char *ptr;
+	uint64_t val, *ticks;
+	size_t i;
+
+	if (!strncmp(buf, "cpu ", 4)) {
+		double values[7];
+
+		for (ptr = buf + 4, i = 0; i < 7; i++) {
+			if ((ptr = parse_uint64(ptr, &val)) == NULL)
+				return 0;
+			values[i] = (double)val;
+		}
+		for (i = 0; i < 7; i++) {
+			stats->value[cpu_indices[i]] = values[i];
+			stats->inaccurate[cpu_indices[i]] = false;
+		}
+		return PROC_STAT_CPU;
+	}
+	if (!strncmp(buf, "cpu", 3) && isdigit((unsigned char)buf[3])) {
+		uint64_t cpu, t[7];
+
+		if (!cpu_util)
+			return 0;
+		if ((ptr = parse_uint64(buf + 3, &cpu)) == NULL)
+			return 0;
+		if (cpu >= (uint64_t)cpu_util->max_cpus)
+			return 0;
+		for (i = 0; i < 7; i++) {
+			if ((ptr = parse_uint64(ptr, &t[i])) == NULL)
+				return 0;
+		}
+		ticks = cpu_util->ticks[cpu_util->cur] + (cpu * CPU_UTIL_FIELDS);
+		ticks[CPU_UTIL_USER] = t[0] + t[1];
+		ticks[CPU_UTIL_SYS] = t[2] + t[5] + t[6];
+		ticks[CPU_UTIL_IDLE] = t[3];
+		ticks[CPU_UTIL_IOWAIT] = t[4];
+		return 0;
+	}
+	for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+		if (!strncmp(buf, keys[i].key, keys[i].len)) {
+			if (parse_uint64(buf + keys[i].len, &val) == NULL)
+				return 0;
+			stats->value[keys[i].index] = (double)val;
+			stats->inaccurate[keys[i].index] = false;
+			return keys[i].field;
+		}
+	}
+	return 0;
+}
+
+/*
+ *  proc_stat_read()
+ *	read the fields we need from /proc/stat, the file is kept
+ *	open and read into a static buffer, parsing stops once all
+ *	the fields are found. Lines longer than the buffer (the intr
+ *	line on large systems) are parsed from their start and the
+ *	rest is skipped.
+ */
+static int proc_stat_read(stats_t *const stats)
+{
+	static int fd = -1;
+	static char buf[PROC_STAT_BUF_SIZE];
+	off_t offset = 0;
+	size_t len = 0;
+	bool skip = false;
+	int found = 0;
+
+	/* Per-CPU ticks go into the other row set, offline CPUs read as zero */
+	if (cpu_util) {
+		cpu_util->cur ^= 1;
+		(void)memset(cpu_util->ticks[cpu_util->cur], 0,
+			sizeof(uint64_t) * cpu_util->max_cpus * CPU_UTIL_FIELDS);
+	}
+
+	if (fd < 0) {
+		if ((fd = sys_open("/proc/stat", O_RDONLY)) < 0) {
+			(void)fprintf(stderr, "Cannot read /proc/stat, errno=%d (%s).\n",
+				errno, strerror(errno));
+			return -1;
+		}
+	}
+
+	while (found != PROC_STAT_ALL) {
+		char *ptr = buf, *end;
+		ssize_t ret;
+
+		ret = pread(fd, buf + len, sizeof(buf) - 1 - len, offset);
+		if (ret < 0) {
+			(void)fprintf(stderr, "Cannot read /proc/stat, errno=%d (%s).\n",
+				errno, strerror(errno));
+			return -1;
+		}
+		if (ret == 0) {
+			/* End of file, parse any unterminated last line */
+			buf[len] = '\0';
+			if (!skip && len)
+				found |= proc_stat_line(buf, stats);
+			break;
+		}
+		offset += ret;
+		len += (size_t)ret;
+		end = buf + len;
+		*end = '\0';
+
+		while ((ptr < end) && (found != PROC_STAT_ALL)) {
+			char *eol = memchr(ptr, '\n', (size_t)(end - ptr));
+
+			if (!eol) {
+				/* Line fills the buffer, parse its start, skip the rest */
+				if (!skip && (ptr == buf) && (len == sizeof(buf) - 1)) {
+					found |= proc_stat_line(ptr, stats);
+					skip = true;
+					ptr = end;
+				} else if (skip) {
+					ptr = end;
+				}
+				break;
+			}
+			*eol = '\0';
+			if (skip)
+				skip = false;
+			else
+				found |= proc_stat_line(ptr, stats);
+			ptr = eol + 1;
+		}
+		/* Move any partial line to the start of the buffer */
+		len = (size_t)(end - ptr);
+		if (len)
+			(void)memmove(buf, ptr, len);
+	}
+	return 0;
+}
+
+/*
+ *  sys_read_uint64()
+ *	read an unsigned integer from a /sys file
+ */
+static int sys_read_uint64(const char *path, uint64_t *val)
+{
+	char *data;
+	int ret;
+
+	if ((data = file_get(path)) == NULL)
+		return -1;
+	ret = parse_uint64(data, val) ? 0 : -1;
+	free(data);
+
+	return ret;
+}
+
+/*
+ *  sys_write_uint64()
+ *	write an unsigned integer to a /sys file
+ */
+static int sys_write_uint64(const char *path, const uint64_t val)
+{
+	char buf[32];
+	int fd, len;
+	ssize_t ret;
+
+	if ((fd = sys_open(path, O_WRONLY)) < 0)
+		return -1;
+	len = snprintf(buf, sizeof(buf), "%" PRIu64 "\n", val);
+	ret = write(fd, buf, (size_t)len);
+	(void)close(fd);
+
+	return (ret == len) ? 0 : -1;
+}
+
+/*
+ *  cstate_open()
+ *	open the cpuidle state time and usage counters of the CPUs,
+ *	returns the number of states common to all of them, 0 if there
+ *	is no cpuidle
+ */
+static int cstate_open(cpu_list_t *cpu_list)
+{
+	cpu_info_t *c;
+	int k, count = MAX_CSTATES;
+
+	for (c = cpu_list->head; c; c = c->next) {
+		for (k = 0; k < MAX_CSTATES; k++) {
+			char path[PATH_MAX];
+
+			(void)snprintf(path, sizeof(path), SYS_CPUIDLE, c->cpu_id, k, "time");
+			if ((c->cstate_time_fd[k] = sys_open(path, O_RDONLY)) < 0)
+				break;
+			(void)snprintf(path, sizeof(path), SYS_CPUIDLE, c->cpu_id, k, "usage");
+			if ((c->cstate_usage_fd[k] = sys_open(path, O_RDONLY)) < 0) {
+				(void)close(c->cstate_time_fd[k]);
+				c->cstate_time_fd[k] = -1;
+				break;
+			}
+		}
+		if (k < count)
+			count = k;
+		if (k == MAX_CSTATES) {
+			char path[PATH_MAX], root_path[PATH_MAX];
+
+			(void)snprintf(path, sizeof(path), SYS_CPUIDLE, c->cpu_id, k, "time");
+			if (access(sys_path(path, root_path, sizeof(root_path)), F_OK) == 0)
+				cstate_truncated = true;
+		}
+	}
+	if (!cpu_list->head)
+		count = 0;
+
+	for (k = 0; k < count; k++) {
+		char path[PATH_MAX], *data, *ptr;
+		uint64_t latency = 0;
+
+		(void)snprintf(path, sizeof(path), SYS_CPUIDLE,
+			cpu_list->head->cpu_id, k, "name");
+		if ((data = file_get(path)) != NULL) {
+			if ((ptr = strchr(data, '\n')) != NULL)
+				*ptr = '\0';
+			(void)snprintf(cstate_name[k], sizeof(cstate_name[k]), "%s", data);
+			free(data);
+		} else {
+			(void)snprintf(cstate_name[k], sizeof(cstate_name[k]), "state%d", k);
+		}
+		(void)snprintf(path, sizeof(path), SYS_CPUIDLE,
+			cpu_list->head->cpu_id, k, "latency");
+		(void)sys_read_uint64(path, &latency);
+		cstate_latency[k] = latency;
+	}
+	cstate_count = count;
+
+	return count;
+}
+
+/*
+ *  cstate_close()
+ *	close the cpuidle state counters
+ */
+static void cstate_close(cpu_list_t *cpu_list)
+{
+	cpu_info_t *c;
+	int k;
+
+	for (c = cpu_list->head; c; c = c->next) {
+		for (k = 0; k < MAX_CSTATES; k++) {
+			if (c->cstate_time_fd[k] >= 0)
+				(void)close(c->cstate_time_fd[k]);
+			if (c->cstate_usage_fd[k] >= 0)
+				(void)close(c->cstate_usage_fd[k]);
+			c->cstate_time_fd[k] = -1;
+			c->cstate_usage_fd[k] = -1;
+		}
+	}
+	cstate_count = 0;
+}
+
+/*
+ *  cstate_read()
+ *	sum the cpuidle state residency time (us) and entries of
+ *	the CPUs into the stats
+ */
+static void cstate_read(cpu_list_t *cpu_list, stats_t *const stats)
+{
+	cpu_info_t *c;
+	int k;
+
+	for (k = 0; k < cstate_count; k++) {
+		stats->value[CSTATE_TIME_0 + k] = 0.0;
+		stats->value[CSTATE_USAGE_0 + k] = 0.0;
+		stats->inaccurate[CSTATE_TIME_0 + k] = false;
+		stats->inaccurate[CSTATE_USAGE_0 + k] = false;
+
+		for (c = cpu_list->head; c; c = c->next) {
+			uint64_t val;
+
+			if (pread_uint64(c->cstate_time_fd[k], &val) == 0)
+				stats->value[CSTATE_TIME_0 + k] += (double)val;
+			else
+				stats->inaccurate[CSTATE_TIME_0 + k] = true;
+			if (pread_uint64(c->cstate_usage_fd[k], &val) == 0)
+				stats->value[CSTATE_USAGE_0 + k] += (double)val;
+			else
+				stats->inaccurate[CSTATE_USAGE_0 + k] = true;
+		}
+	}
+}
+
+/*
+ *  cstate_limit()
+ *	make state the deepest cpuidle state the CPUs can enter, with
+ *	the stateK/disable controls, saving their original settings,
+ *	or if these cannot be written with a PM QoS CPU latency request
+ *	of the state's exit latency, held until cstate_restore()
+ */
+static int cstate_limit(cpu_list_t *cpu_list, const int state)
+{
+	cpu_info_t *c;
+	int k;
+	int32_t latency;
+
+	for (c = cpu_list->head; c; c = c->next) {
+		for (k = 0; k < cstate_count; k++) {
+			char path[PATH_MAX];
+			uint64_t val;
+
+			(void)snprintf(path, sizeof(path), SYS_CPUIDLE, c->cpu_id, k, "disable");
+			if ((c->cstate_disable[k] < 0) && (sys_read_uint64(path, &val) == 0))
+				c->cstate_disable[k] = (int)val;
+			if (sys_write_uint64(path, k > state) < 0)
+				goto qos;
+		}
+	}
+	return 0;
+
+qos:
+	if (cstate_qos_fd < 0) {
+		if ((cstate_qos_fd = open(DEV_CPU_DMA_LATENCY, O_WRONLY)) < 0) {
+			(void)fprintf(stderr, "Cannot limit the idle states with the "
+				"cpuidle disable controls or %s, errno=%d (%s).\n",
+				DEV_CPU_DMA_LATENCY, errno, strerror(errno));
+			return -1;
+		}
+	}
+	latency = (int32_t)cstate_latency[state];
+	if (write(cstate_qos_fd, &latency, sizeof(latency)) != sizeof(latency)) {
+		(void)fprintf(stderr, "Cannot write to %s, errno=%d (%s).\n",
+			DEV_CPU_DMA_LATENCY, errno, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *  cstate_restore()
+ *	restore the cpuidle state controls saved by cstate_limit()
+ *	and drop any PM QoS CPU latency request
+ */
+static void cstate_restore(cpu_list_t *cpu_list)
+{
+	cpu_info_t *c;
+	int k;
+
+	for (c = cpu_list->head; c; c = c->next) {
+		for (k = 0; k < MAX_CSTATES; k++) {
+			if (c->cstate_disable[k] >= 0) {
+				char path[PATH_MAX];
+
+				(void)snprintf(path, sizeof(path), SYS_CPUIDLE,
+					c->cpu_id, k, "disable");
+				(void)sys_write_uint64(path, (uint64_t)c->cstate_disable[k]);
+				c->cstate_disable[k] = -1;
+			}
+		}
+	}
+	if (cstate_qos_fd >= 0) {
+		(void)close(cstate_qos_fd);
+		cstate_qos_fd = -1;
+	}
+}
+
+/*
+ *  show_cstates()
+ *	show the cpuidle state residency and entry rate from the
+ *	averaged stats of a run
+ */
+static void show_cstates(const stats_t *const stats, const uint32_t cpus)
+{
+	int k;
+
+	if (!cstate_count)
+		return;
+
+	(void)printf("%10.10s C-states:", "");
+	for (k = 0; k < cstate_count; k++) {
+		char entries[16];
+
+		value_to_str(stats->value[CSTATE_USAGE_0 + k],
+			stats->inaccurate[CSTATE_USAGE_0 + k], entries, sizeof(entries));
+		/* Time is us per second summed over the CPUs */
+		(void)printf(" %s %.1f%% %s/s", cstate_name[k],
+			stats->value[CSTATE_TIME_0 + k] / (10000.0 * cpus), entries);
+	}
+	(void)printf("\n");
+}
+
+/*
+ *  stats_read()
+ *	gather pertinent /proc/stat data
+ */
+static int stats_read(
+	cpu_list_t *cpu_list,
+	const int32_t num_cpus,
+	stats_t *const stats,
+	telemetry_t *telemetry)
+{
+	int i, j;
+
+	static const int indices[] = {
+		CPU_USER, CPU_NICE, CPU_SYS, CPU_IDLE,
+		CPU_IOWAIT, CPU_IRQ, CPU_SOFTIRQ, CPU_CTXT,
+		CPU_INTR, CPU_PROCS_RUN, CPU_PROCS_BLK, -1
+	};
+
+	for (i = 0; (j = indices[i]) != -1; i++) {
+		stats->value[j] = 0.0;
+		stats->inaccurate[j] = true;
+	}
+
+	if (proc_stat_read(stats) < 0)
+		return -1;
+
+	stats->value[BOGO_OPS] = 0;
+	stats->inaccurate[BOGO_OPS] = false;
+	for (i = 0; i < num_cpus; i++) {
+		telemetry_t snapshot;
+
+		telemetry_read(telemetry_get(telemetry, i), &snapshot);
+		stats->value[BOGO_OPS] += (double)snapshot.ops;
+	}
+	cstate_read(cpu_list, stats);
+
+	return 0;
+}
+
+/*
+ *  stats_sane()
+ *	check if stats are accurate and calculate a
+ *	sane -ve delta
+ */
+static double stats_sane(
+	const stats_t *const s1,
+	const stats_t *const s2,
+	const int index)
+{
+	double ret;
+
+	/* Discard inaccurate or empty stats */
+	if (s1->inaccurate[index] || s2->inaccurate[index])
+		return 0.0;
+
+	/*
+	 *  On Nexus 4 we occasionally get idle time going backwards so
+	 *  work around this by ensuring we don't get -ve deltas.
+	 */
+	ret = s2->value[index] - s1->value[index];
+	return ret < 0.0 ? 0.0 : ret;
+}
+
+#define INACCURATE(s1, s2, index)       \
+	(s1->inaccurate[index] | s2->inaccurate[index])
+
+/*
+ *  stats_gather()
+ *	gather up delta between last stats and current to get
+ * 	some form of per sample accounting calculated.
+ */
+static bool stats_gather(
+	cpu_list_t *cpu_list,
+	const uint32_t sample_delay,
+	const stats_t *const s1,
+	const stats_t *const s2,
+	stats_t *const res)
+{
+	double total;
+	int i, j;
+	bool inaccurate = false;
+
+	static const int indices[] = {
+		CPU_USER, CPU_NICE, CPU_SYS, CPU_IDLE,
+		CPU_IOWAIT, -1
+	};
+
+	res->value[CPU_USER]    = stats_sane(s1, s2, CPU_USER);
+	res->value[CPU_NICE]    = stats_sane(s1, s2, CPU_NICE);
+	res->value[CPU_SYS]     = stats_sane(s1, s2, CPU_SYS);
+	res->value[CPU_IDLE]    = stats_sane(s1, s2, CPU_IDLE);
+	res->value[CPU_IOWAIT]  = stats_sane(s1, s2, CPU_IOWAIT);
+	res->value[CPU_IRQ]     = stats_sane(s1, s2, CPU_IRQ);
+	res->value[CPU_SOFTIRQ] = stats_sane(s1, s2, CPU_SOFTIRQ);
+	res->value[CPU_CTXT]	= stats_sane(s1, s2, CPU_CTXT);
+	res->value[CPU_INTR]	= stats_sane(s1, s2, CPU_INTR);
+	res->value[BOGO_OPS]	= stats_sane(s1, s2, BOGO_OPS);
+
+	for (i = 0; i < perf_events; i++) {
+		res->value[PERF_EVENT_0 + i] = 0.0;
+		res->inaccurate[PERF_EVENT_0 + i] = false;
+	}
+
+#if defined(PERF_ENABLED)
+	if (perf_enabled) {
+		cpu_info_t *c;
+
+		for (c = cpu_list->head; c; c = c->next) {
+			for (i = 0; i < perf_events; i++) {
+				double value;
+
+				perf_counter(&c->perf, i, &value);
+				if (value > 0.0)
+					res->value[PERF_EVENT_0 + i] += value;
+			}
+		}
+	}
+#else
+	(void)cpu_list;
+#endif
+
+	for (i = 0; (j = indices[i]) != -1; i++)
+		inaccurate |= (s1->inaccurate[j] | s2->inaccurate[j]);
+
+	total = res->value[CPU_USER] + res->value[CPU_NICE] +
+		res->value[CPU_SYS] + res->value[CPU_IDLE] +
+		res->value[CPU_IOWAIT];
+
+	/*
+	 * This should not happen, but we need to avoid division
+	 * by zero or weird results if the data is deemed valid
+	 */
+	if (!inaccurate && total <= 0.0)
+		return false;
+
+	for (i = 0; (j = indices[i]) != -1; i++) {
+		res->value[j] = (INACCURATE(s1, s2, j) || (total <= 0.0)) ?
+		NAN : (100.0 * res->value[j]) / total;
+	}
+	res->value[CPU_CTXT] = (INACCURATE(s1, s2, CPU_CTXT) ||
+				(sample_delay <= 0.0)) ?
+		NAN : res->value[CPU_CTXT] / sample_delay;
+	res->value[CPU_INTR] = (INACCURATE(s1, s2, CPU_INTR) ||
+				(sample_delay <= 0.0)) ?
+		NAN : res->value[CPU_INTR] / sample_delay;
+	res->value[BOGO_OPS] = (INACCURATE(s1, s2, BOGO_OPS) ||
+				(sample_delay <= 0.0)) ?
+		NAN : res->value[BOGO_OPS] / sample_delay;
+	res->value[CPU_PROCS_RUN] = s2->inaccurate[CPU_PROCS_RUN] ?
+		NAN : s2->value[CPU_PROCS_RUN];
+	res->value[CPU_PROCS_BLK] = s2->inaccurate[CPU_PROCS_BLK] ?
+		NAN : s2->value[CPU_PROCS_BLK];
+	for (i = 0; i < cstate_count; i++) {
+		/* Residency time then entries of state i */
+		for (j = CSTATE_TIME_0 + i; j < MAX_VALUES; j += MAX_CSTATES) {
+			res->inaccurate[j] = INACCURATE(s1, s2, j) || (sample_delay <= 0.0);
+			res->value[j] = res->inaccurate[j] ?
+				NAN : stats_sane(s1, s2, j) / sample_delay;
+		}
+	}
+	cpu_util_gather(cpu_util);
+
+	return true;
+}
+
+/*
+ *  stats_headings()
+ *	dump heading columns
+ */
+static void stats_headings(const char *test)
+{
+	(void)printf("%10.10s  User   Sys  Idle  Run  Ctxt/s  IRQ/s  Ops/s", test);
+#if defined(PERF_ENABLED)
+	if (perf_enabled) {
+		int i;
+
+		for (i = 0; i < perf_events; i++)
+			(void)printf(" %6.6s", perf_event_info(i)->label);
+	}
+#endif
+	if (energy_sampler)
+		(void)printf("  Watts  PeakW  SDevW\n");
+	else
+		(void)printf("  Watts\n");
+}
+
+/*
+ *  stats_print()
+ *	print out statistics with accuracy depending if it's a summary or not
+ */
+static void stats_print(
+	const char *const prefix,
+	const bool summary,
+	const stats_t *const s)
+{
+	char buf[10], bogo_ops[10];
+	char *fmt;
+
+	if (summary) {
+		if (s->inaccurate[POWER_NOW])
+			(void)snprintf(buf, sizeof(buf), "-N/A-");
+		else
+			(void)snprintf(buf, sizeof(buf), "%6.3f", s->value[POWER_NOW]);
+	} else {
+		(void)snprintf(buf, sizeof(buf), "%6.3f%s", s->value[POWER_NOW],
+			s->inaccurate[POWER_NOW] ? "E" : "");
+	}
+
+	value_to_str(s->value[BOGO_OPS], s->inaccurate[BOGO_OPS],
+		bogo_ops, sizeof(bogo_ops));
+	fmt = summary ?
+		"%10.10s %5.1f %5.1f %5.1f %4.1f %7.1f %6.1f %6s" :
+		"%10.10s %5.1f %5.1f %5.1f %4.0f %7.0f %6.0f %6s";
+	(void)printf(fmt,
+		prefix,
+		s->value[CPU_USER], s->value[CPU_SYS], s->value[CPU_IDLE],
+		s->value[CPU_PROCS_RUN], s->value[CPU_CTXT],
+		s->value[CPU_INTR], bogo_ops);
+	if (perf_enabled) {
+		int i;
+
+		for (i = 0; i < perf_events; i++) {
+			char event[10];
+
+			value_to_str(s->value[PERF_EVENT_0 + i],
+				s->inaccurate[PERF_EVENT_0 + i],
+				event, sizeof(event));
+			(void)printf(" %6s", event);
+		}
+	}
+	if (energy_sampler)
+		(void)printf(" %6s %6.3f %6.3f\n", buf,
+			s->value[POWER_PEAK], s->value[POWER_STDDEV]);
+	else
+		(void)printf(" %s\n", buf);
+}
+
+/*
+ *  stats_average_stddev_min_max()
+ *	calculate average, std deviation, min and max
+ */
+static void stats_average_stddev_min_max(
+	const stats_t *const stats,
+	const int num,
+	stats_t *const average,
+	stats_t *const stddev)
+{
+	int i, j, valid;
+
+	for (j = 0; j < MAX_VALUES; j++) {
+		double total = 0.0;
+
+		for (valid = 0, i = 0; i < num; i++) {
+			if (!stats[i].inaccurate[j]) {
+				total += stats[i].value[j];
+				valid++;
+			}
+		}
+
+		if (valid) {
+			average->value[j] = total / (double)valid;
+			total = 0.0;
+			for (i = 0; i < num; i++) {
+				if (!stats[i].inaccurate[j]) {
+					double diff = (double)stats[i].value[j]
+						- average->value[j];
+					diff = diff * diff;
+					total += diff;
+				}
+			}
+			stddev->value[j] = total / (double)num;
+			stddev->value[j] = sqrt(stddev->value[j]);
+		} else {
+			average->inaccurate[j] = true;
+			stddev->inaccurate[j] = true;
+
+			average->value[j] = 0.0;
+			stddev->value[j] = 0.0;
+		}
+	}
+}
+
+/*
+ *  battery_attr_open()
+ *	open a power supply attribute, returns -1 if it is not present
+ */
+static int battery_attr_open(const char *name, const char *attr)
+{
+	char path[PATH_MAX];
+
+	(void)snprintf(path, sizeof(path), "%s/%s/%s",
+		SYS_CLASS_POWER_SUPPLY, name, attr);
+	return sys_open(path, O_RDONLY);
+}
+
+/*
+ *  battery_free_list()
+ *	free list of batteries and close their attributes
+ */
+static void battery_free_list(battery_info_t *batteries)
+{
+	battery_info_t *battery = batteries;
+
+	while (battery) {
+		battery_info_t *next = battery->next;
+
+		if (battery->status_fd >= 0)
+			(void)close(battery->status_fd);
+		if (battery->power_now_fd >= 0)
+			(void)close(battery->power_now_fd);
+		if (battery->current_now_fd >= 0)
+			(void)close(battery->current_now_fd);
+		if (battery->voltage_now_fd >= 0)
+			(void)close(battery->voltage_now_fd);
+		free(battery->name);
+		free(battery);
+		battery = next;
+	}
+}
+
+/*
+ *  battery_get_list()
+ *	find the batteries in /sys/class/power_supply and open
+ *	the attributes read on each sample, returns the number of
+ *	batteries found or -1 on error
+ */
+static int battery_get_list(battery_info_t **batteries)
+{
+	DIR *dir;
+	struct dirent *dirent;
+	int n = 0;
+
+	if ((dir = sys_opendir(SYS_CLASS_POWER_SUPPLY)) == NULL)
+		return 0;
+
+	battery_sys_fs = true;
+	while ((dirent = readdir(dir)) != NULL) {
+		battery_info_t *battery;
+		char path[PATH_MAX];
+		char *data;
+		bool mismatch;
+
+		if (strlen(dirent->d_name) <= 2)
+			continue;
+
+		/* Check that type field matches the expected type */
+		(void)snprintf(path, sizeof(path), "%s/%s/type",
+			SYS_CLASS_POWER_SUPPLY, dirent->d_name);
+		if ((data = file_get(path)) == NULL)
+			continue;	/* can't check type, skip this entry */
+		mismatch = (strstr(data, "Battery") == NULL);
+		free(data);
+		if (mismatch)
+			continue;	/* type don't match, skip this entry */
+
+		if ((battery = calloc(1, sizeof(*battery))) == NULL) {
+			(void)fprintf(stderr, "Cannot allocate battery information.\n");
+			goto err;
+		}
+		battery->next = *batteries;
+		*batteries = battery;
+		battery->status_fd = -1;
+		battery->power_now_fd = -1;
+		battery->current_now_fd = -1;
+		battery->voltage_now_fd = -1;
+
+		if ((battery->name = strdup(dirent->d_name)) == NULL) {
+			(void)fprintf(stderr, "Cannot allocate battery information.\n");
+			goto err;
+		}
+		battery->status_fd = battery_attr_open(dirent->d_name, "status");
+		battery->power_now_fd = battery_attr_open(dirent->d_name, "power_now");
+		battery->current_now_fd = battery_attr_open(dirent->d_name, "current_now");
+		battery->voltage_now_fd = battery_attr_open(dirent->d_name, "voltage_now");
+		if (battery->status_fd < 0) {
+			(void)fprintf(stderr, "Battery %s present but under supported - "
+				"no state present.\n", dirent->d_name);
+			goto err;
+		}
+		n++;
+	}
+	(void)closedir(dir);
+
+	return n;
+err:
+	(void)closedir(dir);
+	battery_free_list(*batteries);
+	*batteries = NULL;
+	return -1;
+}
+
+/*
+ *  power_get_sys_fs()
+ *	get power discharge rate from the batteries found by
+ *	battery_get_list(), only the open attributes are read
+ */
+static int power_get_sys_fs(
+	stats_t *stats,
+	bool *const discharging,
+	bool *const inaccurate)
+{
+	battery_info_t *battery;
+	double total_watts = 0.0;
+	double average_voltage = 0.0;
+	int n = 0;
+
+	stats->value[POWER_NOW] = 0.0;
+	stats->value[VOLTAGE_NOW] = 0.0;
+	stats->value[CURRENT_NOW] = 0.0;
+	*discharging = false;
+	*inaccurate = true;
+
+	for (battery = battery_list; battery; battery = battery->next) {
+		char buffer[32];
+		ssize_t ret;
+		int64_t val;
+		double voltage = 0.0;
+		double amps_rate = 0.0;
+		double watts_rate = 0.0;
+
+		ret = pread(battery->status_fd, buffer, sizeof(buffer) - 1, 0);
+		if ((ret > 0) && !strncmp(buffer, "Discharging", 11))
+			*discharging = true;
+		if ((battery->current_now_fd >= 0) &&
+		    (pread_int64(battery->current_now_fd, &val) == 0))
+			amps_rate = (double)val / 1000000.0;
+		if ((battery->power_now_fd >= 0) &&
+		    (pread_int64(battery->power_now_fd, &val) == 0))
+			watts_rate = (double)val / 1000000.0;
+		if ((battery->voltage_now_fd >= 0) &&
+		    (pread_int64(battery->voltage_now_fd, &val) == 0))
+			voltage = (double)val / 1000000.0;
+
+		average_voltage += voltage;
+		total_watts     += watts_rate + voltage * amps_rate;
+		n++;
+	}
+
+#if DETECT_DISCHARGING
+	if (! *discharging) {
+		(void)printf("Machine is not discharging, cannot measure power usage.\n");
+#if defined(RAPL_X86)
+		(void)printf("Alternatively, use the RAPL power measuring option '-R'.\n");
+#endif
+		return -1;
+	}
+#else
+	*discharging = true;
+#endif
+
+	/*
+ 	 *  If the battery is helpful it supplies the rate already, in which case
+	 *  we know the results from the battery are as good as we can and we don't
+	 *  have to figure out anything from capacity change over time.
+	 */
+	if (total_watts > RATE_ZERO_LIMIT) {
+		stats->value[POWER_NOW] = total_watts;
+		stats->value[VOLTAGE_NOW] = average_voltage / (double)n;
+		stats->value[CURRENT_NOW] = total_watts / average_voltage;
+		*inaccurate = (total_watts < 0.0);
+		return 0;
+	}
+
+	/*
+	 *  Rate not known, battery is less than useful.  We could
+	 *  calculate it from delta in charge, but that is not accurate
+	 *  for this kind of use case, so error out instead.
+	 */
+	(void)fprintf(stderr, "The battery just provided charge data which is not accurate enough.\n");
+	return -1;
+}
+
+/*
+ *  power_get_proc_acpi()
+ *	get power discharge rate from battery via /proc/acpi interface
+ */
+static int power_get_proc_acpi(
+	stats_t *stats,
+	bool *const discharging,
+	bool *const inaccurate)
+{
+	DIR *dir;
+	FILE *file;
+	struct dirent *dirent;
+	char filename[PATH_MAX];
+	double total_watts = 0.0;
+	double average_voltage = 0.0;
+	int n = 0;
+
+	stats->value[POWER_NOW] = 0.0;
+	stats->value[VOLTAGE_NOW] = 0.0;
+	stats->value[CURRENT_NOW] = 0.0;
+	*discharging = false;
+	*inaccurate = true;
+
+	if ((dir = sys_opendir(PROC_ACPI_BATTERY)) == NULL) {
+		(void)fprintf(stderr, "Machine does not have %s, cannot run the test.\n",
+			PROC_ACPI_BATTERY);
+		return -1;
+	}
+
+	while ((dirent = readdir(dir))) {
+		double voltage = 0.0;
+		double amps_rate = 0.0;
+		double watts_rate = 0.0;
+		char buffer[4096];
+		char *ptr;
+
+		if (strlen(dirent->d_name) < 3)
+			continue;
+
+		(void)sprintf(filename, "/proc/acpi/battery/%s/state", dirent->d_name);
+		if ((file = sys_fopen(filename, "r")) == NULL)
+			continue;
+
+		(void)memset(buffer, 0, sizeof(buffer));
+		while (fgets(buffer, sizeof(buffer), file) != NULL) {
+			if (strstr(buffer, "present:") &&
+			    strstr(buffer, "no"))
+				break;
+
+			if (strstr(buffer, "charging state:") &&
+			    (strstr(buffer, "discharging") || strstr(buffer, "critical")))
+				*discharging = true;
+
+			ptr = strchr(buffer, ':');
+			if (ptr) {
+				ptr++;
+				if (strstr(buffer, "present voltage"))
+					voltage = strtoull(ptr, NULL, 10) / 1000.0;
+
+				if (strstr(buffer, "present rate")) {
+					if (strstr(ptr, "mW"))
+						watts_rate = strtoull(ptr, NULL, 10) / 1000.0 ;
+					if (strstr(ptr, "mA"))
+						amps_rate = strtoull(ptr, NULL, 10) / 1000.0;
+				}
+			}
+		}
+		(void)fclose(file);
+
+		/*
+		 * Some HP firmware is broken and has an undefined
+		 * 'present voltage' field and instead returns this in
+		 * the design_voltage field, so work around this.
+		 */
+		if (FLOAT_CMP(voltage, 0.0)) {
+			sprintf(filename, "/proc/acpi/battery/%s/info",
+				dirent->d_name);
+			if ((file = sys_fopen(filename, "r")) != NULL) {
+				while (fgets(buffer, sizeof(buffer), file) != NULL) {
+					ptr = strchr(buffer, ':');
+					if (ptr) {
+						ptr++;
+						if (strstr(buffer, "design voltage:")) {
+							voltage = strtoull(ptr, NULL, 10) / 1000.0;
+							break;
+						}
+					}
+				}
+				(void)fclose(file);
+			}
+		}
+
+		average_voltage += voltage;
+		total_watts     += watts_rate + voltage * amps_rate;
+		n++;
+	}
+	(void)closedir(dir);
+
+#if DETECT_DISCHARGING
+	if (! *discharging) {
+		printf("Machine is indicating it is not discharging and hence "
+		       "we cannot measure power usage.\n");
+		return -1;
+	}
+#else
+	*discharging = true;
+#endif
+
+	/*
+ 	 * If the battery is helpful it supplies the rate already, in which
+	 * case we know the results from the battery are as good as we can
+	 * and we don't have to figure out anything from capacity change over
+	 * time.
+	 */
+	if (total_watts > RATE_ZERO_LIMIT) {
+		stats->value[POWER_NOW] = total_watts;
+		stats->value[VOLTAGE_NOW] = average_voltage / (double)n;
+		stats->value[CURRENT_NOW] = total_watts / average_voltage;
+		*inaccurate = (total_watts < 0.0);
+		return 0;
+	}
+
+	/*
+	 *  Rate not known, battery is less than useful.  We could
+	 *  calculate it from delta in charge, but that is not accurate
+	 *  for this kind of use case, so error out instead.
+	 */
+	(void)fprintf(stderr, "The battery just provided charge data which is not accurate enough.\n");
+	return -1;
+}
+
+#if defined(RAPL_X86)
+
+/*
+ *  rapl_free_list()
+ *	free RAPL list
+ */
+static void rapl_free_list(rapl_info_t *rapl_list)
+{
+	rapl_info_t *rapl = rapl_list;
+
+	while (rapl) {
+		rapl_info_t *next = rapl->next;
+
+		if (rapl->fd > -1)
+			(void)close(rapl->fd);
+		free(rapl->name);
+		free(rapl->domain_name);
+		free(rapl);
+		rapl = next;
+	}
+}
+
+/*
+ *  rapl_get_domains()
+ */
+static int rapl_get_domains(rapl_info_t **rapl_list)
+{
+	DIR *dir;
+        struct dirent *entry;
+	int n = 0;
+
+	dir = sys_opendir("/sys/class/powercap");
+	if (dir == NULL) {
+		printf("Cannot open /sys/class/powercap, cannot measure power usage, try running as root.\n");
+		return -1;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		char path[PATH_MAX];
+		FILE *fp;
+		rapl_info_t *rapl;
+
+		/* Ignore non Intel RAPL interfaces */
+		if (strncmp(entry->d_name, "intel-rapl", 10))
+			continue;
+
+		if ((rapl = calloc(1, sizeof(*rapl))) == NULL) {
+			fprintf(stderr, "Cannot allocate RAPL information.\n");
+			closedir(dir);
+			return -1;
+		}
+		rapl->fd = -1;
+		rapl->msr = -1;
+		if ((rapl->name = strdup(entry->d_name)) == NULL) {
+			fprintf(stderr, "Cannot allocate RAPL name information.\n");
+			closedir(dir);
+			free(rapl);
+			return -1;
+		}
+		(void)snprintf(path, sizeof(path),
+			"/sys/class/powercap/%s/max_energy_range_uj",
+			entry->d_name);
+
+		rapl->max_energy_uj = 0.0;
+		if ((fp = sys_fopen(path, "r")) != NULL) {
+			if (fscanf(fp, "%lf\n", &rapl->max_energy_uj) != 1)
+				rapl->max_energy_uj = 0.0;
+			(void)fclose(fp);
+		}
+		(void)snprintf(path, sizeof(path),
+			"/sys/class/powercap/%s/name",
+			entry->d_name);
+
+		rapl->domain_name = NULL;
+		if ((fp = sys_fopen(path, "r")) != NULL) {
+			char domain_name[128];
+
+			if (fgets(domain_name, sizeof(domain_name), fp) != NULL) {
+				domain_name[strcspn(domain_name, "\n")] = '\0';
+				rapl->domain_name = strdup(domain_name);
+			}
+			(void)fclose(fp);
+		}
+		if (rapl->domain_name == NULL) {
+			free(rapl->name);
+			free(rapl);
+			continue;
+		}
+
+		/* Keep energy_uj open, it is read on every sample */
+		(void)snprintf(path, sizeof(path),
+			"/sys/class/powercap/%s/energy_uj",
+			entry->d_name);
+		if ((rapl->fd = sys_open(path, O_RDONLY)) < 0) {
+			free(rapl->domain_name);
+			free(rapl->name);
+			free(rapl);
+			continue;
+		}
+
+		rapl->is_package = (strncmp(rapl->domain_name, "package-", 8) == 0);
+		rapl->is_dram = (strcmp(rapl->domain_name, "dram") == 0);
+		rapl->next = *rapl_list;
+		*rapl_list = rapl;
+		n++;
+	}
+	(void)closedir(dir);
+
+	if (!n)
+		(void)printf("Cannot detect any RAPL domains, cannot power measure power usage, try running as root.\n");
+	return n;
+}
+
+/*
+ *  rapl_read_energy_uj()
+ *	read a RAPL domain's energy counter in microjoules, either
+ *	from the powercap energy_uj file or from the energy status MSR
+ */
+static int rapl_read_energy_uj(const rapl_info_t *rapl, double *energy_uj)
+{
+	uint64_t val;
+
+	if (rapl->msr >= 0) {
+		if (pread(rapl->fd, &val, sizeof(val), (off_t)rapl->msr) != sizeof(val))
+			return -1;
+		/* Energy status is a 32 bit counter in energy units */
+		*energy_uj = (double)(val & 0xffffffffULL) * rapl->energy_unit_uj;
+		return 0;
+	}
+	if (pread_uint64(rapl->fd, &val) < 0)
+		return -1;
+	*energy_uj = (double)val;
+	return 0;
+}
+
+/*
+ *  rapl_msr_open()
+ *	open the MSR device of a CPU
+ */
+static int rapl_msr_open(const char *msr_path, const int cpu)
+{
+	char path[PATH_MAX];
+	const char *pos = strstr(msr_path, "%d");
+
+	/* Substitute the CPU number, the path is never used as a format */
+	if (pos)
+		(void)snprintf(path, sizeof(path), "%.*s%d%s",
+			(int)(pos - msr_path), msr_path, cpu, pos + 2);
+	else
+		(void)snprintf(path, sizeof(path), "%s", msr_path);
+
+	return open(path, O_RDONLY);
+}
+
+/*
+ *  rapl_dram_fixed_unit()
+ *	true if the CPU is an Intel server part whose DRAM energy
+ *	status counts in a fixed 2^-16 J (15.3 uJ) unit rather than
+ *	the MSR_RAPL_POWER_UNIT energy unit, the same models the
+ *	kernel intel_rapl driver applies its DRAM unit quirk to
+ */
+static bool rapl_dram_fixed_unit(void)
+{
+	static const int models[] = {
+		63,	/* Haswell-X */
+		79,	/* Broadwell-X */
+		86,	/* Broadwell-D */
+		85,	/* Skylake-X, Cascade Lake, Cooper Lake */
+		87,	/* Xeon Phi Knights Landing */
+		133,	/* Xeon Phi Knights Mill */
+		106,	/* Ice Lake-X */
+		108,	/* Ice Lake-D */
+		143,	/* Sapphire Rapids-X */
+		207,	/* Emerald Rapids-X */
+	};
+	char buffer[256];
+	bool intel = false;
+	int family = -1, model = -1;
+	size_t i;
+	FILE *fp;
+
+	if ((fp = sys_fopen(PROC_CPUINFO, "r")) == NULL)
+		return false;
+	/* The first CPU's fields are enough, they end at a blank line */
+	while (fgets(buffer, sizeof(buffer), fp) && (buffer[0] != '\n')) {
+		char *val = strchr(buffer, ':'), *end;
+
+		if (!val)
+			continue;
+		/* Split into the field name, without its padding, and value */
+		for (end = val; (end > buffer) && isspace((unsigned char)end[-1]); end--)
+			;
+		*end = '\0';
+		val++;
+		if (!strcmp(buffer, "vendor_id"))
+			intel = (strstr(val, "GenuineIntel") != NULL);
+		else if (!strcmp(buffer, "cpu family"))
+			family = atoi(val);
+		else if (!strcmp(buffer, "model"))
+			model = atoi(val);
+	}
+	(void)fclose(fp);
+
+	if (!intel || (family != 6))
+		return false;
+	for (i = 0; i < sizeof(models) / sizeof(models[0]); i++)
+		if (model == models[i])
+			return true;
+	return false;
+}
+
+/*
+ *  rapl_get_domains_msr()
+ *	get RAPL domains from the energy status MSRs of the
+ *	first CPU of each package
+ */
+static int rapl_get_domains_msr(
+	rapl_info_t **rapl_list,
+	const char *msr_path,
+	const int32_t max_cpus)
+{
+	static const struct {
+		const char *name;	/* domain name */
+		int64_t	msr;		/* energy status MSR */
+		bool	is_package;	/* package domain */
+	} domains[] = {
+		{ "package",	MSR_PKG_ENERGY_STATUS,	true },
+		{ "core",	MSR_PP0_ENERGY_STATUS,	false },
+		{ "uncore",	MSR_PP1_ENERGY_STATUS,	false },
+		{ "dram",	MSR_DRAM_ENERGY_STATUS,	false },
+	};
+	const bool dram_fixed_unit = rapl_dram_fixed_unit();
+	bool package_seen[max_cpus];
+	int cpu, n = 0;
+
+	(void)memset(package_seen, 0, sizeof(package_seen));
+
+	for (cpu = 0; cpu < max_cpus; cpu++) {
+		char path[PATH_MAX], *data;
+		int package = 0, fd;
+		uint64_t units;
+		double energy_unit_uj;
+		size_t i;
+
+		(void)snprintf(path, sizeof(path),
+			"/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+		if ((data = file_get(path)) != NULL) {
+			package = atoi(data);
+			free(data);
+		} else if (cpu > 0) {
+			/* No topology, just use the first CPU */
+			break;
+		}
+		if ((package < 0) || (package >= max_cpus) || package_seen[package])
+			continue;
+		package_seen[package] = true;
+
+		if ((fd = rapl_msr_open(msr_path, cpu)) < 0)
+			continue;
+		if (pread(fd, &units, sizeof(units), MSR_RAPL_POWER_UNIT) != sizeof(units)) {
+			(void)close(fd);
+			continue;
+		}
+		(void)close(fd);
+		/* Energy status units are 1 / 2^ESU Joules, ESU is bits 12:8 */
+		energy_unit_uj = 1000000.0 / (double)(1ULL << ((units >> 8) & 0x1f));
+
+		for (i = 0; i < sizeof(domains) / sizeof(domains[0]); i++) {
+			rapl_info_t *rapl;
+			uint64_t val;
+			char name[64];
+
+			if ((fd = rapl_msr_open(msr_path, cpu)) < 0)
+				continue;
+			/* Unsupported domains read back as zero or fail */
+			if ((pread(fd, &val, sizeof(val), (off_t)domains[i].msr) != sizeof(val)) ||
+			    ((val & 0xffffffffULL) == 0)) {
+				(void)close(fd);
+				continue;
+			}
+			if ((rapl = calloc(1, sizeof(*rapl))) == NULL) {
+				(void)fprintf(stderr, "Cannot allocate RAPL information.\n");
+				(void)close(fd);
+				return -1;
+			}
+			(void)snprintf(name, sizeof(name), "msr-%d-%s", package, domains[i].name);
+			rapl->name = strdup(name);
+			if (domains[i].is_package)
+				(void)snprintf(name, sizeof(name), "package-%d", package);
+			else
+				(void)snprintf(name, sizeof(name), "%s", domains[i].name);
+			rapl->domain_name = strdup(name);
+			if (!rapl->name || !rapl->domain_name) {
+				(void)fprintf(stderr, "Cannot allocate RAPL name information.\n");
+				free(rapl->name);
+				free(rapl->domain_name);
+				free(rapl);
+				(void)close(fd);
+				return -1;
+			}
+			rapl->fd = fd;
+			rapl->msr = domains[i].msr;
+			rapl->is_package = domains[i].is_package;
+			rapl->is_dram = (domains[i].msr == MSR_DRAM_ENERGY_STATUS);
+			rapl->energy_unit_uj = (rapl->is_dram && dram_fixed_unit) ?
+				MSR_DRAM_ENERGY_UNIT_UJ : energy_unit_uj;
+			rapl->max_energy_uj = 4294967296.0 * rapl->energy_unit_uj;
+			rapl->next = *rapl_list;
+			*rapl_list = rapl;
+			n++;
+		}
+	}
+
+	if (!n)
+		(void)printf("Cannot read any RAPL MSRs from %s, cannot measure power usage, "
+			"try running as root with the msr module loaded.\n", msr_path);
+	return n;
+}
+
+/*
+ *  power_get_rapl()
+ *	get power discharge rate from battery via the RAPL interface
+ */
+static int power_get_rapl(
+	rapl_info_t *rapl_list,
+	stats_t *stats,
+	bool *const discharging)
+{
+	double t_now;
+	static bool first = true;
+	rapl_info_t *rapl;
+	int n = 0;
+
+	/* Assume OK until found otherwise */
+	stats->inaccurate[POWER_NOW] = false;
+	stats->value[POWER_NOW] = 0.0;
+	*discharging = false;
+
+	t_now = gettime_to_double();
+
+	for (rapl = rapl_list; rapl; rapl = rapl->next) {
+		double ujoules;
+
+		if (rapl_read_energy_uj(rapl, &ujoules) == 0) {
+			double t_delta = t_now - rapl->t_last;
+			double last_energy_uj = rapl->last_energy_uj;
+
+			rapl->t_last = t_now;
+			if (n < MAX_POWER_DOMAINS)
+				energy_counter[n] = ujoules / 1000000.0;
+
+			/* Wrapped around since last time? */
+			if (ujoules - rapl->last_energy_uj < 0.0) {
+				rapl->last_energy_uj = ujoules;
+				ujoules += rapl->max_energy_uj;
+			} else {
+				rapl->last_energy_uj = ujoules;
+			}
+
+			if (first || (t_delta <= 0.0)) {
+				stats->value[POWER_DOMAIN_0 + n] = 0.0;
+				stats->inaccurate[POWER_NOW] = true;
+			} else {
+				stats->value[POWER_DOMAIN_0 + n] =
+					(ujoules - last_energy_uj) /
+					(t_delta * 1000000.0);
+			}
+			if (rapl->is_package || (rapl->is_dram && power_dram))
+				stats->value[POWER_NOW] += stats->value[POWER_DOMAIN_0 + n];
+			n++;
+			*discharging = true;
+		}
+	}
+
+	if (first) {
+		stats->inaccurate[POWER_NOW] = true;
+		first = false;
+	}
+
+	if (!n) {
+		(void)printf("Cannot detect any RAPL domains, cannot power measure power usage, try running as root\n");
+		return -1;
+	}
+	return 0;
+}
+/*
+ *  sampler_energy_uj()
+ *	read the total package energy in microjoules, unwrapping
+ *	each domain's counter with the sampler's own state
+ */
+static int sampler_energy_uj(sampler_t *sampler, double *energy_uj)
+{
+	rapl_info_t *rapl;
+	double total = 0.0;
+	int n = 0;
+
+	for (rapl = sampler->rapl_list; rapl && (n < MAX_POWER_DOMAINS);
+	     rapl = rapl->next, n++) {
+		double ujoules;
+
+		/* On a read failure assume no change since last time */
+		if (rapl_read_energy_uj(rapl, &ujoules) < 0)
+			ujoules = sampler->last_uj[n];
+		/* Wrapped around since last time? */
+		if (ujoules < sampler->last_uj[n])
+			sampler->wrap_uj[n] += rapl->max_energy_uj;
+		sampler->last_uj[n] = ujoules;
+		if (rapl->is_package || (rapl->is_dram && power_dram))
+			total += ujoules + sampler->wrap_uj[n];
+	}
+	*energy_uj = total;
+
+	return 0;
+}
+
+/*
+ *  sampler_thread()
+ *	sample RAPL energy at a high rate into the ring buffer
+ */
+static void *sampler_thread(void *arg)
+{
+	sampler_t *sampler = (sampler_t *)arg;
+	struct timespec next;
+	sigset_t set;
+
+	/* Leave signal handling to the main thread */
+	(void)sigfillset(&set);
+	(void)pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (sampler->cpu >= 0)
+		(void)set_affinity(sampler->cpu);
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!sampler->stop) {
+		energy_sample_t *sample;
+		struct timespec now;
+		const uint32_t head = __atomic_load_n(&sampler->head, __ATOMIC_RELAXED);
+		const uint32_t tail = __atomic_load_n(&sampler->tail, __ATOMIC_ACQUIRE);
+
+		next.tv_nsec += sampler->interval_ns;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		(void)clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		if (head - tail >= SAMPLER_RING_SIZE) {
+			sampler->overruns++;
+			continue;
+		}
+		sample = &sampler->ring[head & (SAMPLER_RING_SIZE - 1)];
+		(void)clock_gettime(CLOCK_MONOTONIC, &now);
+		sample->t = (double)now.tv_sec + ((double)now.tv_nsec / 1000000000.0);
+		(void)sampler_energy_uj(sampler, &sample->energy_uj);
+		__atomic_store_n(&sampler->head, head + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/*
+ *  sampler_drain()
+ *	drain the ring buffer and compute mean power, standard
+ *	deviation and peak power of the sampled intervals since
+ *	the last drain, returns the number of intervals
+ */
+static int sampler_drain(
+	sampler_t *sampler,
+	double *power,
+	double *stddev,
+	double *peak)
+{
+	uint32_t tail = __atomic_load_n(&sampler->tail, __ATOMIC_RELAXED);
+	const uint32_t head = __atomic_load_n(&sampler->head, __ATOMIC_ACQUIRE);
+	double sum = 0.0, sum2 = 0.0, t_start = 0.0, e_start = 0.0;
+	int n = 0;
+
+	*power = 0.0;
+	*stddev = 0.0;
+	*peak = 0.0;
+
+	for (; tail != head; tail++) {
+		const energy_sample_t *sample =
+			&sampler->ring[tail & (SAMPLER_RING_SIZE - 1)];
+
+		if (sampler->have_last) {
+			const double dt = sample->t - sampler->last.t;
+
+			if (dt > 0.0) {
+				const double watts = (sample->energy_uj -
+					sampler->last.energy_uj) / (dt * 1000000.0);
+
+				if (!n) {
+					t_start = sampler->last.t;
+					e_start = sampler->last.energy_uj;
+				}
+				sum += watts;
+				sum2 += watts * watts;
+				if (watts > *peak)
+					*peak = watts;
+				n++;
+			}
+		}
+		sampler->last = *sample;
+		sampler->have_last = true;
+	}
+	__atomic_store_n(&sampler->tail, tail, __ATOMIC_RELEASE);
+
+	if (n) {
+		const double mean = sum / (double)n;
+		const double dt = sampler->last.t - t_start;
+		const double var = (sum2 / (double)n) - (mean * mean);
+
+		/* Mean power is total energy over total time */
+		*power = (dt > 0.0) ?
+			(sampler->last.energy_uj - e_start) / (dt * 1000000.0) : mean;
+		*stddev = (var > 0.0) ? sqrt(var) : 0.0;
+	}
+	return n;
+}
+
+/*
+ *  sampler_start()
+ *	start the high rate energy sampler on a housekeeping CPU
+ */
+static sampler_t *sampler_start(
+	rapl_info_t *rapl_list,
+	cpu_list_t *cpu_list,
+	const int32_t max_cpus,
+	const uint32_t interval_ms)
+{
+	sampler_t *sampler;
+	int cpu, ret;
+
+	sampler = mmap(NULL, sizeof(*sampler), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (sampler == MAP_FAILED) {
+		(void)fprintf(stderr, "Cannot allocate energy sampler ring buffer.\n");
+		return NULL;
+	}
+	sampler->rapl_list = rapl_list;
+	sampler->interval_ns = (long)interval_ms * 1000000L;
+
+	/* Use the highest numbered CPU that is not being loaded */
+	sampler->cpu = -1;
+	for (cpu = max_cpus - 1; cpu >= 0; cpu--) {
+		cpu_info_t *c;
+
+		for (c = cpu_list->head; c; c = c->next)
+			if (c->cpu_id == cpu)
+				break;
+		if (!c) {
+			sampler->cpu = cpu;
+			break;
+		}
+	}
+	if (sampler->cpu < 0)
+		(void)fprintf(stderr, "No housekeeping CPU available, energy "
+			"sampler is not pinned and will disturb the load.\n");
+
+	ret = pthread_create(&sampler->thread, NULL, sampler_thread, sampler);
+	if (ret) {
+		(void)fprintf(stderr, "Cannot create energy sampler thread, "
+			"errno=%d (%s).\n", ret, strerror(ret));
+		(void)munmap(sampler, sizeof(*sampler));
+		return NULL;
+	}
+	return sampler;
+}
+
+/*
+ *  sampler_stop()
+ *	stop the energy sampler
+ */
+static void sampler_stop(sampler_t *sampler)
+{
+	if (!sampler)
+		return;
+
+	sampler->stop = true;
+	(void)pthread_join(sampler->thread, NULL);
+	if (sampler->overruns)
+		(void)fprintf(stderr, "Energy sampler dropped %" PRIu64
+			" samples, ring buffer was full.\n", sampler->overruns);
+	(void)munmap(sampler, sizeof(*sampler));
+}
+#endif
+
+#if defined(PERF_ENABLED)
+/*
+ *  power_get_perf_power()
+ *	get power consumption rate via the perf power PMU energy
+ *	events, each package's events are read with one read()
+ */
+static int power_get_perf_power(
+	stats_t *stats,
+	bool *const discharging)
+{
+	static bool first = true;
+	double t_now, pkg_watts = 0.0, psys_watts = 0.0, total_watts = 0.0;
+	double ram_watts = 0.0;
+	bool has_pkg = false, has_psys = false;
+	int i, n = 0;
+
+	/* Assume OK until found otherwise */
+	stats->inaccurate[POWER_NOW] = false;
+	stats->value[POWER_NOW] = 0.0;
+	*discharging = false;
+
+	t_now = gettime_to_double();
+
+	for (i = 0; i < perf_power_packages; i++) {
+		perf_power_t *p = &perf_power[i];
+		double energy[PERF_POWER_EVENTS_MAX];
+		int j;
+
+		if (perf_power_read(p, energy) < 0)
+			continue;
+
+		for (j = 0; (j < p->nr) && (n < MAX_POWER_DOMAINS); j++, n++) {
+			perf_power_event_t *event = &p->event[j];
+			const double t_delta = t_now - event->t_last;
+			double watts = 0.0;
+
+			/* 64 bit counters, so no wrap around to worry about */
+			if (first || (t_delta <= 0.0))
+				stats->inaccurate[POWER_NOW] = true;
+			else
+				watts = (energy[j] - event->last_energy) / t_delta;
+			event->last_energy = energy[j];
+			event->t_last = t_now;
+			energy_counter[n] = energy[j];
+
+			stats->value[POWER_DOMAIN_0 + n] = watts;
+			total_watts += watts;
+			if (!strcmp(event->name, "energy-pkg")) {
+				pkg_watts += watts;
+				has_pkg = true;
+			} else if (!strcmp(event->name, "energy-psys")) {
+				psys_watts += watts;
+				has_psys = true;
+			} else if (!strcmp(event->name, "energy-ram")) {
+				ram_watts += watts;
+			}
+		}
+		*discharging = true;
+	}
+
+	/* Package energy like RAPL, otherwise the platform or all events */
+	if (has_pkg)
+		stats->value[POWER_NOW] = pkg_watts + (power_dram ? ram_watts : 0.0);
+	else if (has_psys)
+		stats->value[POWER_NOW] = psys_watts;
+	else
+		stats->value[POWER_NOW] = total_watts;
+
+	if (first) {
+		stats->inaccurate[POWER_NOW] = true;
+		first = false;
+	}
+
+	if (!n) {
+		(void)printf("Cannot read any perf power PMU energy events, cannot measure power usage.\n");
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+/*
+ *  power_get_sim()
+ *	get a simulated power consumption rate, the model is idle
+ *	power plus power per busy CPU, where the busy CPUs are taken
+ *	from the /proc/stat CPU ticks since the last sample. Optional
+ *	gaussian noise is added to make the fit less than perfect.
+ */
+static int power_get_sim(
+	stats_t *stats,
+	bool *const discharging)
+{
+	char buf[4096], *eol;
+	stats_t cpu;
+	ssize_t ret;
+	double t_now, busy, busy_cpus = 0.0, watts, clk_tck;
+
+	stats->inaccurate[POWER_NOW] = false;
+	*discharging = false;
+
+	if ((sim.fd < 0) && ((sim.fd = sys_open("/proc/stat", O_RDONLY)) < 0)) {
+		(void)fprintf(stderr, "Cannot read /proc/stat, errno=%d (%s), cannot "
+			"simulate power.\n", errno, strerror(errno));
+		return -1;
+	}
+	if ((ret = pread(sim.fd, buf, sizeof(buf) - 1, 0)) <= 0) {
+		(void)fprintf(stderr, "Cannot read /proc/stat, cannot simulate power.\n");
+		return -1;
+	}
+	buf[ret] = '\0';
+	if ((eol = strchr(buf, '\n')) != NULL)
+		*eol = '\0';
+	if (proc_stat_line(buf, &cpu) != PROC_STAT_CPU) {
+		(void)fprintf(stderr, "No CPU ticks in /proc/stat, cannot simulate power.\n");
+		return -1;
+	}
+	busy = cpu.value[CPU_USER] + cpu.value[CPU_NICE] + cpu.value[CPU_SYS] +
+	       cpu.value[CPU_IRQ] + cpu.value[CPU_SOFTIRQ];
+	clk_tck = (double)sysconf(_SC_CLK_TCK);
+	if (clk_tck < 1.0)
+		clk_tck = 100.0;	/* USER_HZ on most systems */
+
+	t_now = gettime_to_double();
+	if ((sim.t_last > 0.0) && (t_now > sim.t_last))
+		busy_cpus = (busy - sim.busy_last) / (clk_tck * (t_now - sim.t_last));
+	else
+		stats->inaccurate[POWER_NOW] = true;
+	sim.busy_last = busy;
+	sim.t_last = t_now;
+
+	watts = sim.idle_watts + (sim.cpu_watts * busy_cpus);
+	if (sim.noise > 0.0) {
+		/* Box-Muller transform of two uniform samples */
+		const double u1 = ((double)mwc() + 1.0) / 4294967297.0;
+		const double u2 = (double)mwc() / 4294967296.0;
+
+		watts *= 1.0 + (sim.noise * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2));
+	}
+	if (watts < 0.0)
+		watts = 0.0;
+
+	stats->value[POWER_NOW] = watts;
+	stats->value[POWER_DOMAIN_0] = watts;
+	*discharging = true;
+
+	return 0;
+}
+
+/*
+ *  power_get()
+ *	get consumption rate
+ */
+static int power_get(
+	rapl_info_t *rapl_list,
+	stats_t *stats,
+	bool *const discharging,
+	bool *const inaccurate)
+{
+	struct stat buf;
+	char path[PATH_MAX];
+	int i;
+
+	for (i = POWER_NOW; i < POWER_DOMAIN_0 + MAX_POWER_VALUES; i++) {
+		stats->value[i] = 0.0;
+		stats->inaccurate[i] = 0.0;
+	}
+	for (i = 0; i < MAX_POWER_DOMAINS; i++)
+		energy_counter[i] = NAN;
+	if (opt_flags & OPT_SIMULATE)
+		return power_get_sim(stats, discharging);
+#if defined(PERF_ENABLED)
+	if (opt_flags & OPT_PERF_POWER)
+		return power_get_perf_power(stats, discharging);
+#endif
+#if defined(RAPL_X86)
+	if (opt_flags & OPT_RAPL)
+		return power_get_rapl(rapl_list, stats, discharging);
+#else
+	(void)rapl_list;
+#endif
+
+	if (battery_sys_fs)
+		return power_get_sys_fs(stats, discharging, inaccurate);
+
+	if ((stat(sys_path(PROC_ACPI_BATTERY, path, sizeof(path)), &buf) != -1) &&
+	    S_ISDIR(buf.st_mode))
+		return power_get_proc_acpi(stats, discharging, inaccurate);
+
+	(void)fprintf(stderr, "Machine does not seem to have a battery, cannot measure power.\n");
+	return -1;
+}
+
+/*
+ *  not_discharging()
+ *	returns true if battery is not discharging
+ */
+static inline bool not_discharging(rapl_info_t *rapl_list)
+{
+	stats_t dummy;
+	bool discharging, inaccurate;
+
+	return power_get(rapl_list, &dummy, &discharging, &inaccurate) < 0;
+}
+
+#if defined(PERF_ENABLED)
+/*
+ *  perf_persist_open()
+ *	open persistent perf counters on the load processes or
+ *	system wide on each CPU as one counter group per CPU
+ */
+static void perf_persist_open(cpu_list_t *cpu_list)
+{
+	cpu_info_t *c;
+
+	for (c = cpu_list->head; c; c = c->next) {
+		if (opt_flags & OPT_PERF_CPU)
+			(void)perf_open(&c->perf, -1, c->cpu_id);
+		else
+			(void)perf_open(&c->perf, c->pid, -1);
+	}
+}
+
+/*
+ *  perf_persist_read()
+ *	read persistent perf counters and account for the syscalls
+ *	that perf_start() and perf_stop() would have used
+ */
+static void perf_persist_read(cpu_list_t *cpu_list)
+{
+	cpu_info_t *c;
+
+	for (c = cpu_list->head; c; c = c->next) {
+		(void)perf_read(&c->perf);
+		perf_syscalls_legacy += (uint64_t)c->perf.perf_opened *
+					PERF_SYSCALLS_PER_COUNTER;
+	}
+	perf_samples++;
+}
+
+/*
+ *  perf_persist_close()
+ *	close persistent perf counters and gather read statistics
+ */
+static void perf_persist_close(cpu_list_t *cpu_list)
+{
+	cpu_info_t *c;
+
+	for (c = cpu_list->head; c; c = c->next) {
+		perf_syscalls_used += c->perf.syscall_reads;
+		perf_rdpmc_reads += c->perf.rdpmc_reads;
+		perf_close(&c->perf);
+	}
+}
+#endif
+
+/*
+ *   monitor()
+ *	monitor system activity and power consumption
+ */
+static inline int monitor(
+	const int num_cpus,
+	cpu_list_t *cpu_list,
+	rapl_info_t *rapl_list,
+	const int start_delay,
+	const int sample_delay,
+	const int max_readings,
+	const char *test,
+	const double percent_each,
+	const double percent,
+	telemetry_t *telemetry,
+	double *busy,
+	double *power,
+	double *voltage,
+	double *ops,
+	double *events,
+	stats_t *result)
+{
+	int readings = 0, i;
+	int64_t t = 1;
+	stats_t *stats, s1, s2, average, stddev;
+	bool dummy_inaccurate;
+	double time_start;
+
+	*busy = 0.0;
+	*power = 0.0;
+	*voltage = 0.0;
+	*ops = 0.0;
+	for (i = 0; i < perf_events; i++)
+		events[i] = 0.0;
+	(void)memset(result, 0, sizeof(*result));
+
+	if (start_delay > 0) {
+		stats_t dummy;
+		bool discharging;
+
+		/* Gather up initial data */
+		for (i = 0; i < start_delay; i++) {
+			if (opt_flags & OPT_PROGRESS) {
+				(void)fprintf(stdout, "%10.10s: test warming up %5.1f%%..\r",
+					test, 100.0 * i / start_delay);
+				(void)fflush(stdout);
+			}
+			if (power_get(rapl_list, &dummy, &discharging, &dummy_inaccurate) < 0)
+				return -1;
+			if (sleep(1) || stop_flag)
+				return -1;
+#if defined(RAPL_X86)
+			/* Discard high rate samples taken while warming up */
+			if (energy_sampler) {
+				double s_power, s_stddev, s_peak;
+
+				(void)sampler_drain(energy_sampler, &s_power, &s_stddev, &s_peak);
+			}
+#endif
+			if (!discharging)
+				return -1;
+		}
+	}
+
+	if (not_discharging(rapl_list))
+		return -1;
+
+	if ((stats = calloc(max_readings, sizeof(stats_t))) == NULL) {
+		(void)fprintf(stderr, "Cannot allocate statistics table.\n");
+		return -1;
+	}
+
+	stats_clear_all(stats, max_readings);
+	stats_clear(&average);
+	stats_clear(&stddev);
+
+	if ((time_start = gettime_to_double()) < 0.0) {
+		free(stats);
+		return -1;
+	}
+
+	cpu_util_reset(cpu_util);
+	if (stats_read(cpu_list, num_cpus, &s1, telemetry) < 0) {
+		free(stats);
+		return -1;
+	}
+	trace_mark(trace);
+
+#if defined(PERF_ENABLED)
+	if (perf_enabled && (opt_flags & OPT_PERF_PERSIST))
+		perf_persist_open(cpu_list);
+#endif
+#if defined(RAPL_X86)
+	/* Start the first interval from now */
+	if (energy_sampler) {
+		double s_power, s_stddev, s_peak;
+
+		(void)sampler_drain(energy_sampler, &s_power, &s_stddev, &s_peak);
+	}
+#endif
+
+	while (!stop_flag && (readings < max_readings)) {
+		int ret = 0;
+		double secs, time_now;
+		struct timeval tv;
+#if defined(PERF_ENABLED)
+		cpu_info_t *c;
+#endif
+
+		if ((time_now = gettime_to_double()) < 0.0)
+			goto tidy_exit;
+
+#if defined(PERF_ENABLED)
+		if (perf_enabled && !(opt_flags & OPT_PERF_PERSIST)) {
+			for (c = cpu_list->head; c; c = c->next)
+				perf_start(&c->perf, c->pid);
+		}
+#endif
+
+		if (opt_flags & OPT_PROGRESS) {
+			double progress = readings * 100.0 / max_readings;
+			(void)fprintf(stdout, "%10.10s: test progress %5.1f%% (total progress %6.2f%%)\r",
+				test, progress,
+				(progress * percent_each / 100.0) + percent);
+			(void)fflush(stdout);
+		}
+
+		secs = time_start + ((double)t * sample_delay) - time_now;
+		if (secs < 0.0)
+			goto sample_now;
+		tv = double_to_timeval(secs);
+		ret = select(0, NULL, NULL, NULL, &tv);
+#if defined(PERF_ENABLED)
+		if ((ret < 0) && (perf_enabled)) {
+			if (!(opt_flags & OPT_PERF_PERSIST)) {
+				for (c = cpu_list->head; c; c = c->next)
+					perf_stop(&c->perf);
+			}
+
+			if (errno == EINTR)
+				break;
+			(void)fprintf(stderr,"select failed: errno=%d (%s).\n",
+				errno, strerror(errno));
+			goto tidy_exit;
+		}
+#endif
+sample_now:
+		if (stop_flag)
+			break;
+		/* Time out, so measure some more samples */
+		if (ret == 0) {
+			char tmbuffer[10];
+			bool discharging;
+
+#if defined(PERF_ENABLED)
+			if (perf_enabled) {
+				if (opt_flags & OPT_PERF_PERSIST) {
+					perf_persist_read(cpu_list);
+				} else {
+					for (c = cpu_list->head; c; c = c->next)
+						perf_stop(&c->perf);
+				}
+			}
+#endif
+
+			get_time(tmbuffer, sizeof(tmbuffer));
+			if (stats_read(cpu_list, num_cpus, &s2, telemetry) < 0)
+				goto tidy_exit;
+
+			/*
+			 *  Total ticks was zero, something is broken,
+			 *  so re-sample
+			 */
+			if (!stats_gather(cpu_list, sample_delay, &s1, &s2, &stats[readings])) {
+				stats_clear(&stats[readings]);
+				if (stats_read(cpu_list, num_cpus, &s1, telemetry) < 0)
+					goto tidy_exit;
+				trace_mark(trace);
+				continue;
+			}
+
+			if (power_get(rapl_list, &stats[readings], &discharging,
+				      &stats[readings].inaccurate[POWER_NOW]) < 0)
+				goto tidy_exit;
+
+			if (!discharging)
+				goto tidy_exit; /* No longer discharging! */
+
+#if defined(RAPL_X86)
+			/* Use the high rate samples for this interval */
+			if (energy_sampler) {
+				double s_power, s_stddev, s_peak;
+
+				if (sampler_drain(energy_sampler, &s_power, &s_stddev, &s_peak) > 0) {
+					stats[readings].value[POWER_NOW] = s_power;
+					stats[readings].value[POWER_PEAK] = s_peak;
+					stats[readings].value[POWER_STDDEV] = s_stddev;
+				}
+			}
+#endif
+			if (trace_sample(trace, (uint32_t)readings, &s2, &stats[readings]) < 0)
+				goto tidy_exit;
+
+			readings++;
+			s1 = s2;
+			t++;
+		}
+	}
+
+	/*
+	 * Stats now gathered, calculate averages, stddev, min
+	 * and max and display
+	 */
+	stats_average_stddev_min_max(stats, readings, &average, &stddev);
+	/* Report the highest peak rather than the average peak */
+	for (i = 0; i < readings; i++) {
+		if (stats[i].value[POWER_PEAK] > average.value[POWER_PEAK])
+			average.value[POWER_PEAK] = stats[i].value[POWER_PEAK];
+	}
+	if (readings > 0) {
+		stats_print(test, true, &average);
+	}
+	*busy = 100.0 - average.value[CPU_IDLE];
+	*power = average.value[POWER_NOW];
+	*voltage = average.value[VOLTAGE_NOW];
+	*ops = average.value[BOGO_OPS];
+	for (i = 0; i < perf_events; i++)
+		events[i] = average.value[PERF_EVENT_0 + i];
+	*result = average;
+
+#if defined(PERF_ENABLED)
+	if (perf_enabled && (opt_flags & OPT_PERF_PERSIST))
+		perf_persist_close(cpu_list);
+#endif
+	free(stats);
+	/* Write the step's records now the sampling is done */
+	return trace_flush(trace);
+
+tidy_exit:
+#if defined(PERF_ENABLED)
+	if (perf_enabled && (opt_flags & OPT_PERF_PERSIST))
+		perf_persist_close(cpu_list);
+#endif
+	free(stats);
+	return -1;
+
+}
+
+/*
+ *  calc_trend()
+ *	calculate linear trendline - compute gradient, y intercept and
+ *	coefficient of determination. Errors are not shown if the
+ *	heading is NULL.
+ */
+static int calc_trend(
+	const char *heading,
+	const int cpus_used,
+	const value_t *values,
+	const int num_values,
+	double *gradient,
+	double *intercept,
+	double *r2)
+{
+	int i, n = 0;
+	double a = 0.0, b, c = 0.0, d, e, f;
+	double sum_x = 0.0, sum_y = 0.0;
+	double sum_x2 = 0.0, sum_y2 = 0.0;
+	double sum_xy = 0.0, r;
+	double n1, n2;
+
+	for (i = 0; i < num_values; i++) {
+		if (cpus_used == CPU_ANY || cpus_used >= values[i].cpus_used) {
+			a += values[i].x * values[i].y;
+			sum_x += values[i].x;
+			sum_y += values[i].y;
+			sum_xy += (values[i].x * values[i].y);
+			sum_x2 += (values[i].x * values[i].x);
+			sum_y2 += (values[i].y * values[i].y);
+			n++;
+		}
+	}
+
+	if (!n) {
+		if (heading)
+			(void)printf("%s: Cannot perform trend analysis, zero samples.\n", heading);
+		return -1;
+	}
+
+	/*
+	 * Coefficient of determination R^2,
+	 * http://mathbits.com/MathBits/TISection/Statistics2/correlation.htm
+	 */
+	n1 = sqrt(((double)n * sum_x2) - (sum_x * sum_x));
+	n2 = sqrt(((double)n * sum_y2) - (sum_y * sum_y));
+	d = n1 * n2;
+	if (d <= 0.0) {
+		if (heading)
+			(void)printf("%s: Cannot perform trend analysis\n"
+				"(the coefficient of determination is not invalid).\n", heading);
+		return -1;
+	}
+	r  = (((double)n * sum_xy) - (sum_x * sum_y)) / d;
+	*r2 = r * r;
+
+	/*
+	 *  Regression Equation(y) = a + bx
+         *  Slope = (NΣXY - (ΣX)(ΣY)) / (NΣX2 - (ΣX)2)
+ 	 *  Intercept = (ΣY - b(ΣX)) / N
+	 */
+	a *= (double)n;
+	b = sum_x * sum_y;
+	c = sum_x2 * (double)n;
+	d = sum_x * sum_x;
+	e = sum_y;
+	*gradient = (a - b) / (c - d);
+	f = (*gradient) * sum_x;
+	*intercept = (e - f) / (double)n;
+
+	return 0;
+}
+
+/*
+ *  calc_regression()
+ *	multivariate linear least squares fit of power against a
+ *	set of predictors, y = b0 + b1.x1 + .. + bn.xn, using a
+ *	Householder QR decomposition of the column scaled design
+ *	matrix. Predictors that are collinear with earlier ones are
+ *	dropped and flagged as not estimable. coeff[0] and std_err[0]
+ *	are the intercept, coeff[i + 1] and std_err[i + 1] are for
+ *	the i'th predictor.
+ */
+static int calc_regression(
+	const char *heading,
+	const int cpus_used,
+	const predictor_t *predictors,
+	const int num_predictors,
+	const int num_values,
+	double *coeff,
+	double *std_err,
+	bool *estimable,
+	double *r2,
+	double *adj_r2,
+	int *samples)
+{
+	const int p = num_predictors + 1;
+	double *a, *y, *y_orig, *scale, *rdiag;
+	int *rank_col;
+	int i, j, k, n = 0, rank = 0, ret = -1;
+	double mean = 0.0, tss = 0.0, rss = 0.0, sigma2;
+
+	a = calloc((size_t)num_values * p, sizeof(*a));
+	y = calloc((size_t)num_values, sizeof(*y));
+	y_orig = calloc((size_t)num_values, sizeof(*y_orig));
+	scale = calloc((size_t)p, sizeof(*scale));
+	rdiag = calloc((size_t)p, sizeof(*rdiag));
+	rank_col = calloc((size_t)p, sizeof(*rank_col));
+	if (!a || !y || !y_orig || !scale || !rdiag || !rank_col) {
+		(void)fprintf(stderr, "Cannot allocate regression data.\n");
+		goto out;
+	}
+
+	/* Design matrix, column 0 is the intercept */
+	for (i = 0; i < num_values; i++) {
+		const value_t *v = &predictors[0].values[i];
+
+		if (cpus_used != CPU_ANY && cpus_used < v->cpus_used)
+			continue;
+		a[(n * p) + 0] = 1.0;
+		for (j = 0; j < num_predictors; j++)
+			a[(n * p) + j + 1] = predictors[j].values[i].x;
+		y[n] = v->y;
+		y_orig[n] = v->y;
+		mean += v->y;
+		n++;
+	}
+	*samples = n;
+
+	if (n <= p) {
+		(void)printf("%s: Cannot perform multivariate analysis, "
+			"%d samples for %d coefficients.\n", heading, n, p);
+		goto out;
+	}
+	mean /= (double)n;
+
+	/* Scale each column to unit length to keep the QR well conditioned */
+	for (j = 0; j < p; j++) {
+		double sum = 0.0;
+
+		for (i = 0; i < n; i++)
+			sum += a[(i * p) + j] * a[(i * p) + j];
+		scale[j] = sqrt(sum);
+		if (scale[j] > 0.0) {
+			for (i = 0; i < n; i++)
+				a[(i * p) + j] /= scale[j];
+		}
+		estimable[j] = false;
+		coeff[j] = 0.0;
+		std_err[j] = 0.0;
+	}
+
+	/* Householder QR, column by column, dropping collinear columns */
+	for (k = 0; k < p; k++) {
+		double sigma = 0.0, alpha, vnorm2;
+
+		for (i = rank; i < n; i++)
+			sigma += a[(i * p) + k] * a[(i * p) + k];
+		sigma = sqrt(sigma);
+		if (sigma < 1.0E-9)
+			continue;
+
+		alpha = (a[(rank * p) + k] > 0.0) ? -sigma : sigma;
+		a[(rank * p) + k] -= alpha;
+		vnorm2 = 0.0;
+		for (i = rank; i < n; i++)
+			vnorm2 += a[(i * p) + k] * a[(i * p) + k];
+
+		/* Apply the reflection to the remaining columns and to y */
+		for (j = k + 1; j <= p; j++) {
+			double dot = 0.0, f;
+
+			if (j < p) {
+				for (i = rank; i < n; i++)
+					dot += a[(i * p) + k] * a[(i * p) + j];
+				f = 2.0 * dot / vnorm2;
+				for (i = rank; i < n; i++)
+					a[(i * p) + j] -= f * a[(i * p) + k];
+			} else {
+				for (i = rank; i < n; i++)
+					dot += a[(i * p) + k] * y[i];
+				f = 2.0 * dot / vnorm2;
+				for (i = rank; i < n; i++)
+					y[i] -= f * a[(i * p) + k];
+			}
+		}
+		rdiag[rank] = alpha;
+		rank_col[rank] = k;
+		estimable[k] = true;
+		rank++;
+	}
+
+	for (i = rank; i < n; i++)
+		rss += y[i] * y[i];
+	for (i = 0; i < n; i++)
+		tss += (y_orig[i] - mean) * (y_orig[i] - mean);
+	if ((tss <= 0.0) || (n <= rank)) {
+		(void)printf("%s: Cannot perform multivariate analysis, "
+			"no variation in power.\n", heading);
+		goto out;
+	}
+	sigma2 = rss / (double)(n - rank);
+	*r2 = 1.0 - (rss / tss);
+	*adj_r2 = 1.0 - (1.0 - *r2) * (double)(n - 1) / (double)(n - rank);
+
+	/*
+	 *  Back substitute R.b = Q'y for the coefficients, and
+	 *  form R^-1 row by row for the coefficient variances,
+	 *  var(b) = sigma^2 * diag(R^-1 . R^-T)
+	 */
+	for (i = rank - 1; i >= 0; i--) {
+		double sum = y[i];
+
+		for (j = i + 1; j < rank; j++)
+			sum -= a[(i * p) + rank_col[j]] * coeff[rank_col[j]];
+		coeff[rank_col[i]] = sum / rdiag[i];
+	}
+	for (i = 0; i < rank; i++) {
+		double rinv[p], var = 0.0;
+
+		/* Row i of R^-1 */
+		for (j = 0; j < rank; j++)
+			rinv[j] = 0.0;
+		rinv[i] = 1.0 / rdiag[i];
+		for (j = i + 1; j < rank; j++) {
+			double sum = 0.0;
+
+			for (k = i; k < j; k++)
+				sum -= rinv[k] * a[(k * p) + rank_col[j]];
+			rinv[j] = sum / rdiag[j];
+		}
+		for (j = i; j < rank; j++)
+			var += rinv[j] * rinv[j];
+		std_err[rank_col[i]] = sqrt(sigma2 * var);
+	}
+
+	/* Undo the column scaling */
+	for (j = 0; j < p; j++) {
+		if (estimable[j]) {
+			coeff[j] /= scale[j];
+			std_err[j] /= scale[j];
+		}
+	}
+	ret = 0;
+out:
+	free(rank_col);
+	free(rdiag);
+	free(scale);
+	free(y_orig);
+	free(y);
+	free(a);
+
+	return ret;
+}
+
+/*
+ *  show_help()
+ *	simple help
+ */
+static void show_help(char *const argv[])
+{
+	(void)printf("%s, version %s\n\n", app_name, VERSION);
+	(void)printf("usage: %s [options]\n", argv[0]);
+	(void)printf(" -a       count perf events on each CPU for all processes (implies -k)\n");
+	(void)printf(" --analyze file\n");
+	(void)printf("          refit and cross-validate the models of a -t trace file\n");
+	(void)printf(" -C pair  ctxt workload partner CPU: cpu, smt or package\n");
+	(void)printf(" -d secs  specify delay before starting\n");
+#if defined(PERF_ENABLED)
+	(void)printf(" -E       use the perf power PMU energy events to measure Watts\n");
+#endif
+#if defined(RAPL_X86)
+	(void)printf(" -f msecs sample RAPL energy every msecs on a housekeeping CPU\n");
+#endif
+	(void)printf(" --freq-sweep\n");
+	(void)printf("          calibrate at each CPU frequency in turn\n");
+	(void)printf(" -h show  help\n");
+	(void)printf(" --idle   calibrate idle power limited to each idle state in turn\n");
+	(void)printf(" -k       keep perf counters open for each test, low overhead sampling\n");
+	(void)printf(" -L msecs period of the partial CPU load duty cycle\n");
+	(void)printf(" -n cpus  specify number of CPUs to exercise\n");
+	(void)printf(" -N node  memory workload NUMA node, local or remote\n");
+	(void)printf(" -o file  output results into YAML formatted file\n");
+	(void)printf(" -p       show progress\n");
+	(void)printf(" -P list  comma separated list of perf events to measure\n");
+	(void)printf(" -r secs  specify run duration in seconds of each test cycle\n");
+#if defined(RAPL_X86)
+	(void)printf(" -m path  MSR device path for -M, %%d is the CPU number\n");
+	(void)printf(" -M       use Intel RAPL MSRs to measure Watts (implies -R)\n");
+	(void)printf(" -R       use Intel RAPL per CPU package data to measure Watts\n");
+#endif
+	(void)printf(" -s num   number of samples (tests) per CPU for CPU calibration\n");
+	(void)printf(" -t file  record every raw sample into a binary trace file\n");
+	(void)printf(" --simulate[=idle,cpu,noise]\n");
+	(void)printf("          use a simulated power source driven by the /proc/stat load\n");
+	(void)printf(" --sysroot dir\n");
+	(void)printf("          read /proc and /sys files under dir\n");
+	(void)printf(" --turbo on|off\n");
+	(void)printf("          turn turbo/boost on or off for --freq-sweep\n");
+	(void)printf(" -w name  workload kernel: int, fp, vector, mixed, read, write, copy,\n");
+	(void)printf("          chase-l1, chase-l2, chase-llc, chase-dram, ctxt, wakeup\n");
+	(void)printf("          or syscall\n");
+	(void)printf("\nExample: power-calibrate  -R -r 20 -d 5 -s 21 -n 0 -p\n");
+}
+
+/*
+ *  coefficient_r2()
+ *	give some idea of r2
+ */
+static const char *coefficient_r2(const double r2)
+{
+	if (r2 < 0.4)
+		return "very weak";
+	if (r2 < 0.75)
+		return "weak";
+	if (r2 < 0.80)
+		return "fair";
+	if (r2 < 0.90)
+		return "good";
+	if (r2 < 0.95)
+		return "strong";
+	if (r2 < 1.0)
+		return "very strong";
+	return "perfect";
+}
+
+/*
+ *  dump_yaml_values()
+ *	output yaml formatted data
+ */
+static void dump_yaml_values(
+	FILE *yaml,
+	const char *heading,
+	const char *field,
+	const double value,
+	const double r2)
+{
+	if (!yaml)
+		return;
+
+	(void)fprintf(yaml, "  %s:\n", heading);
+	(void)fprintf(yaml, "    %s: %e\n", field, value);
+	(void)fprintf(yaml, "    r-squared: %f\n", r2);
+}
+
+/*
+ *  dump_yaml_misc()
+ *	output json misc test data
+ */
+static void dump_yaml_misc(FILE *yaml)
+{
+	time_t now;
+	struct tm tm;
+	struct utsname buf;
+
+	now = time(NULL);
+	if (now == ((time_t) -1)) {
+		(void)memset(&tm, 0, sizeof(tm));
+	} else {
+		localtime_r(&now, &tm);
+	}
+
+	(void)memset(&buf, 0, sizeof(struct utsname));
+	(void)uname(&buf);
+
+	(void)fprintf(yaml, "  test-run:\n");
+	(void)fprintf(yaml, "    date: %2.2d/%2.2d/%-2.2d\n",
+		tm.tm_mday, tm.tm_mon + 1, (tm.tm_year+1900) % 100);
+	(void)fprintf(yaml, "    time: %-2.2d:%-2.2d:%-2.2d\n",
+		tm.tm_hour, tm.tm_min, tm.tm_sec);
+	(void)fprintf(yaml, "    sysname: %s\n", buf.sysname);
+	(void)fprintf(yaml, "    nodename: %s\n", buf.nodename);
+	(void)fprintf(yaml, "    release: %s\n", buf.release);
+	(void)fprintf(yaml, "    machine: %s\n", buf.machine);
+	(void)fprintf(yaml, "    workload: %s\n", workload->name);
+	(void)fprintf(yaml, "    bogo-op: %s\n", workload->bogo_op);
+	if (workload->bytes)
+		(void)fprintf(yaml, "    numa-node: %s\n", mem_remote ? "remote" : "local");
+	if (workload->rate == RATE_CTXT)
+		(void)fprintf(yaml, "    context-switch-pair: %s\n", ctxt_pair_names[ctxt_pair]);
+	if (workload->rate == RATE_SYSCALL)
+		show_mitigations(yaml);
+	if (*sysroot)
+		(void)fprintf(yaml, "    sysroot: %s\n", sysroot);
+	if (opt_flags & OPT_SIMULATE) {
+		(void)fprintf(yaml, "    power-simulator:\n");
+		(void)fprintf(yaml, "      idle-watts: %f\n", sim.idle_watts);
+		(void)fprintf(yaml, "      watts-per-cpu: %f\n", sim.cpu_watts);
+		(void)fprintf(yaml, "      noise: %f\n", sim.noise);
+	}
+#if defined(PERF_ENABLED)
+	if (perf_enabled) {
+		int i;
+
+		(void)fprintf(yaml, "    perf-events:\n");
+		for (i = 0; i < perf_events; i++)
+			(void)fprintf(yaml, "      - %s\n", perf_event_info(i)->name);
+	}
+#endif
+}
+
+/*
+ *  calc_average_voltage()
+ *	calculatate average voltage on CPU ids
+ */
+static double calc_average_voltage(
+	const int cpus_used,
+	value_t *values,
+	const int num_values)
+{
+	int i, n = 0;
+	double average = 0.0;
+
+	for (i = 0; i < num_values; i++) {
+		if (cpus_used == CPU_ANY || cpus_used >= values[i].cpus_used) {
+			average += values[i].voltage;
+			n++;
+		}
+	}
+	average = (n == 0) ? 0.0 : average / n;
+
+	if (FLOAT_CMP(average, 0.0))
+		return -1;
+
+	return average;
+}
+
+/*
+ *  show_trend()
+ *	Show power trend
+ */
+static void show_trend(
+	FILE *yaml,
+	const int cpus_used,
+	value_t *values,
+	const int num_values,
+	const char *unit,
+	const char *each,
+	const char *heading,
+	const char *field,
+	bool power)
+{
+	char watts[16];
+	double gradient, intercept, r2;
+	double average_voltage =
+		calc_average_voltage(cpus_used, values, num_values);
+
+	if (calc_trend(heading, cpus_used, values, num_values, &gradient, &intercept, &r2) < 0)
+		return;
+
+	units_to_str(gradient, "W", watts, sizeof(watts));
+
+	(void)printf("  %s (%s) = (%s * %e) + %f\n",
+		power ? "Power" : "Energy",
+		power ? "Watts" : "Watt-seconds",
+		unit, gradient, intercept);
+	if (average_voltage > 0) {
+		char amps[16], volts[16];
+		units_to_str(average_voltage, "V", volts, sizeof(volts));
+		units_to_str(gradient / average_voltage, "A", amps, sizeof(amps));
+		printf("  %s is about %s (about %s @ %s)\n",
+			each, watts, amps, volts);
+	} else {
+		(void)printf("  %s is about %s%s\n", each, watts,
+			power ? "" : "s");
+	}
+	(void)printf("  Coefficient of determination R^2 = %f (%s)\n",
+		r2, coefficient_r2(r2));
+
+	dump_yaml_values(yaml, heading, field, gradient, r2);
+}
+
+/*
+ *  show_regression()
+ *	show multivariate power model
+ */
+static void show_regression(
+	FILE *yaml,
+	const char *heading,
+	const int cpus_used,
+	const predictor_t *predictors,
+	const int num_predictors,
+	const int num_values)
+{
+	double coeff[num_predictors + 1], std_err[num_predictors + 1];
+	bool estimable[num_predictors + 1];
+	double r2, adj_r2;
+	int i, samples;
+
+	if (calc_regression(heading, cpus_used, predictors,
+			    num_predictors, num_values, coeff, std_err,
+			    estimable, &r2, &adj_r2, &samples) < 0)
+		return;
+
+	(void)printf("  Multivariate model from %d samples:\n", samples);
+	(void)printf("  Power (Watts) = %f (+/- %e)\n", coeff[0], std_err[0]);
+	for (i = 0; i < num_predictors; i++) {
+		if (estimable[i + 1]) {
+			(void)printf("    + (%s * %e (+/- %e))\n",
+				predictors[i].name, coeff[i + 1], std_err[i + 1]);
+		} else {
+			(void)printf("    (%s not estimable, collinear with other predictors)\n",
+				predictors[i].name);
 		}
-		if ((rapl->name = strdup(entry->d_name)) == NULL) {
-			fprintf(stderr, "Cannot allocate RAPL name information.\n");
-			closedir(dir);
-			free(rapl);
-			return -1;
+	}
+	(void)printf("  Coefficient of determination R^2 = %f, adjusted R^2 = %f (%s)\n",
+		r2, adj_r2, coefficient_r2(adj_r2));
+
+	if (!yaml)
+		return;
+
+	(void)fprintf(yaml, "  %s:\n", heading);
+	(void)fprintf(yaml, "    intercept-watts: %e\n", coeff[0]);
+	(void)fprintf(yaml, "    intercept-standard-error: %e\n", std_err[0]);
+	for (i = 0; i < num_predictors; i++) {
+		if (!estimable[i + 1])
+			continue;
+		(void)fprintf(yaml, "    %s:\n", predictors[i].heading);
+		(void)fprintf(yaml, "      %s: %e\n", predictors[i].field, coeff[i + 1]);
+		(void)fprintf(yaml, "      standard-error: %e\n", std_err[i + 1]);
+	}
+	(void)fprintf(yaml, "    r-squared: %f\n", r2);
+	(void)fprintf(yaml, "    adjusted-r-squared: %f\n", adj_r2);
+}
+
+static void init_values(value_t *values, const size_t n)
+{
+	register size_t i;
+
+	for (i = 0; i < n; i++) {
+		values[i].x = 0.0;
+		values[i].y = 0.0;
+		values[i].voltage = 0.0;
+		values[i].cpu_id = 0;
+		values[i].cpus_used = 0;
+	}
+}
+
+/*
+ *  show_event_trends()
+ *	show power trend for each perf event
+ */
+static void show_event_trends(
+	FILE *yaml,
+	const int cpus_used,
+	value_t *values_events,
+	const size_t n_values,
+	const int num_values)
+{
+#if defined(PERF_ENABLED)
+	int i;
+
+	if (!perf_enabled)
+		return;
+
+	for (i = 0; i < perf_events; i++) {
+		const perf_info_t *info = perf_event_info(i);
+		char each[64];
+
+		(void)snprintf(each, sizeof(each), "1 %s", info->unit);
+		(void)printf("\n");
+		show_trend(yaml, cpus_used, values_events + (i * n_values),
+			num_values, info->unit, each,
+			info->heading, info->field, false);
+	}
+#else
+	(void)yaml;
+	(void)cpus_used;
+	(void)values_events;
+	(void)n_values;
+	(void)num_values;
+#endif
+}
+
+/*
+ *  cpu_util_check()
+ *	check the per-CPU utilisation of the last monitor() run
+ *	against where the load was placed, track stray activity on
+ *	unloaded CPUs and loaded CPUs running below half the
+ *	requested load. Returns the number of active CPUs or -1
+ *	if there is no per-CPU data.
+ */
+static int cpu_util_check(
+	cpu_list_t *cpu_list,
+	const uint32_t n_cpus,
+	const int cpu_load,
+	double *stray_peak,
+	uint32_t *stray_runs,
+	uint32_t *low_runs)
+{
+	int32_t cpu;
+	int active = 0;
+	bool sampled = false;
+
+	if (!cpu_util)
+		return -1;
+
+	for (cpu = 0; cpu < cpu_util->max_cpus; cpu++) {
+		const double busy = cpu_util_busy(cpu_util, cpu);
+		cpu_info_t *c;
+		uint32_t i;
+
+		if (isnan(busy))
+			continue;
+		sampled = true;
+		if (busy > CPU_UTIL_ACTIVE)
+			active++;
+
+		for (i = 0, c = cpu_list->head; c && i < n_cpus; c = c->next, i++)
+			if (c->cpu_id == cpu)
+				break;
+		if (c && i < n_cpus) {
+			if ((cpu_load > 0) && (busy < cpu_load / 2.0))
+				low_runs[cpu]++;
+		} else if (busy > CPU_UTIL_STRAY) {
+			stray_runs[cpu]++;
+			if (busy > stray_peak[cpu])
+				stray_peak[cpu] = busy;
 		}
-		(void)snprintf(path, sizeof(path),
-			"/sys/class/powercap/%s/max_energy_range_uj",
-			entry->d_name);
+	}
+	return sampled ? active : -1;
+}
 
-		rapl->max_energy_uj = 0.0;
-		if ((fp = fopen(path, "r")) != NULL) {
-			if (fscanf(fp, "%lf\n", &rapl->max_energy_uj) != 1)
-				rapl->max_energy_uj = 0.0;
-			(void)fclose(fp);
+/*
+ *  show_cpu_util()
+ *	report CPUs where the measured load did not match
+ *	where the load was placed
+ */
+static void show_cpu_util(
+	const int32_t max_cpus,
+	const uint32_t runs,
+	const double *stray_peak,
+	const uint32_t *stray_runs,
+	const uint32_t *low_runs)
+{
+	int32_t cpu;
+	bool heading = false;
+
+	for (cpu = 0; cpu < max_cpus; cpu++) {
+		if (!stray_runs[cpu])
+			continue;
+		if (!heading) {
+			(void)printf("\nStray activity on CPUs that were not loaded:\n");
+			heading = true;
 		}
-		(void)snprintf(path, sizeof(path),
-			"/sys/class/powercap/%s/name",
-			entry->d_name);
+		(void)printf("  CPU %" PRId32 ": busy in %" PRIu32 " of %" PRIu32
+			" tests, peak %.1f%%\n", cpu, stray_runs[cpu], runs,
+			stray_peak[cpu]);
+	}
 
-		rapl->domain_name = NULL;
-		if ((fp = fopen(path, "r")) != NULL) {
-			char domain_name[128];
+	heading = false;
+	for (cpu = 0; cpu < max_cpus; cpu++) {
+		if (!low_runs[cpu])
+			continue;
+		if (!heading) {
+			(void)printf("\nLoaded CPUs running below half the requested load:\n");
+			heading = true;
+		}
+		(void)printf("  CPU %" PRId32 ": in %" PRIu32 " of %" PRIu32 " tests\n",
+			cpu, low_runs[cpu], runs);
+	}
+}
 
-			if (fgets(domain_name, sizeof(domain_name), fp) != NULL) {
-				domain_name[strcspn(domain_name, "\n")] = '\0';
-				rapl->domain_name = strdup(domain_name);
+/*
+ *  show_chase()
+ *	show the pointer chase working set and the perf events
+ *	per access, averaged over the tests with up to cpus_used CPUs
+ */
+static void show_chase(
+	FILE *yaml,
+	const int cpus_used,
+	const value_t *values_ops,
+	const value_t *values_events,
+	const size_t n_values,
+	const int num_values)
+{
+	int i, j;
+
+	(void)printf("\nPointer chase over %zu KB per CPU (%s):\n",
+		mem_size / 1024, workload->bogo_op);
+	if (yaml) {
+		(void)fprintf(yaml, "  pointer-chase-%s:\n", workload->name + 6);
+		(void)fprintf(yaml, "    working-set-bytes: %zu\n", mem_size);
+	}
+#if defined(PERF_ENABLED)
+	for (i = 0; perf_enabled && (i < perf_events); i++) {
+		const perf_info_t *info = perf_event_info(i);
+		double events = 0.0, ops = 0.0;
+
+		for (j = 0; j < num_values; j++) {
+			if ((cpus_used != CPU_ANY) && (cpus_used < values_ops[j].cpus_used))
+				continue;
+			if ((values_ops[j].x > 0.0) &&
+			    !isnan(values_events[(i * n_values) + j].x)) {
+				events += values_events[(i * n_values) + j].x;
+				ops += values_ops[j].x;
 			}
-			(void)fclose(fp);
 		}
-		if (rapl->domain_name == NULL) {
-			free(rapl->name);
-			free(rapl);
+		if ((ops <= 0.0) || (events <= 0.0))
 			continue;
+		(void)printf("  %s per access: %.3f\n", info->name, events / ops);
+		if (yaml)
+			(void)fprintf(yaml, "    %s-per-access: %f\n",
+				info->name, events / ops);
+	}
+#else
+	(void)i;
+	(void)j;
+	(void)cpus_used;
+	(void)values_ops;
+	(void)values_events;
+	(void)n_values;
+	(void)num_values;
+#endif
+}
+
+/*
+ *  monitor_cpu_load()
+ *	load CPU(s) and gather stats
+ */
+static int monitor_cpu_load(
+	FILE *fp,
+	const int32_t num_cpus,
+	const int32_t max_cpus,
+	const int32_t samples_cpu,
+	const int32_t sample_delay,
+	cpu_list_t *cpu_list,
+	rapl_info_t *rapl_list,
+	const int start_delay,
+	const int max_readings,
+	const uint32_t load_period_ms,
+	telemetry_t *telemetry,
+	value_t *values_out)
+{
+	uint32_t i, n = 0;
+	int j, rc = -1;
+	const size_t n_values = num_cpus * samples_cpu;
+	value_t values_load[n_values], *value_load = values_load;
+	value_t values_ops[n_values], *value_ops = values_ops;
+	value_t values_bw[n_values], values_rate[n_values];
+	value_t *values_events, *values_freq, *values_cpus;
+	predictor_t predictors[PERF_MAX_EVENTS + 2];
+	int num_predictors = 0, cycles_idx = -1;
+	double scale = (double)MAX_CPU_LOAD / (samples_cpu - 1);
+	double stray_peak[max_cpus];
+	uint32_t stray_runs[max_cpus], low_runs[max_cpus];
+	char bogo_unit[32], bogo_each[32], bogo_heading[32], bw_heading[48];
+
+	/* The default int kernel keeps the original bogo-op YAML heading */
+	(void)snprintf(bogo_unit, sizeof(bogo_unit), "%s bogo op", workload->name);
+	(void)snprintf(bogo_each, sizeof(bogo_each), "1 %s bogo op", workload->name);
+	if (workload == &workloads[0])
+		(void)snprintf(bogo_heading, sizeof(bogo_heading), "bogo-op");
+	else
+		(void)snprintf(bogo_heading, sizeof(bogo_heading), "bogo-op-%s",
+			workload->name);
+	(void)snprintf(bw_heading, sizeof(bw_heading), "memory-bandwidth-%s-%s",
+		workload->name, mem_remote ? "remote" : "local");
+
+	(void)memset(stray_peak, 0, sizeof(stray_peak));
+	(void)memset(stray_runs, 0, sizeof(stray_runs));
+	(void)memset(low_runs, 0, sizeof(low_runs));
+
+	/* perf event values followed by frequency and active CPU values */
+	values_events = calloc((perf_events + 2) * n_values, sizeof(value_t));
+	if (!values_events) {
+		(void)fprintf(stderr, "Cannot allocate perf event values.\n");
+		return -1;
+	}
+	values_freq = values_events + (perf_events * n_values);
+	values_cpus = values_freq + n_values;
+
+	init_values(values_load, n_values);
+	init_values(values_ops, n_values);
+	init_values(values_bw, n_values);
+	init_values(values_rate, n_values);
+	init_values(values_events, (perf_events + 2) * n_values);
+
+#if defined(PERF_ENABLED)
+	for (j = 0; j < perf_events; j++) {
+		const perf_info_t *info = perf_event_info(j);
+
+		predictors[num_predictors].name = info->label;
+		predictors[num_predictors].heading = info->heading;
+		predictors[num_predictors].field = "watt-seconds";
+		predictors[num_predictors].values = values_events + (j * n_values);
+		num_predictors++;
+		if (!strcmp(info->name, "cycles"))
+			cycles_idx = j;
+	}
+#endif
+	if (cycles_idx >= 0) {
+		predictors[num_predictors].name = "MHz";
+		predictors[num_predictors].heading = "cpu-frequency";
+		predictors[num_predictors].field = "watts-per-mhz";
+		predictors[num_predictors].values = values_freq;
+		num_predictors++;
+	}
+	predictors[num_predictors].name = "active CPUs";
+	predictors[num_predictors].heading = "active-cpus";
+	predictors[num_predictors].field = "watts-per-cpu";
+	predictors[num_predictors].values = values_cpus;
+	num_predictors++;
+
+	if (load_pool_create(cpu_list,
+	    (workload->rate == RATE_WAKEUP) ? stress_wakeup : stress_cpu,
+	    load_period_ms, telemetry) < 0)
+		goto out;
+
+	(void)printf("Workload %s, one bogo op is %s", workload->name,
+		workload->bogo_op);
+	if (!strcmp(workload->name, "vector") || !strcmp(workload->name, "mixed"))
+		(void)printf(" (%s)", workload_vector_isa());
+	(void)printf("\n");
+	if (workload->bytes)
+		(void)printf("%zu MB buffer per CPU on the %s NUMA node, power includes "
+			"DRAM if measured\n", mem_size / (1024 * 1024),
+			mem_remote ? "next (remote)" : "local");
+	else if (workload->chase)
+		(void)printf("%zu KB working set per CPU on the %s NUMA node\n",
+			mem_size / 1024, mem_remote ? "next (remote)" : "local");
+	else if (workload->rate == RATE_CTXT)
+		(void)printf("Context switch partners on the %s, the CPU load "
+			"sweeps the switch rate\n",
+			(ctxt_pair == CTXT_PAIR_SMT) ? "SMT sibling" :
+			(ctxt_pair == CTXT_PAIR_PACKAGE) ?
+			"CPU in another package" : "same CPU");
+	else if (workload->rate == RATE_WAKEUP)
+		(void)printf("Timer wakeup rate swept from %.0f Hz to %.0f Hz\n",
+			WAKEUP_RATE_MIN, WAKEUP_RATE_MAX);
+	else if (workload->rate == RATE_SYSCALL)
+		show_mitigations(NULL);
+
+	stats_headings((workload->rate == RATE_WAKEUP) ? "Wakeups/s" : "CPU load");
+	for (i = 0; i < (uint32_t)samples_cpu; i++) {
+		cpu_info_t *c;
+		uint32_t n_cpus;
+
+		for (n_cpus = 1, c = cpu_list->head; c; n_cpus++, c = c->next) {
+			char buffer[1024];
+			int cpu_load = scale * i;
+			int ret, active;
+			double percent_each = 100.0 / (samples_cpu * num_cpus);
+			double percent = n * percent_each;
+			double events[PERF_MAX_EVENTS];
+			stats_t result;
+
+			if (workload->rate == RATE_WAKEUP) {
+				const uint64_t rate = wakeup_rate(cpu_load);
+
+				if (rate >= 1000)
+					(void)snprintf(buffer, sizeof(buffer), "%.3gK x %u",
+						(double)rate / 1000.0, n_cpus);
+				else
+					(void)snprintf(buffer, sizeof(buffer), "%" PRIu64 " x %u",
+						rate, n_cpus);
+			} else {
+				(void)snprintf(buffer, sizeof(buffer), "%d%% x %u",
+					cpu_load, n_cpus);
+			}
+			start_load(n_cpus, (workload->rate == RATE_WAKEUP) ?
+				wakeup_rate(cpu_load) : (uint64_t)cpu_load);
+
+			ret = monitor(num_cpus, cpu_list, rapl_list,
+				start_delay, sample_delay,
+				max_readings, buffer,
+				percent_each, percent, telemetry,
+				&value_load->x,
+				&value_load->y,
+				&value_load->voltage,
+				&value_ops->x,
+				events, &result);
+			value_ops->y = value_load->y;
+			value_ops->voltage = value_load->voltage;
+			value_ops->cpu_id = value_load->cpu_id = c->cpu_id;
+			value_ops->cpus_used = value_load->cpus_used = n_cpus;
+			values_bw[n] = *value_ops;
+			values_bw[n].x = value_ops->x * workload->bytes / 1000000000.0;
+			values_rate[n] = *value_ops;
+			if (workload->rate)
+				values_rate[n].x = isnan(result.value[rates[workload->rate].stat]) ?
+					0.0 : result.value[rates[workload->rate].stat];
+
+			for (j = 0; j < perf_events + 2; j++) {
+				value_t *value_event = &values_events[(j * n_values) + n];
+
+				if (j < perf_events)
+					value_event->x = events[j];
+				value_event->y = value_load->y;
+				value_event->voltage = value_load->voltage;
+				value_event->cpu_id = value_load->cpu_id;
+				value_event->cpus_used = value_load->cpus_used;
+			}
+			/* Measured active CPUs, or the CPUs loaded if unknown */
+			/* Timer wakeups do not keep the CPUs busy */
+			active = cpu_util_check(cpu_list, n_cpus,
+				(workload->rate == RATE_WAKEUP) ? 0 : cpu_load,
+				stray_peak, stray_runs, low_runs);
+			values_cpus[n].x = (double)((active < 0) ? (int)n_cpus : active);
+			/*
+			 *  Effective frequency, cycles per second over the
+			 *  number of CPUs that were busy
+			 */
+			if (cycles_idx >= 0) {
+				double busy_cpus = value_load->x * max_cpus / 100.0;
+
+				values_freq[n].x = (busy_cpus > 0.01) ?
+					events[cycles_idx] / (busy_cpus * 1000000.0) : 0.0;
+			}
+
+			if ((stop_load() < 0) || stop_flag || (ret < 0))
+				goto out;
+			if ((cpu_load > 0) && (cpu_load < MAX_CPU_LOAD) &&
+			    (workload->rate != RATE_WAKEUP))
+				show_duty_cycle(cpu_list, n_cpus);
+			show_cstates(&result, cpu_list->count);
+			value_load++;
+			value_ops++;
+			n++;
 		}
+	}
+	/* Keep static analysis happy */
+	if (n == 0) {
+		printf("\nZero samples, cannot compute statistics.\n");
+		goto out;
+	}
 
-		rapl->is_package = (strncmp(rapl->domain_name, "package-", 8) == 0);
-		rapl->next = *rapl_list;
-		*rapl_list = rapl;
-		n++;
+	if (opt_flags & OPT_CALIBRATE_EACH_CPU) {
+		cpu_info_t *c;
+		int cpus_used = 0;
+
+		for (c = cpu_list->head, cpus_used = 1; c; c = c->next, cpus_used++) {
+			(void)printf("\nFor %d CPU%s (of a %d CPU system):\n",
+				cpus_used, cpus_used > 1 ? "s" : "", max_cpus);
+			show_trend(NULL, cpus_used, values_load, n,
+				"% CPU load", "1% CPU load",
+				"cpu-load", "one-percent-cpu-load-watts", true);
+			(void)printf("\n");
+			show_trend(NULL, cpus_used, values_ops, n,
+				bogo_unit, bogo_each,
+				bogo_heading, "one-bogo-op-power-watt-seconds", false);
+			if (workload->bytes) {
+				(void)printf("\n");
+				show_trend(NULL, cpus_used, values_bw, n,
+					"GB/s", "1 GB/s", bw_heading,
+					"watts-per-gb-per-second", true);
+			}
+			if (workload->rate) {
+				(void)printf("\n");
+				show_trend(NULL, cpus_used, values_rate, n,
+					rates[workload->rate].unit, rates[workload->rate].each,
+					rates[workload->rate].heading,
+					rates[workload->rate].field, true);
+			}
+			show_event_trends(NULL, cpus_used, values_events, n_values, n);
+			if (workload->chase)
+				show_chase(NULL, cpus_used, values_ops, values_events,
+					n_values, n);
+			if (perf_enabled) {
+				(void)printf("\n");
+				show_regression(NULL, "multivariate-model", cpus_used, predictors,
+					num_predictors, n);
+			}
+		}
+	} else {
+		(void)printf("\nFor %u CPU%s (of a %d CPU system):\n",
+			cpu_list->count, cpu_list->count > 1 ? "s" : "", max_cpus);
+		show_trend(fp, CPU_ANY, values_load, n,
+			"% CPU load", "1% CPU load",
+			"cpu-load", "one-percent-cpu-load-watts", true);
+		(void)printf("\n");
+		show_trend(fp, CPU_ANY, values_ops, n,
+			bogo_unit, bogo_each,
+			bogo_heading, "one-bogo-op-watts-seconds", false);
+		if (workload->bytes) {
+			(void)printf("\n");
+			show_trend(fp, CPU_ANY, values_bw, n,
+				"GB/s", "1 GB/s", bw_heading,
+				"watts-per-gb-per-second", true);
+		}
+		if (workload->rate) {
+			(void)printf("\n");
+			show_trend(fp, CPU_ANY, values_rate, n,
+				rates[workload->rate].unit, rates[workload->rate].each,
+				rates[workload->rate].heading,
+				rates[workload->rate].field, true);
+		}
+		show_event_trends(fp, CPU_ANY, values_events, n_values, n);
+		if (workload->chase)
+			show_chase(fp, CPU_ANY, values_ops, values_events, n_values, n);
+		if (perf_enabled) {
+			(void)printf("\n");
+			show_regression(fp, "multivariate-model", CPU_ANY,
+				predictors, num_predictors, n);
+		}
 	}
-	(void)closedir(dir);
 
-	if (!n)
-		(void)printf("Cannot detect any RAPL domains, cannot power measure power usage, try running as root.\n");
-	return n;
+	show_cpu_util(max_cpus, n, stray_peak, stray_runs, low_runs);
+	if (values_out)
+		(void)memcpy(values_out, values_load, n * sizeof(value_t));
+
+	if (perf_enabled && (opt_flags & OPT_PERF_PERSIST) && perf_samples) {
+		(void)printf("\nPersistent perf counters saved %.1f syscalls per sample "
+			"(%" PRIu64 " rdpmc reads, %" PRIu64 " read() calls).\n",
+			(double)(perf_syscalls_legacy - perf_syscalls_used) /
+			(double)perf_samples, perf_rdpmc_reads, perf_syscalls_used);
+	}
+	rc = 0;
+out:
+	load_pool_destroy(cpu_list);
+	free(values_events);
+	return rc;
 }
 
 /*
- *  power_get_rapl()
- *	get power discharge rate from battery via the RAPL interface
+ *  freq_path()
+ *	path of a cpufreq attribute of a CPU
  */
-static int power_get_rapl(
-	rapl_info_t *rapl_list,
-	stats_t *stats,
-	bool *const discharging)
+static void freq_path(char *path, const size_t len, const int cpu, const char *attr)
 {
-	double t_now;
-	static bool first = true;
-	rapl_info_t *rapl;
-	int n = 0;
+	(void)snprintf(path, len, SYS_CPUFREQ, cpu, attr);
+}
 
-	/* Assume OK until found otherwise */
-	stats->inaccurate[POWER_NOW] = false;
-	stats->value[POWER_NOW] = 0.0;
-	*discharging = false;
+/*
+ *  freq_limit()
+ *	set the scaling frequency limits of a CPU in kHz, the maximum
+ *	is raised to the hardware maximum first so each write is valid
+ *	whatever the current limits are
+ */
+static int freq_limit(const cpu_info_t *c, const uint64_t min, const uint64_t max)
+{
+	char path_min[PATH_MAX], path_max[PATH_MAX];
+
+	freq_path(path_min, sizeof(path_min), c->cpu_id, "scaling_min_freq");
+	freq_path(path_max, sizeof(path_max), c->cpu_id, "scaling_max_freq");
+	if ((sys_write_uint64(path_max, c->freq_hw_max) < 0) ||
+	    (sys_write_uint64(path_min, min) < 0) ||
+	    (sys_write_uint64(path_max, max) < 0)) {
+		(void)fprintf(stderr, "Cannot set CPU %d frequency limits, "
+			"errno=%d (%s).\n", c->cpu_id, errno, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
 
-	t_now = gettime_to_double();
+/*
+ *  freq_save()
+ *	save the scaling frequency limits of the CPUs so they can be
+ *	restored by freq_restore()
+ */
+static int freq_save(cpu_list_t *cpu_list)
+{
+	cpu_info_t *c;
 
-	for (rapl = rapl_list; rapl; rapl = rapl->next) {
+	for (c = cpu_list->head; c; c = c->next) {
 		char path[PATH_MAX];
-		FILE *fp;
-		double ujoules;
-
-		(void)snprintf(path, sizeof(path),
-			"/sys/class/powercap/%s/energy_uj",
-			rapl->name);
-
-		if ((fp = fopen(path, "r")) == NULL)
-			continue;
-
-		if (fscanf(fp, "%lf\n", &ujoules) == 1) {
-			double t_delta = t_now - rapl->t_last;
-			double last_energy_uj = rapl->last_energy_uj;
-
-			rapl->t_last = t_now;
-
-			/* Wrapped around since last time? */
-			if (ujoules - rapl->last_energy_uj < 0.0) {
-				rapl->last_energy_uj = ujoules;
-				ujoules += rapl->max_energy_uj;
-			} else {
-				rapl->last_energy_uj = ujoules;
-			}
-
-			if (first || (t_delta <= 0.0)) {
-				stats->value[POWER_DOMAIN_0 + n] = 0.0;
-				stats->inaccurate[POWER_NOW] = true;
-			} else {
-				stats->value[POWER_DOMAIN_0 + n] =
-					(ujoules - last_energy_uj) /
-					(t_delta * 1000000.0);
-			}
-			if (rapl->is_package)
-				stats->value[POWER_NOW] += stats->value[POWER_DOMAIN_0 + n];
-			n++;
-			*discharging = true;
-		}
-		(void)fclose(fp);
-	}
-
-	if (first) {
-		stats->inaccurate[POWER_NOW] = true;
-		first = false;
-	}
 
-	if (!n) {
-		(void)printf("Cannot detect any RAPL domains, cannot power measure power usage, try running as root\n");
+		freq_path(path, sizeof(path), c->cpu_id, "cpuinfo_max_freq");
+		if (sys_read_uint64(path, &c->freq_hw_max) < 0)
+			goto err;
+		freq_path(path, sizeof(path), c->cpu_id, "scaling_min_freq");
+		if (sys_read_uint64(path, &c->freq_min) < 0)
+			goto err;
+		freq_path(path, sizeof(path), c->cpu_id, "scaling_max_freq");
+		if (sys_read_uint64(path, &c->freq_max) < 0)
+			goto err;
+		continue;
+err:
+		(void)fprintf(stderr, "Cannot read CPU %d cpufreq limits.\n", c->cpu_id);
+		c->freq_max = 0;
 		return -1;
 	}
 	return 0;
 }
-#endif
 
 /*
- *  power_get()
- *	get consumption rate
+ *  freq_restore()
+ *	restore the scaling frequency limits and turbo state saved
+ *	before the frequency sweep
  */
-static int power_get(
-	rapl_info_t *rapl_list,
-	stats_t *stats,
-	bool *const discharging,
-	bool *const inaccurate)
+static void freq_restore(cpu_list_t *cpu_list)
 {
-	struct stat buf;
-	int i;
+	cpu_info_t *c;
 
-	for (i = POWER_NOW; i < MAX_VALUES; i++) {
-		stats->value[i] = i;
-		stats->inaccurate[i] = 0.0;
+	for (c = cpu_list->head; c; c = c->next) {
+		if (c->freq_max)
+			(void)freq_limit(c, c->freq_min, c->freq_max);
+		c->freq_max = 0;
 	}
-#if defined(RAPL_X86)
-	if (opt_flags & OPT_RAPL)
-		return power_get_rapl(rapl_list, stats, discharging);
-#else
-	(void)rapl_list;
-#endif
+	if (turbo_saved >= 0) {
+		if (sys_write_uint64(SYS_CPUFREQ_BOOST, (uint64_t)turbo_saved) < 0)
+			(void)sys_write_uint64(SYS_INTEL_NO_TURBO, (uint64_t)!turbo_saved);
+		turbo_saved = -1;
+	}
+}
 
-	if ((stat(SYS_CLASS_POWER_SUPPLY, &buf) != -1) &&
-	    S_ISDIR(buf.st_mode))
-		return power_get_sys_fs(stats, discharging, inaccurate);
+/*
+ *  turbo_set()
+ *	turn turbo/boost on or off with the cpufreq boost control or
+ *	the intel_pstate no_turbo control, saving the current state
+ */
+static int turbo_set(const bool on)
+{
+	uint64_t val;
+
+	if (sys_read_uint64(SYS_CPUFREQ_BOOST, &val) == 0) {
+		turbo_saved = (int)val;
+		if (sys_write_uint64(SYS_CPUFREQ_BOOST, on) == 0)
+			return 0;
+	} else if (sys_read_uint64(SYS_INTEL_NO_TURBO, &val) == 0) {
+		turbo_saved = !val;
+		if (sys_write_uint64(SYS_INTEL_NO_TURBO, !on) == 0)
+			return 0;
+	}
+	(void)fprintf(stderr, "Cannot turn turbo %s, errno=%d (%s).\n",
+		on ? "on" : "off", errno, strerror(errno));
+	turbo_saved = -1;
+	return -1;
+}
 
-	if ((stat(PROC_ACPI_BATTERY, &buf) != -1) &&
-	    S_ISDIR(buf.st_mode))
-		return power_get_proc_acpi(stats, discharging, inaccurate);
+/*
+ *  freq_cmp()
+ *	sort frequencies into ascending order
+ */
+static int freq_cmp(const void *p1, const void *p2)
+{
+	const uint64_t f1 = *(const uint64_t *)p1;
+	const uint64_t f2 = *(const uint64_t *)p2;
 
-	(void)fprintf(stderr, "Machine does not seem to have a battery, cannot measure power.\n");
-	return -1;
+	return (f1 > f2) - (f1 < f2);
 }
 
 /*
- *  not_discharging()
- *	returns true if battery is not discharging
+ *  freq_available()
+ *	frequencies in kHz a CPU's driver lists in
+ *	scaling_available_frequencies in ascending order, 0 if none
  */
-static inline bool not_discharging(rapl_info_t *rapl_list)
+static int freq_available(const int cpu, uint64_t *freqs, const int max)
 {
-	stats_t dummy;
-	bool discharging, inaccurate;
+	char path[PATH_MAX], *data;
+	const char *ptr;
+	int n = 0;
 
-	return power_get(rapl_list, &dummy, &discharging, &inaccurate) < 0;
+	freq_path(path, sizeof(path), cpu, "scaling_available_frequencies");
+	if ((data = file_get(path)) == NULL)
+		return 0;
+	for (ptr = data; (n < max) && (ptr = parse_uint64(ptr, &freqs[n])); n++)
+		;
+	free(data);
+	qsort(freqs, (size_t)n, sizeof(*freqs), freq_cmp);
+	return n;
 }
 
 /*
- *   monitor()
- *	monitor system activity and power consumption
+ *  freq_common()
+ *	frequencies in kHz to sweep in ascending order that every CPU
+ *	in the list supports, the frequencies all the drivers list or,
+ *	if a driver has no list, FREQ_SWEEP_STEPS steps over the
+ *	hardware range common to all the CPUs
  */
-static inline int monitor(
-	const int num_cpus,
-	cpu_list_t *cpu_list,
-	rapl_info_t *rapl_list,
-	const int start_delay,
-	const int sample_delay,
-	const int max_readings,
-	const char *test,
-	const double percent_each,
-	const double percent,
-	bogo_ops_t *bogo_ops,
-	double *busy,
-	double *power,
-	double *voltage,
-	double *ops,
-	double *cpu_cycles,
-	double *cpu_instr)
+static int freq_common(cpu_list_t *cpu_list, uint64_t *freqs, const int max)
 {
-	int readings = 0, i;
-	int64_t t = 1;
-	stats_t *stats, s1, s2, average, stddev;
-	bool dummy_inaccurate;
-	double time_start;
+	uint64_t cpu_freqs[FREQ_SWEEP_MAX];
+	uint64_t min_freq = 0, max_freq = UINT64_MAX;
+	bool listed = true;
+	cpu_info_t *c;
+	int i, n = 0;
 
-	*busy = 0.0;
-	*power = 0.0;
-	*voltage = 0.0;
-	*ops = 0.0;
-	*cpu_cycles = 0.0;
-	*cpu_instr = 0.0;
+	for (c = cpu_list->head; c; c = c->next) {
+		char path[PATH_MAX];
+		uint64_t freq;
+		int cn, k;
 
-	if (start_delay > 0) {
-		stats_t dummy;
-		bool discharging;
+		freq_path(path, sizeof(path), c->cpu_id, "cpuinfo_min_freq");
+		if (sys_read_uint64(path, &freq) < 0)
+			return -1;
+		if (freq > min_freq)
+			min_freq = freq;
+		freq_path(path, sizeof(path), c->cpu_id, "cpuinfo_max_freq");
+		if (sys_read_uint64(path, &freq) < 0)
+			return -1;
+		if (freq < max_freq)
+			max_freq = freq;
 
-		/* Gather up initial data */
-		for (i = 0; i < start_delay; i++) {
-			if (opt_flags & OPT_PROGRESS) {
-				(void)fprintf(stdout, "%10.10s: test warming up %5.1f%%..\r",
-					test, 100.0 * i / start_delay);
-				(void)fflush(stdout);
-			}
-			if (power_get(rapl_list, &dummy, &discharging, &dummy_inaccurate) < 0)
-				return -1;
-			if (sleep(1) || stop_flag)
-				return -1;
-			if (!discharging)
-				return -1;
+		if (!listed)
+			continue;
+		cn = freq_available(c->cpu_id, cpu_freqs, FREQ_SWEEP_MAX);
+		if (cn < 1) {
+			listed = false;
+			continue;
+		}
+		if (c == cpu_list->head) {
+			n = (cn < max) ? cn : max;
+			(void)memcpy(freqs, cpu_freqs, (size_t)n * sizeof(*freqs));
+			continue;
 		}
+		/* Keep the frequencies this CPU also lists */
+		for (i = 0, k = 0; i < n; i++) {
+			if (bsearch(&freqs[i], cpu_freqs, (size_t)cn,
+				    sizeof(*cpu_freqs), freq_cmp))
+				freqs[k++] = freqs[i];
+		}
+		n = k;
 	}
+	if (listed)
+		return n;
 
-	if (not_discharging(rapl_list))
-		return -1;
-
-	if ((stats = calloc(max_readings, sizeof(stats_t))) == NULL) {
-		(void)fprintf(stderr, "Cannot allocate statistics table.\n");
-		return -1;
-	}
+	if (max_freq < min_freq)
+		return 0;
+	for (i = 0; i < FREQ_SWEEP_STEPS; i++)
+		freqs[i] = min_freq + (((max_freq - min_freq) * (uint64_t)i) /
+			(FREQ_SWEEP_STEPS - 1));
+	return FREQ_SWEEP_STEPS;
+}
 
-	stats_clear_all(stats, max_readings);
-	stats_clear(&average);
-	stats_clear(&stddev);
+/*
+ *  freq_sweep()
+ *	pin the CPUs to each frequency in turn and run the CPU load
+ *	calibration at each, then show power by frequency and load and
+ *	fit power to a CMOS style model, P = a + busy CPUs x (b.f + c.f^3),
+ *	where the f^3 term is C.V^2.f with the voltage scaling with f
+ */
+static int freq_sweep(
+	FILE *fp,
+	const int32_t num_cpus,
+	const int32_t max_cpus,
+	const int32_t samples_cpu,
+	const int32_t sample_delay,
+	cpu_list_t *cpu_list,
+	rapl_info_t *rapl_list,
+	const int start_delay,
+	const int max_readings,
+	const uint32_t load_period_ms,
+	telemetry_t *telemetry)
+{
+	const size_t n_values = num_cpus * samples_cpu;
+	const double scale = (double)MAX_CPU_LOAD / (samples_cpu - 1);
+	uint64_t freqs[FREQ_SWEEP_MAX];
+	value_t *values, *values_f, *values_f3;
+	predictor_t predictors[2];
+	cpu_info_t *c;
+	int n_freqs, f, i, rc = -1;
+	size_t j;
 
-	if ((time_start = gettime_to_double()) < 0.0) {
-		free(stats);
+	if ((n_freqs = freq_common(cpu_list, freqs, FREQ_SWEEP_MAX)) < 1) {
+		(void)fprintf(stderr, "Cannot find CPU frequencies to sweep that "
+			"all the CPUs support.\n");
 		return -1;
 	}
+	if (freq_save(cpu_list) < 0)
+		return -1;
 
-	if (stats_read(num_cpus, &s1, bogo_ops) < 0) {
-		free(stats);
+	/* Measured values for each frequency, then the two model predictors */
+	values = calloc(3 * n_freqs * n_values, sizeof(value_t));
+	if (!values) {
+		(void)fprintf(stderr, "Cannot allocate frequency sweep values.\n");
 		return -1;
 	}
+	values_f = values + (n_freqs * n_values);
+	values_f3 = values_f + (n_freqs * n_values);
 
-	while (!stop_flag && (readings < max_readings)) {
-		int ret = 0;
-		double secs, time_now;
-		struct timeval tv;
-#if defined(PERF_ENABLED)
-		cpu_info_t *c;
-#endif
-
-		if ((time_now = gettime_to_double()) < 0.0) {
-			free(stats);
-			return -1;
-		}
-
-#if defined(PERF_ENABLED)
-		if (perf_enabled) {
-			for (c = cpu_list->head; c; c = c->next)
-				perf_start(&c->perf, c->pid);
-		}
-#endif
-
-		if (opt_flags & OPT_PROGRESS) {
-			double progress = readings * 100.0 / max_readings;
-			(void)fprintf(stdout, "%10.10s: test progress %5.1f%% (total progress %6.2f%%)\r",
-				test, progress,
-				(progress * percent_each / 100.0) + percent);
-			(void)fflush(stdout);
+	for (f = 0; f < n_freqs; f++) {
+		for (c = cpu_list->head; c; c = c->next) {
+			if (freq_limit(c, freqs[f], freqs[f]) < 0)
+				goto out;
 		}
+		trace_context(trace, freqs[f], -1);
+		(void)printf("\nCPU frequency %.0f MHz:\n", (double)freqs[f] / 1000.0);
+		if (monitor_cpu_load(NULL, num_cpus, max_cpus, samples_cpu, sample_delay,
+			cpu_list, rapl_list, start_delay, max_readings, load_period_ms,
+			telemetry, values + (f * n_values)) < 0)
+			goto out;
+		if (stop_flag)
+			goto out;
+	}
 
-		secs = time_start + ((double)t * sample_delay) - time_now;
-		if (secs < 0.0)
-			goto sample_now;
-		tv = double_to_timeval(secs);
-		ret = select(0, NULL, NULL, NULL, &tv);
-#if defined(PERF_ENABLED)
-		if ((ret < 0) && (perf_enabled)) {
-			for (c = cpu_list->head; c; c = c->next)
-				perf_stop(&c->perf);
-
-			if (errno == EINTR)
-				break;
-			(void)fprintf(stderr,"select failed: errno=%d (%s).\n",
-				errno, strerror(errno));
-			free(stats);
-			return -1;
+	(void)printf("\nPower (Watts) by CPU frequency and CPU load on %u CPU%s:\n",
+		cpu_list->count, cpu_list->count > 1 ? "s" : "");
+	(void)printf("%8s", "MHz");
+	for (i = 0; i < samples_cpu; i++)
+		(void)printf(" %6d%%", (int)(scale * i));
+	(void)printf("\n");
+	if (fp)
+		(void)fprintf(fp, "  frequency-sweep:\n");
+	for (f = 0; f < n_freqs; f++) {
+		(void)printf("%8.0f", (double)freqs[f] / 1000.0);
+		if (fp)
+			(void)fprintf(fp, "    frequency-%.0f-mhz:\n", (double)freqs[f] / 1000.0);
+		for (i = 0; i < samples_cpu; i++) {
+			/* All the CPUs loaded is the last step of each load */
+			const value_t *v = &values[(f * n_values) + (i * num_cpus) + (num_cpus - 1)];
+
+			(void)printf(" %7.3f", v->y);
+			if (fp)
+				(void)fprintf(fp, "      load-%d-percent-watts: %f\n",
+					(int)(scale * i), v->y);
 		}
-#endif
-sample_now:
-		if (stop_flag)
-			break;
-		/* Time out, so measure some more samples */
-		if (ret == 0) {
-			char tmbuffer[10];
-			bool discharging;
+		(void)printf("\n");
+	}
 
-#if defined(PERF_ENABLED)
-			if (perf_enabled) {
-				for (c = cpu_list->head; c; c = c->next)
-					perf_stop(&c->perf);
-			}
-#endif
+	for (f = 0; f < n_freqs; f++) {
+		const double ghz = (double)freqs[f] / 1000000.0;
 
-			get_time(tmbuffer, sizeof(tmbuffer));
-			if (stats_read(num_cpus, &s2, bogo_ops) < 0)
-				goto tidy_exit;
+		for (j = 0; j < n_values; j++) {
+			value_t *v = &values[(f * n_values) + j];
+			const double busy_cpus = v->x * max_cpus / 100.0;
 
-			/*
-			 *  Total ticks was zero, something is broken,
-			 *  so re-sample
-			 */
-			if (!stats_gather(cpu_list, sample_delay, &s1, &s2, &stats[readings])) {
-				stats_clear(&stats[readings]);
-				if (stats_read(num_cpus, &s1, bogo_ops) < 0)
-					goto tidy_exit;
-				continue;
-			}
+			values_f[(f * n_values) + j] = *v;
+			values_f[(f * n_values) + j].x = busy_cpus * ghz;
+			values_f3[(f * n_values) + j] = *v;
+			values_f3[(f * n_values) + j].x = busy_cpus * ghz * ghz * ghz;
+		}
+	}
+	predictors[0].name = "busy CPUs x GHz";
+	predictors[0].heading = "busy-cpu-ghz";
+	predictors[0].field = "watts-per-busy-cpu-ghz";
+	predictors[0].values = values_f;
+	predictors[1].name = "busy CPUs x GHz^3";
+	predictors[1].heading = "busy-cpu-ghz-cubed";
+	predictors[1].field = "watts-per-busy-cpu-ghz-cubed";
+	predictors[1].values = values_f3;
+	(void)printf("\n");
+	show_regression(fp, "frequency-model", CPU_ANY, predictors, 2,
+		n_freqs * (int)n_values);
+	rc = 0;
+out:
+	free(values);
+	return rc;
+}
 
-			if (power_get(rapl_list, &stats[readings], &discharging,
-				      &stats[readings].inaccurate[POWER_NOW]) < 0)
-				goto tidy_exit;
+/*
+ *  idle_calibrate()
+ *	limit the deepest idle state the CPUs can enter to each cpuidle
+ *	state in turn and measure the power with the CPUs idle and woken
+ *	by a timer at a few low rates. The power with no wakeups is the
+ *	idle power at that limit and the gradient of power against the
+ *	idle state entry rate is the energy of one idle state entry.
+ */
+static int idle_calibrate(
+	FILE *fp,
+	const int32_t num_cpus,
+	const int32_t sample_delay,
+	cpu_list_t *cpu_list,
+	rapl_info_t *rapl_list,
+	const int start_delay,
+	const int max_readings,
+	telemetry_t *telemetry)
+{
+	static const uint64_t idle_rates[] = { 0, 20, 100, 500, 2000 };
+	const int n_rates = (int)(sizeof(idle_rates) / sizeof(idle_rates[0]));
+	value_t values[MAX_CSTATES * n_rates];
+	double idle_watts[MAX_CSTATES];
+	int k, r, n = 0, rc = -1;
+
+	if (!cstate_count) {
+		(void)fprintf(stderr, "No cpuidle states found for CPU %d.\n",
+			cpu_list->head->cpu_id);
+		return -1;
+	}
+	/* Deeper states that are not sampled could not be disabled */
+	if (cstate_truncated) {
+		(void)fprintf(stderr, "More than %d cpuidle states, cannot limit "
+			"the deepest idle state.\n", MAX_CSTATES);
+		return -1;
+	}
+	init_values(values, MAX_CSTATES * n_rates);
+	if (load_pool_create(cpu_list, stress_wakeup, LOAD_PERIOD_MS, telemetry) < 0)
+		return -1;
 
-			if (!discharging)
-				goto tidy_exit; /* No longer discharging! */
+	for (k = 0; k < cstate_count; k++) {
+		char heading[48];
 
-			readings++;
-			s1 = s2;
-			t++;
+		if (cstate_limit(cpu_list, k) < 0)
+			goto out;
+		trace_context(trace, 0, k);
+		(void)printf("\nDeepest idle state %s, exit latency %" PRIu64 " us:\n",
+			cstate_name[k], cstate_latency[k]);
+		stats_headings("Wakeups/s");
+		for (r = 0; r < n_rates; r++, n++) {
+			char buffer[64];
+			double busy, ops, events[PERF_MAX_EVENTS];
+			const double percent_each = 100.0 / (cstate_count * n_rates);
+			value_t *v = &values[n];
+			stats_t result;
+			int i, ret;
+
+			(void)snprintf(buffer, sizeof(buffer), "%" PRIu64 " x %u",
+				idle_rates[r], cpu_list->count);
+			start_load(cpu_list->count, idle_rates[r]);
+			ret = monitor(num_cpus, cpu_list, rapl_list, start_delay,
+				sample_delay, max_readings, buffer, percent_each,
+				n * percent_each, telemetry, &busy, &v->y, &v->voltage,
+				&ops, events, &result);
+			if ((stop_load() < 0) || stop_flag || (ret < 0))
+				goto out;
+			show_cstates(&result, cpu_list->count);
+
+			/* All the idle state entries of the CPUs */
+			v->x = 0.0;
+			for (i = 0; i < cstate_count; i++)
+				v->x += result.value[CSTATE_USAGE_0 + i];
+			v->cpu_id = cpu_list->head->cpu_id;
+			v->cpus_used = cpu_list->count;
+			if (r == 0)
+				idle_watts[k] = v->y;
 		}
+		(void)printf("\n");
+		(void)snprintf(heading, sizeof(heading), "idle-state-%s", cstate_name[k]);
+		show_trend(fp, CPU_ANY, values + (k * n_rates), n_rates,
+			"idle state entries/s", "1 idle state entry/s",
+			heading, "joules-per-entry", true);
 	}
 
-	/*
-	 * Stats now gathered, calculate averages, stddev, min
-	 * and max and display
-	 */
-	stats_average_stddev_min_max(stats, readings, &average, &stddev);
-	if (readings > 0) {
-		stats_print(test, true, &average);
+	(void)printf("\nIdle power by deepest idle state:\n");
+	(void)printf("  %-16s %10s %8s\n", "State", "Latency", "Watts");
+	if (fp)
+		(void)fprintf(fp, "  idle-states:\n");
+	for (k = 0; k < cstate_count; k++) {
+		(void)printf("  %-16s %7" PRIu64 " us %8.3f\n",
+			cstate_name[k], cstate_latency[k], idle_watts[k]);
+		if (fp) {
+			(void)fprintf(fp, "    %s:\n", cstate_name[k]);
+			(void)fprintf(fp, "      exit-latency-us: %" PRIu64 "\n",
+				cstate_latency[k]);
+			(void)fprintf(fp, "      idle-power-watts: %f\n", idle_watts[k]);
+		}
 	}
-	*busy = 100.0 - average.value[CPU_IDLE];
-	*power = average.value[POWER_NOW];
-	*voltage = average.value[VOLTAGE_NOW];
-	*ops = average.value[BOGO_OPS];
-	*cpu_cycles = average.value[CPU_CYCLES];
-	*cpu_instr = average.value[CPU_INSTRUCTIONS];
+	rc = 0;
+out:
+	load_pool_destroy(cpu_list);
+	cstate_restore(cpu_list);
+	return rc;
+}
 
-	free(stats);
-	return 0;
+/*
+ *  double_cmp()
+ *	qsort compare of doubles, ascending
+ */
+static int double_cmp(const void *p1, const void *p2)
+{
+	const double d1 = *(const double *)p1;
+	const double d2 = *(const double *)p2;
 
-tidy_exit:
-	free(stats);
-	return -1;
+	return (d1 > d2) - (d1 < d2);
+}
 
+/*
+ *  calc_median()
+ *	median of n doubles, the array is sorted
+ */
+static double calc_median(double *data, const size_t n)
+{
+	qsort(data, n, sizeof(*data), double_cmp);
+	return (n & 1) ? data[n / 2] : (data[(n / 2) - 1] + data[n / 2]) / 2.0;
 }
 
 /*
- *  calc_trend()
- *	calculate linear trendline - compute gradient, y intercept and
- *	coefficient of determination.
+ *  calc_theil_sen()
+ *	Theil-Sen robust linear fit, the gradient is the median of
+ *	the gradients between all pairs of points and the intercept
+ *	is the median of y - gradient.x, so a few outlying samples,
+ *	such as a background task waking up, do not skew the fit
  */
-static int calc_trend(
-	const char *heading,
+static int calc_theil_sen(
 	const int cpus_used,
 	const value_t *values,
 	const int num_values,
 	double *gradient,
-	double *intercept,
-	double *r2)
+	double *intercept)
 {
-	int i, n = 0;
-	double a = 0.0, b, c = 0.0, d, e, f;
-	double sum_x = 0.0, sum_y = 0.0;
-	double sum_x2 = 0.0, sum_y2 = 0.0;
-	double sum_xy = 0.0, r;
-	double n1, n2;
+	double *slopes, *offsets;
+	size_t n_slopes = 0, n = 0;
+	int i, j, ret = -1;
+
+	slopes = calloc(((size_t)num_values * (num_values - 1) / 2) + 1, sizeof(*slopes));
+	offsets = calloc((size_t)num_values + 1, sizeof(*offsets));
+	if (!slopes || !offsets)
+		goto out;
 
 	for (i = 0; i < num_values; i++) {
-		if (cpus_used == CPU_ANY || cpus_used >= values[i].cpus_used) {
-			a += values[i].x * values[i].y;
-			sum_x += values[i].x;
-			sum_y += values[i].y;
-			sum_xy += (values[i].x * values[i].y);
-			sum_x2 += (values[i].x * values[i].x);
-			sum_y2 += (values[i].y * values[i].y);
-			n++;
-		}
-	}
+		if (cpus_used != CPU_ANY && cpus_used < values[i].cpus_used)
+			continue;
+		for (j = i + 1; j < num_values; j++) {
+			const double dx = values[j].x - values[i].x;
 
-	if (!n) {
-		(void)printf("%s: Cannot perform trend analysis, zero samples.\n", heading);
-		return -1;
+			if (cpus_used != CPU_ANY && cpus_used < values[j].cpus_used)
+				continue;
+			if (fabs(dx) > FLOAT_TINY)
+				slopes[n_slopes++] = (values[j].y - values[i].y) / dx;
+		}
 	}
+	if (!n_slopes)
+		goto out;
+	*gradient = calc_median(slopes, n_slopes);
 
-	/*
-	 * Coefficient of determination R^2,
-	 * http://mathbits.com/MathBits/TISection/Statistics2/correlation.htm
-	 */
-	n1 = sqrt(((double)n * sum_x2) - (sum_x * sum_x));
-	n2 = sqrt(((double)n * sum_y2) - (sum_y * sum_y));
-	d = n1 * n2;
-	if (d <= 0.0) {
-		(void)printf("%s: Cannot perform trend analysis\n"
-			"(the coefficient of determination is not invalid).\n", heading);
-		return -1;
+	for (i = 0; i < num_values; i++) {
+		if (cpus_used != CPU_ANY && cpus_used < values[i].cpus_used)
+			continue;
+		offsets[n++] = values[i].y - (*gradient * values[i].x);
 	}
-	r  = (((double)n * sum_xy) - (sum_x * sum_y)) / d;
-	*r2 = r * r;
-
-	/*
-	 *  Regression Equation(y) = a + bx
-         *  Slope = (NΣXY - (ΣX)(ΣY)) / (NΣX2 - (ΣX)2)
- 	 *  Intercept = (ΣY - b(ΣX)) / N
-	 */
-	a *= (double)n;
-	b = sum_x * sum_y;
-	c = sum_x2 * (double)n;
-	d = sum_x * sum_x;
-	e = sum_y;
-	*gradient = (a - b) / (c - d);
-	f = (*gradient) * sum_x;
-	*intercept = (e - f) / (double)n;
-
-	return 0;
+	*intercept = calc_median(offsets, n);
+	ret = 0;
+out:
+	free(slopes);
+	free(offsets);
+	return ret;
 }
 
-
 /*
- *  show_help()
- *	simple help
+ *  model_fit()
+ *	fit a model with one of the ESTIMATOR_* estimators, a model
+ *	that cannot be fitted fails without showing an error as the
+ *	folds are fitted on the cross-validation threads
  */
-static void show_help(char *const argv[])
+static int model_fit(
+	const int estimator,
+	const int cpus_used,
+	const value_t *values,
+	const int num_values,
+	double *gradient,
+	double *intercept)
 {
-	(void)printf("%s, version %s\n\n", app_name, VERSION);
-	(void)printf("usage: %s [options]\n", argv[0]);
-	(void)printf(" -d secs  specify delay before starting\n");
-	(void)printf(" -h show  help\n");
-	(void)printf(" -n cpus  specify number of CPUs to exercise\n");
-	(void)printf(" -o file  output results into YAML formatted file\n");
-	(void)printf(" -p       show progress\n");
-	(void)printf(" -r secs  specify run duration in seconds of each test cycle\n");
-#if defined(RAPL_X86)
-	(void)printf(" -R       use Intel RAPL per CPU package data to measure Watts\n");
-#endif
-	(void)printf(" -s num   number of samples (tests) per CPU for CPU calibration\n");
-	(void)printf("\nExample: power-calibrate  -R -r 20 -d 5 -s 21 -n 0 -p\n");
-}
+	double r2;
 
-/*
- *  coefficient_r2()
- *	give some idea of r2
- */
-static const char *coefficient_r2(const double r2)
-{
-	if (r2 < 0.4)
-		return "very weak";
-	if (r2 < 0.75)
-		return "weak";
-	if (r2 < 0.80)
-		return "fair";
-	if (r2 < 0.90)
-		return "good";
-	if (r2 < 0.95)
-		return "strong";
-	if (r2 < 1.0)
-		return "very strong";
-	return "perfect";
+	if (estimator == ESTIMATOR_THEIL_SEN)
+		return calc_theil_sen(cpus_used, values, num_values, gradient, intercept);
+	return calc_trend(NULL, cpus_used, values, num_values,
+		gradient, intercept, &r2);
 }
 
 /*
- *  dump_yaml_values()
- *	output yaml formatted data
+ *  fold_run()
+ *	fit a model to the steps outside a fold and sum the errors
+ *	of its predictions of the steps held out in the fold, a fold
+ *	the model cannot be fitted to is skipped
  */
-static void dump_yaml_values(
-	FILE *yaml,
-	const char *heading,
-	const char *field,
-	const double value,
-	const double r2)
+static void fold_run(fold_t *f)
 {
-	if (!yaml)
+	value_t *train;
+	double gradient, intercept;
+	int i, n = 0, ret;
+
+	if ((train = calloc((size_t)f->n, sizeof(*train))) == NULL)
 		return;
+	for (i = 0; i < f->n; i++)
+		if ((i % f->folds) != f->fold)
+			train[n++] = f->model->values[f->order[i]];
 
-	(void)fprintf(yaml, "  %s:\n", heading);
-	(void)fprintf(yaml, "    %s: %e\n", field, value);
-	(void)fprintf(yaml, "    r-squared: %f\n", r2);
+	ret = model_fit(f->estimator, CPU_ANY, train, n, &gradient, &intercept);
+	free(train);
+	if (ret < 0)
+		return;
+
+	for (i = f->fold; i < f->n; i += f->folds) {
+		const value_t *v = &f->model->values[f->order[i]];
+		const double err = v->y - (intercept + (gradient * v->x));
+
+		f->sse += err * err;
+		f->sae += fabs(err);
+		f->tested++;
+	}
 }
 
 /*
- *  dump_yaml_misc()
- *	output json misc test data
+ *  fold_thread()
+ *	cross-validation thread pool worker, runs folds from
+ *	the queue until it is empty
  */
-static void dump_yaml_misc(FILE *yaml)
+static void *fold_thread(void *arg)
 {
-	time_t now;
-	struct tm tm;
-	struct utsname buf;
-
-	now = time(NULL);
-	if (now == ((time_t) -1)) {
-		(void)memset(&tm, 0, sizeof(tm));
-	} else {
-		localtime_r(&now, &tm);
-	}
+	fold_queue_t *queue = (fold_queue_t *)arg;
 
-	(void)memset(&buf, 0, sizeof(struct utsname));
-	(void)uname(&buf);
+	for (;;) {
+		const uint32_t i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
 
-	(void)fprintf(yaml, "  test-run:\n");
-	(void)fprintf(yaml, "    date: %2.2d/%2.2d/%-2.2d\n",
-		tm.tm_mday, tm.tm_mon + 1, (tm.tm_year+1900) % 100);
-	(void)fprintf(yaml, "    time: %-2.2d:%-2.2d:%-2.2d\n",
-		tm.tm_hour, tm.tm_min, tm.tm_sec);
-	(void)fprintf(yaml, "    sysname: %s\n", buf.sysname);
-	(void)fprintf(yaml, "    nodename: %s\n", buf.nodename);
-	(void)fprintf(yaml, "    release: %s\n", buf.release);
-	(void)fprintf(yaml, "    machine: %s\n", buf.machine);
+		if (i >= queue->n)
+			break;
+		fold_run(&queue->folds[i]);
+	}
+	return NULL;
 }
 
 /*
- *  calc_average_voltage()
- *	calculatate average voltage on CPU ids
+ *  cross_validate()
+ *	k-fold cross-validation of each valid model with each
+ *	estimator, the folds are run on a pool of threads. The steps
+ *	are run in load order, so they are shuffled with a fixed seed
+ *	before they are dealt into the folds, otherwise each fold would
+ *	hold a regular stride of loads and CPU counts. The shuffle is
+ *	the same on every run of a trace.
  */
-static double calc_average_voltage(
-	const int cpus_used,
-	value_t *values,
-	const int num_values)
+static int cross_validate(
+	FILE *yaml,
+	model_t *models,
+	const int num_models,
+	const int n)
 {
-	int i, n = 0;
-	double average = 0.0;
+	const int folds = (n < ANALYZE_FOLDS) ? n : ANALYZE_FOLDS;
+	pthread_t threads[ANALYZE_THREADS_MAX];
+	fold_queue_t queue;
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t w = MWC_SEED_W, z = MWC_SEED_Z;
+	int *order;
+	int i, m, e, n_threads = 0;
+
+	if (folds < 3) {
+		(void)printf("Too few test steps (%d) to cross-validate the models.\n", n);
+		return 0;
+	}
 
-	for (i = 0; i < num_values; i++) {
-		if (cpus_used == CPU_ANY || cpus_used >= values[i].cpus_used) {
-			average += values[i].voltage;
-			n++;
-		}
+	if ((order = calloc((size_t)n, sizeof(*order))) == NULL) {
+		(void)fprintf(stderr, "Cannot allocate cross-validation folds.\n");
+		return -1;
+	}
+	/* Fisher-Yates shuffle, a private mwc() so the seed is fixed */
+	for (i = 0; i < n; i++)
+		order[i] = i;
+	for (i = n - 1; i > 0; i--) {
+		int j, tmp;
+
+		z = 36969 * (z & 65535) + (z >> 16);
+		w = 18000 * (w & 65535) + (w >> 16);
+		j = (int)(((z << 16) + w) % (uint32_t)(i + 1));
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
 	}
-	average = (n == 0) ? 0.0 : average / n;
 
-	if (FLOAT_CMP(average, 0.0))
+	(void)memset(&queue, 0, sizeof(queue));
+	queue.folds = calloc((size_t)num_models * ESTIMATORS * folds, sizeof(fold_t));
+	if (!queue.folds) {
+		(void)fprintf(stderr, "Cannot allocate cross-validation folds.\n");
+		free(order);
 		return -1;
+	}
+	for (m = 0; m < num_models; m++) {
+		if (!models[m].valid)
+			continue;
+		for (e = 0; e < ESTIMATORS; e++) {
+			for (i = 0; i < folds; i++) {
+				fold_t *f = &queue.folds[queue.n++];
+
+				f->model = &models[m];
+				f->estimator = e;
+				f->fold = i;
+				f->folds = folds;
+				f->n = n;
+				f->order = order;
+			}
+		}
+	}
 
-	return average;
+	/* The main thread works through the queue too */
+	if (online > ANALYZE_THREADS_MAX)
+		online = ANALYZE_THREADS_MAX;
+	if (online > (long)queue.n)
+		online = (long)queue.n;
+	for (i = 0; i < online - 1; i++) {
+		if (pthread_create(&threads[i], NULL, fold_thread, &queue))
+			break;
+		n_threads++;
+	}
+	(void)fold_thread(&queue);
+	for (i = 0; i < n_threads; i++)
+		(void)pthread_join(threads[i], NULL);
+
+	(void)printf("\n%d-fold cross-validation on %d thread%s, prediction "
+		"error of held out steps:\n", folds, n_threads + 1,
+		n_threads ? "s" : "");
+	(void)printf("  %-32s %-13s %10s %10s\n", "Model", "Estimator",
+		"RMSE W", "MAE W");
+	if (yaml) {
+		(void)fprintf(yaml, "  cross-validation:\n");
+		(void)fprintf(yaml, "    folds: %d\n", folds);
+	}
+	for (m = 0; m < num_models; m++) {
+		if (!models[m].valid)
+			continue;
+		if (yaml)
+			(void)fprintf(yaml, "    %s:\n", models[m].heading);
+		for (e = 0; e < ESTIMATORS; e++) {
+			double sse = 0.0, sae = 0.0;
+			int tested = 0;
+
+			for (i = 0; i < (int)queue.n; i++) {
+				const fold_t *f = &queue.folds[i];
+
+				if ((f->model == &models[m]) && (f->estimator == e)) {
+					sse += f->sse;
+					sae += f->sae;
+					tested += f->tested;
+				}
+			}
+			if (!tested)
+				continue;
+			(void)printf("  %-32.32s %-13s %10.4f %10.4f\n", models[m].unit,
+				estimator_names[e], sqrt(sse / tested), sae / tested);
+			if (yaml) {
+				(void)fprintf(yaml, "      %s:\n", estimator_names[e]);
+				(void)fprintf(yaml, "        rmse-watts: %f\n", sqrt(sse / tested));
+				(void)fprintf(yaml, "        mae-watts: %f\n", sae / tested);
+			}
+		}
+	}
+	free(queue.folds);
+	free(order);
+	return 0;
 }
 
 /*
- *  show_trend()
- *	Show power trend
+ *  analyze_fits()
+ *	refit each model to the steps with up to cpus_used CPUs,
+ *	with least squares as in a calibration run and with the
+ *	Theil-Sen estimator
  */
-static void show_trend(
+static void analyze_fits(
 	FILE *yaml,
 	const int cpus_used,
-	value_t *values,
-	const int num_values,
-	const char *unit,
-	const char *each,
-	const char *heading,
-	const char *field,
-	bool power)
+	model_t *models,
+	const int num_models,
+	const int n)
 {
-	char watts[16];
-	double gradient, intercept, r2;
-	double average_voltage =
-		calc_average_voltage(cpus_used, values, num_values);
-
-	if (calc_trend(heading, cpus_used, values, num_values, &gradient, &intercept, &r2) < 0)
-		return;
-
-	units_to_str(gradient, "W", watts, sizeof(watts));
-
-	(void)printf("  %s (%s) = (%s * %e) + %f\n",
-		power ? "Power" : "Energy",
-		power ? "Watts" : "Watt-seconds",
-		unit, gradient, intercept);
-	if (average_voltage > 0) {
-		char amps[16], volts[16];
-		units_to_str(average_voltage, "V", volts, sizeof(volts));
-		units_to_str(gradient / average_voltage, "A", amps, sizeof(amps));
-		printf("  %s is about %s (about %s @ %s)\n",
-			each, watts, amps, volts);
-	} else {
-		(void)printf("  %s is about %s%s\n", each, watts,
-			power ? "" : "s");
-	}
-	(void)printf("  Coefficient of determination R^2 = %f (%s)\n",
-		r2, coefficient_r2(r2));
-
-	dump_yaml_values(yaml, heading, field, gradient, r2);
-}
+	int m;
 
-static void init_values(value_t *values, const size_t n)
-{
-	register size_t i;
+	for (m = 0; m < num_models; m++) {
+		double gradient, intercept, r2;
 
-	for (i = 0; i < n; i++) {
-		values[i].x = 0.0;
-		values[i].y = 0.0;
-		values[i].voltage = 0.0;
-		values[i].cpu_id = 0;
-		values[i].cpus_used = 0;
+		if (m)
+			(void)printf("\n");
+		if (calc_trend(models[m].heading, cpus_used, models[m].values, n,
+			       &gradient, &intercept, &r2) < 0)
+			continue;
+		show_trend(yaml, cpus_used, models[m].values, n, models[m].unit,
+			models[m].each, models[m].heading, models[m].field,
+			models[m].power);
+		if (cpus_used == CPU_ANY)
+			models[m].valid = true;
+		if (calc_theil_sen(cpus_used, models[m].values, n,
+				   &gradient, &intercept) == 0)
+			(void)printf("  Theil-Sen estimate = (%s * %e) + %f\n",
+				models[m].unit, gradient, intercept);
 	}
 }
 
 /*
- *  monitor_cpu_load()
- *	load CPU(s) and gather stats
+ *  analyze_trace()
+ *	rebuild the per step averages from a -t raw sample trace
+ *	and refit the models to them without running any load
  */
-static int monitor_cpu_load(
-	FILE *fp,
-	const int32_t num_cpus,
-	const int32_t max_cpus,
-	const int32_t samples_cpu,
-	const int32_t sample_delay,
-	cpu_list_t *cpu_list,
-	rapl_info_t *rapl_list,
-	const int start_delay,
-	const int max_readings,
-	bogo_ops_t *bogo_ops)
+static int analyze_trace(const char *trace_filename, const char *filename)
 {
-	uint32_t i, n = 0;
-	const size_t n_values = num_cpus * samples_cpu;
-	value_t values_load[n_values], *value_load = values_load;
-	value_t values_ops[n_values], *value_ops = values_ops;
-	value_t values_cpu_cycles[n_values], *value_cpu_cycles = values_cpu_cycles;
-	value_t values_cpu_instr[n_values], *value_cpu_instr = values_cpu_instr;
-	double scale = (double)MAX_CPU_LOAD / (samples_cpu - 1);
+	const trace_header_t *header;
+	const trace_record_t *records;
+	struct stat statbuf;
+	void *map = MAP_FAILED;
+	FILE *yaml = NULL;
+	value_t *values = NULL;
+	model_t models[4 + PERF_MAX_EVENTS];
+	char bogo_unit[32], bogo_each[32], bogo_heading[32], bw_heading[48];
+	size_t n_records = 0, r;
+	int fd, n = 0, n_steps = 0, num_models = 0, rc = -1;
+
+	if ((fd = open(trace_filename, O_RDONLY)) < 0) {
+		(void)fprintf(stderr, "Cannot open trace file '%s', errno=%d (%s).\n",
+			trace_filename, errno, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &statbuf) < 0) {
+		(void)fprintf(stderr, "Cannot stat trace file '%s', errno=%d (%s).\n",
+			trace_filename, errno, strerror(errno));
+		goto out;
+	}
+	if ((size_t)statbuf.st_size >= sizeof(trace_header_t))
+		map = mmap(NULL, (size_t)statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	header = map;
+	if ((map == MAP_FAILED) ||
+	    memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) ||
+	    (header->version != TRACE_VERSION) ||
+	    (header->header_size != sizeof(trace_header_t)) ||
+	    (header->record_size != sizeof(trace_record_t)) ||
+	    (header->max_values != MAX_VALUES) ||
+	    (header->max_domains != MAX_POWER_DOMAINS)) {
+		(void)fprintf(stderr, "File '%s' is not a trace recorded by this "
+			"version of %s.\n", trace_filename, app_name);
+		goto out;
+	}
+	records = (const trace_record_t *)((const uint8_t *)map + header->header_size);
+	n_records = ((size_t)statbuf.st_size - header->header_size) / header->record_size;
+	for (r = 0; r < n_records; r++)
+		if (!r || (records[r].step != records[r - 1].step))
+			n_steps++;
+	if (!n_steps) {
+		(void)fprintf(stderr, "Trace file '%s' has no samples.\n", trace_filename);
+		goto out;
+	}
 
-	init_values(values_load, n_values);
-	init_values(values_ops, n_values);
-	init_values(values_cpu_cycles, n_values);
-	init_values(values_cpu_instr, n_values);
+	if ((workload = workload_find(header->workload)) == NULL) {
+		(void)fprintf(stderr, "Trace file '%s' has an unknown workload '%.*s'.\n",
+			trace_filename, (int)sizeof(header->workload), header->workload);
+		goto out;
+	}
+#if defined(PERF_ENABLED)
+	if ((header->perf_events > 0) && (header->perf_events <= PERF_MAX_EVENTS)) {
+		char list[PERF_MAX_EVENTS * 33];
+		size_t len = 0;
+		int i;
+
+		for (i = 0; i < header->perf_events; i++)
+			len += (size_t)snprintf(list + len, sizeof(list) - len, "%s%.*s",
+				i ? "," : "", (int)sizeof(header->perf_event[i]) - 1,
+				header->perf_event[i]);
+		if (perf_events_parse(list) < 0)
+			goto out;
+		perf_events = header->perf_events;
+		perf_enabled = true;
+	}
+#endif
 
-	stats_headings("CPU load");
-	for (i = 0; i < (uint32_t)samples_cpu; i++) {
-		cpu_info_t *c;
-		uint32_t n_cpus;
+	/* The steps of each model, then the perf event x values */
+	values = calloc((size_t)n_steps * (4 + PERF_MAX_EVENTS), sizeof(value_t));
+	if (!values) {
+		(void)fprintf(stderr, "Cannot allocate trace step values.\n");
+		goto out;
+	}
 
-		for (n_cpus = 1, c = cpu_list->head; c; n_cpus++, c = c->next) {
-			char buffer[1024];
-			int cpu_load = scale * i;
-			int ret;
-			double percent_each = 100.0 / (samples_cpu * num_cpus);
-			double percent = n * percent_each;
+	(void)printf("Trace %s: workload %s, %zu samples in %d test steps, "
+		"%d of %d CPUs\n", trace_filename, workload->name, n_records,
+		n_steps, header->num_cpus, header->max_cpus);
+	if (header->flags & (OPT_FREQ_SWEEP | OPT_IDLE))
+		(void)printf("Steps from each %s are fitted together\n",
+			(header->flags & OPT_IDLE) ? "idle state limit" : "CPU frequency");
+	stats_headings((workload->rate == RATE_WAKEUP) ? "Wakeups/s" : "CPU load");
+
+	/* Average the accurate samples of each step, as monitor() does */
+	for (r = 0; r < n_records; n++) {
+		double sum[MAX_VALUES];
+		int valid[MAX_VALUES];
+		const trace_record_t *first = &records[r];
+		char buffer[64];
+		stats_t average;
+		int j;
+
+		(void)memset(sum, 0, sizeof(sum));
+		(void)memset(valid, 0, sizeof(valid));
+		for (; (r < n_records) && (records[r].step == first->step); r++) {
+			for (j = 0; j < MAX_VALUES; j++) {
+				if ((j == POWER_NOW) && records[r].inaccurate)
+					continue;
+				sum[j] += records[r].value[j];
+				valid[j]++;
+			}
+		}
+		for (j = 0; j < MAX_VALUES; j++) {
+			average.value[j] = valid[j] ? sum[j] / valid[j] : 0.0;
+			average.inaccurate[j] = !valid[j];
+		}
+		if (workload->rate == RATE_WAKEUP)
+			(void)snprintf(buffer, sizeof(buffer), "%.3gK x %u",
+				first->load / 1000.0, first->cpus);
+		else
+			(void)snprintf(buffer, sizeof(buffer), "%.0f%% x %u",
+				first->load, first->cpus);
+		stats_print(buffer, true, &average);
 
-			(void)snprintf(buffer, sizeof(buffer), "%d%% x %u",
-				cpu_load, n_cpus);
-			start_load(cpu_list, n_cpus, stress_cpu,
-				(uint64_t)cpu_load, bogo_ops);
+		for (j = 0; j < 4 + PERF_MAX_EVENTS; j++) {
+			value_t *v = &values[(j * n_steps) + n];
 
-			ret = monitor(num_cpus, cpu_list, rapl_list,
-				start_delay, sample_delay,
-				max_readings, buffer,
-				percent_each, percent, bogo_ops,
-				&value_load->x,
-				&value_load->y,
-				&value_load->voltage,
-				&value_ops->x,
-				&value_cpu_cycles->x,
-				&value_cpu_instr->x);
-			value_ops->y = value_load->y;
-			value_ops->voltage = value_load->voltage;
-			value_ops->cpu_id = value_load->cpu_id = c->cpu_id;
-			value_ops->cpus_used = value_load->cpus_used = n_cpus;
+			v->y = average.value[POWER_NOW];
+			v->voltage = average.value[VOLTAGE_NOW];
+			v->cpus_used = (int)first->cpus;
+		}
+		values[n].x = 100.0 - average.value[CPU_IDLE];
+		values[n_steps + n].x = average.value[BOGO_OPS];
+		values[(2 * n_steps) + n].x = average.value[BOGO_OPS] *
+			workload->bytes / 1000000000.0;
+		if (workload->rate)
+			values[(3 * n_steps) + n].x = average.value[rates[workload->rate].stat];
+		for (j = 0; j < perf_events; j++)
+			values[((4 + j) * n_steps) + n].x = average.value[PERF_EVENT_0 + j];
+	}
 
-			value_cpu_cycles->y = value_load->y;
-			value_cpu_cycles->voltage = value_load->voltage;
-			value_cpu_cycles->cpu_id = value_load->cpu_id;
-			value_cpu_cycles->cpus_used = value_load->cpus_used;
+	(void)snprintf(bogo_unit, sizeof(bogo_unit), "%s bogo op", workload->name);
+	(void)snprintf(bogo_each, sizeof(bogo_each), "1 %s bogo op", workload->name);
+	if (workload == &workloads[0])
+		(void)snprintf(bogo_heading, sizeof(bogo_heading), "bogo-op");
+	else
+		(void)snprintf(bogo_heading, sizeof(bogo_heading), "bogo-op-%s",
+			workload->name);
+	(void)snprintf(bw_heading, sizeof(bw_heading), "memory-bandwidth-%s",
+		workload->name);
+	(void)memset(models, 0, sizeof(models));
+	models[num_models++] = (model_t){ "% CPU load", "1% CPU load", "cpu-load",
+		"one-percent-cpu-load-watts", true, values, false };
+	models[num_models++] = (model_t){ bogo_unit, bogo_each, bogo_heading,
+		"one-bogo-op-watts-seconds", false, values + n_steps, false };
+	if (workload->bytes)
+		models[num_models++] = (model_t){ "GB/s", "1 GB/s", bw_heading,
+			"watts-per-gb-per-second", true, values + (2 * n_steps), false };
+	if (workload->rate)
+		models[num_models++] = (model_t){ rates[workload->rate].unit,
+			rates[workload->rate].each, rates[workload->rate].heading,
+			rates[workload->rate].field, true, values + (3 * n_steps), false };
+#if defined(PERF_ENABLED)
+	for (n = 0; n < perf_events; n++) {
+		const perf_info_t *info = perf_event_info(n);
 
-			value_cpu_instr->y = value_load->y;
-			value_cpu_instr->voltage = value_load->voltage;
-			value_cpu_instr->cpu_id = value_load->cpu_id;
-			value_cpu_instr->cpus_used = value_load->cpus_used;
+		models[num_models++] = (model_t){ info->unit, info->unit, info->heading,
+			info->field, false, values + ((4 + n) * n_steps), false };
+	}
+#endif
 
-			stop_load(cpu_list, n_cpus);
-			if (stop_flag || (ret < 0))
-				return -1;
-			value_load++;
-			value_ops++;
-			value_cpu_cycles++;
-			value_cpu_instr++;
-			n++;
+	if (filename) {
+		if ((yaml = fopen(filename, "w")) == NULL) {
+			(void)fprintf(stderr, "Cannot open json output file '%s', "
+				"errno=%d (%s).\n", filename, errno, strerror(errno));
+			goto out;
 		}
-	}
-	/* Keep static analysis happy */
-	if (n == 0) {
-		printf("\nZero samples, cannot compute statistics.\n");
-		return -1;
+		(void)fprintf(yaml, "---\n%s:\n", app_name);
+		(void)fprintf(yaml, "  trace:\n");
+		(void)fprintf(yaml, "    file: %s\n", trace_filename);
+		(void)fprintf(yaml, "    workload: %s\n", workload->name);
+		(void)fprintf(yaml, "    samples: %zu\n", n_records);
+		(void)fprintf(yaml, "    steps: %d\n", n_steps);
 	}
 
 	if (opt_flags & OPT_CALIBRATE_EACH_CPU) {
-		cpu_info_t *c;
-		int cpus_used = 0;
+		int cpus_used;
 
-		for (c = cpu_list->head, cpus_used = 1; c; c = c->next, cpus_used++) {
+		for (cpus_used = 1; cpus_used <= header->num_cpus; cpus_used++) {
 			(void)printf("\nFor %d CPU%s (of a %d CPU system):\n",
-				cpus_used, cpus_used > 1 ? "s" : "", max_cpus);
-			show_trend(NULL, cpus_used, values_load, n,
-				"% CPU load", "1% CPU load",
-				"cpu-load", "one-percent-cpu-load-watts", true);
-			(void)printf("\n");
-			show_trend(NULL, cpus_used, values_ops, n,
-				"bogo op", "1 bogo op",
-				"bogo-op", "one-bogo-op-power-watt-seconds", false);
-
-			if (perf_enabled) {
-				(void)printf("\n");
-				show_trend(NULL, cpus_used, values_cpu_cycles, n,
-					"CPU cycle", "1 CPU cycle",
-					"cpu-cycle", "one-cpu-cycle-watt-seconds", false);
-				(void)printf("\n");
-				show_trend(NULL, cpus_used, values_cpu_instr, n,
-					"CPU instruction", "1 CPU instruction",
-					"cpu-instruction", "on-cpu-instruction-watt-seconds", false);
-			}
-		}
-	} else {
-		(void)printf("\nFor %u CPU%s (of a %d CPU system):\n",
-			cpu_list->count, cpu_list->count > 1 ? "s" : "", max_cpus);
-		show_trend(fp, CPU_ANY, values_load, n,
-			"% CPU load", "1% CPU load",
-			"cpu-load", "one-percent-cpu-load-watts", true);
-		(void)printf("\n");
-		show_trend(fp, CPU_ANY, values_ops, n,
-			"bogo op", "1 bogo op",
-			"bogo-op", "one-bogo-op-watts-seconds", false);
-		if (perf_enabled) {
-			(void)printf("\n");
-			show_trend(fp, CPU_ANY, values_cpu_cycles, n,
-				"CPU cycle", "1 CPU cycle",
-				"cpu-cycle", "one-cpu-cycle-watt-seconds", false);
-			(void)printf("\n");
-			show_trend(fp, CPU_ANY, values_cpu_instr, n,
-				"CPU instruction", "1 CPU instruction",
-				"cpu-instruction", "on-cpu-instruction-watt-seconds", false);
+				cpus_used, cpus_used > 1 ? "s" : "", header->max_cpus);
+			analyze_fits(NULL, cpus_used, models, num_models, n_steps);
 		}
 	}
-	return 0;
+	(void)printf("\nFor %d CPU%s (of a %d CPU system):\n", header->num_cpus,
+		header->num_cpus > 1 ? "s" : "", header->max_cpus);
+	analyze_fits(yaml, CPU_ANY, models, num_models, n_steps);
+
+	rc = cross_validate(yaml, models, num_models, n_steps);
+out:
+	if (yaml) {
+		(void)fprintf(yaml, "...\n");
+		(void)fclose(yaml);
+		if (rc < 0)
+			(void)unlink(filename);
+	}
+	free(values);
+	if (map != MAP_FAILED)
+		(void)munmap(map, (size_t)statbuf.st_size);
+	(void)close(fd);
+	return rc;
 }
 
 /*
@@ -1964,6 +6546,7 @@ static int monitor_cpu_load(
 static int add_cpu_info(cpu_list_t *cpu_list, const int cpu)
 {
 	cpu_info_t *c;
+	int i;
 
 	c = calloc(1, sizeof(cpu_info_t));
 	if (!c) {
@@ -1976,6 +6559,12 @@ static int add_cpu_info(cpu_list_t *cpu_list, const int cpu)
 		cpu_list->head = c;
 
 	c->cpu_id = cpu;
+	c->pid = -1;
+	for (i = 0; i < MAX_CSTATES; i++) {
+		c->cstate_time_fd[i] = -1;
+		c->cstate_usage_fd[i] = -1;
+		c->cstate_disable[i] = -1;
+	}
 	cpu_list->tail = c;
 	cpu_list->count++;
 
@@ -2066,18 +6655,36 @@ int main(int argc, char * const argv[])
 	int max_readings, run_duration, start_delay = START_DELAY_BATTERY;
 	int opt_run_duration = DEFAULT_RUN_DURATION;
 	char *filename = NULL;
+	char *trace_filename = NULL;		/* -t raw sample trace */
+	char *analyze_filename = NULL;		/* --analyze trace */
 	FILE *yaml = NULL;
 	int ret = EXIT_FAILURE, i;
 	struct sigaction new_action;
-	bogo_ops_t *bogo_ops = NULL;
+	telemetry_t *telemetry = NULL;
 	rapl_info_t *rapl_list = NULL;		/* RAPL domain info list */
 	cpu_list_t cpu_list;
 	int32_t samples_cpu = 11.0;		/* samples per run */
 	int32_t sample_delay = SAMPLE_DELAY;	/* time between each sampl */
 	int32_t num_cpus;			/* number of CPUs */
 	int32_t max_cpus;			/* number of CPUs in system */
+	int32_t sampler_ms = 0;			/* energy sampler interval */
+	int32_t load_period_ms = LOAD_PERIOD_MS;	/* PWM load period */
+	const char *msr_path = DEV_CPU_MSR;	/* MSR device path */
+	bool opt_ctxt_pair = false;		/* -C given */
+	long page_size;				/* telemetry page size */
+	int opt_turbo = -1;			/* --turbo, -1 = leave as is */
+	static const struct option long_options[] = {
+		{ "freq-sweep",	no_argument,		NULL,	OPT_LONG_FREQ_SWEEP },
+		{ "turbo",	required_argument,	NULL,	OPT_LONG_TURBO },
+		{ "idle",	no_argument,		NULL,	OPT_LONG_IDLE },
+		{ "sysroot",	required_argument,	NULL,	OPT_LONG_SYSROOT },
+		{ "simulate",	optional_argument,	NULL,	OPT_LONG_SIMULATE },
+		{ "analyze",	required_argument,	NULL,	OPT_LONG_ANALYZE },
+		{ NULL,		0,			NULL,	0 }
+	};
 
 	(void)memset(&cpu_list, 0, sizeof(cpu_list));
+	workload = &workloads[0];
 
 	max_cpus = num_cpus = sysconf(_SC_NPROCESSORS_CONF);
 	if (num_cpus < 1) {
@@ -2088,10 +6695,14 @@ int main(int argc, char * const argv[])
 	}
 
 	for (;;) {
-		int c = getopt(argc, argv, "d:ehn:o:ps:r:R");
+		int c = getopt_long(argc, argv, "aC:d:Eef:hkL:m:Mn:N:o:pP:s:r:Rt:w:",
+			long_options, NULL);
 		if (c == -1)
 			break;
 		switch (c) {
+		case 'a':
+			opt_flags |= (OPT_PERF_CPU | OPT_PERF_PERSIST);
+			break;
 		case 'd':
 			opt_flags |= OPT_DELAY;
 			start_delay = atoi(optarg);
@@ -2100,12 +6711,102 @@ int main(int argc, char * const argv[])
 				goto out;
 			}
 			break;
+#if defined(PERF_ENABLED)
+		case 'E':
+			opt_flags |= OPT_PERF_POWER;
+			break;
+#endif
 		case 'e':
 			opt_flags |= OPT_CALIBRATE_EACH_CPU;
 			break;
+#if defined(RAPL_X86)
+		case 'f':
+			sampler_ms = atoi(optarg);
+			if ((sampler_ms < 1) || (sampler_ms > SAMPLER_MAX_MS)) {
+				(void)fprintf(stderr, "Energy sampling interval must be "
+					"1 to %d milliseconds.\n", SAMPLER_MAX_MS);
+				goto out;
+			}
+			break;
+#endif
 		case 'h':
 			show_help(argv);
 			goto out;
+		case OPT_LONG_FREQ_SWEEP:
+			opt_flags |= OPT_FREQ_SWEEP;
+			break;
+		case OPT_LONG_IDLE:
+			opt_flags |= OPT_IDLE;
+			break;
+		case OPT_LONG_ANALYZE:
+			analyze_filename = optarg;
+			break;
+		case OPT_LONG_SYSROOT:
+			sysroot = optarg;
+			break;
+		case OPT_LONG_SIMULATE:
+			opt_flags |= OPT_SIMULATE;
+			if (optarg &&
+			    ((sscanf(optarg, "%lf,%lf,%lf", &sim.idle_watts,
+					&sim.cpu_watts, &sim.noise) < 1) ||
+			     (sim.idle_watts < 0.0) || (sim.cpu_watts < 0.0) ||
+			     (sim.noise < 0.0))) {
+				(void)fprintf(stderr, "Simulator model must be idle watts, "
+					"watts per busy CPU and noise, e.g. 2,5,0.02.\n");
+				goto out;
+			}
+			break;
+		case OPT_LONG_TURBO:
+			if (!strcmp(optarg, "on")) {
+				opt_turbo = 1;
+			} else if (!strcmp(optarg, "off")) {
+				opt_turbo = 0;
+			} else {
+				(void)fprintf(stderr, "Turbo must be on or off.\n");
+				goto out;
+			}
+			break;
+		case 'w':
+			if ((workload = workload_find(optarg)) == NULL) {
+				(void)fprintf(stderr, "Unknown workload '%s', use int, "
+					"fp, vector, mixed, read, write, copy, chase-l1, "
+					"chase-l2, chase-llc, chase-dram, ctxt, wakeup or "
+					"syscall.\n", optarg);
+				goto out;
+			}
+			break;
+		case 'C':
+			for (i = 0; i < (int)(sizeof(ctxt_pair_names) / sizeof(ctxt_pair_names[0])); i++) {
+				if (!strcmp(optarg, ctxt_pair_names[i]))
+					break;
+			}
+			if (i == (int)(sizeof(ctxt_pair_names) / sizeof(ctxt_pair_names[0]))) {
+				(void)fprintf(stderr, "Context switch pair placement must "
+					"be cpu, smt or package.\n");
+				goto out;
+			}
+			ctxt_pair = i;
+			opt_ctxt_pair = true;
+			break;
+		case 'N':
+			if (!strcmp(optarg, "remote")) {
+				mem_remote = true;
+			} else if (strcmp(optarg, "local")) {
+				(void)fprintf(stderr, "NUMA node must be local or remote.\n");
+				goto out;
+			}
+			break;
+		case 'L':
+			load_period_ms = atoi(optarg);
+			if ((load_period_ms < 1) || (load_period_ms > LOAD_PERIOD_MAX_MS)) {
+				(void)fprintf(stderr, "Load period must be 1 to %d "
+					"milliseconds.\n", LOAD_PERIOD_MAX_MS);
+				goto out;
+			}
+			break;
+		case 'k':
+			opt_flags |= OPT_PERF_PERSIST;
+			break;
 		case 'n':
 			if (parse_cpu_info(&num_cpus, max_cpus, &cpu_list, optarg) < 0)
 				goto out;
@@ -2116,6 +6817,18 @@ int main(int argc, char * const argv[])
 		case 'p':
 			opt_flags |= OPT_PROGRESS;
 			break;
+		case 't':
+			trace_filename = optarg;
+			break;
+		case 'P':
+#if defined(PERF_ENABLED)
+			if (perf_events_parse(optarg) < 0)
+				goto out;
+#else
+			(void)fprintf(stderr, "perf events are not supported on this system.\n");
+			goto out;
+#endif
+			break;
 		case 'r':
 			opt_run_duration = atoi(optarg);
 			if (opt_run_duration < MIN_RUN_DURATION) {
@@ -2125,6 +6838,12 @@ int main(int argc, char * const argv[])
 			}
 			break;
 #if defined(RAPL_X86)
+		case 'm':
+			msr_path = optarg;
+			break;
+		case 'M':
+			opt_flags |= (OPT_RAPL | OPT_RAPL_MSR);
+			break;
 		case 'R':
 			opt_flags |= OPT_RAPL;
 			break;
@@ -2143,15 +6862,109 @@ int main(int argc, char * const argv[])
 		}
 	}
 
-	if ((opt_flags & (OPT_RAPL | OPT_DELAY)) == OPT_RAPL)
+	/* Offline analysis of a trace needs none of the hardware */
+	if (analyze_filename) {
+		if (analyze_trace(analyze_filename, filename) == 0)
+			ret = EXIT_SUCCESS;
+		goto out;
+	}
+
+	if ((opt_flags & OPT_PERF_POWER) && (opt_flags & OPT_RAPL)) {
+		(void)fprintf(stderr, "Cannot use the perf power PMU (-E) and RAPL at the same time.\n");
+		goto out;
+	}
+	if ((opt_flags & OPT_SIMULATE) && (opt_flags & (OPT_RAPL | OPT_PERF_POWER))) {
+		(void)fprintf(stderr, "Cannot use the power simulator (--simulate) with "
+			"RAPL or the perf power PMU.\n");
+		goto out;
+	}
+	if ((opt_flags & (OPT_RAPL | OPT_PERF_POWER | OPT_SIMULATE)) &&
+	    !(opt_flags & OPT_DELAY))
 		start_delay = START_DELAY_RAPL;
 
-	perf_enabled = perf_possible();
+	perf_enabled = perf_possible(2);
+#if defined(PERF_ENABLED)
+	if (perf_enabled)
+		perf_events = perf_events_num();
+#endif
+	/* System wide per CPU events need a lower paranoid level */
+	if (perf_enabled && (opt_flags & OPT_PERF_CPU) && !perf_possible(1)) {
+		(void)fprintf(stderr, "Cannot count perf events on each CPU, "
+			"try running as root, using per process counters instead.\n");
+		opt_flags &= ~OPT_PERF_CPU;
+	}
+	if ((opt_flags & OPT_IDLE) && (opt_flags & OPT_FREQ_SWEEP)) {
+		(void)fprintf(stderr, "Cannot use --idle with --freq-sweep.\n");
+		goto out;
+	}
+	if ((opt_flags & OPT_FREQ_SWEEP) && workload->rate) {
+		(void)fprintf(stderr, "Cannot use --freq-sweep with the %s "
+			"workload.\n", workload->name);
+		goto out;
+	}
+	if ((opt_turbo >= 0) && !(opt_flags & OPT_FREQ_SWEEP)) {
+		(void)fprintf(stderr, "Turbo control (--turbo) needs --freq-sweep.\n");
+		goto out;
+	}
+	if (opt_ctxt_pair && (workload->rate != RATE_CTXT)) {
+		(void)fprintf(stderr, "Context switch pair placement (-C) needs "
+			"the ctxt workload.\n");
+		goto out;
+	}
+	if (mem_remote) {
+		if (!workload->bytes && !workload->chase) {
+			(void)fprintf(stderr, "Remote NUMA node (-N) needs a memory "
+				"or pointer chase workload.\n");
+			goto out;
+		}
+		if (numa_nodes() < 2) {
+			(void)fprintf(stderr, "Remote NUMA node (-N) needs more "
+				"than one NUMA node.\n");
+			goto out;
+		}
+	}
+	/* Memory traffic power is in the DRAM domain */
+	power_dram = (workload->bytes > 0) || (workload->chase == CHASE_DRAM);
 	populate_cpu_info(num_cpus, &cpu_list);
+	mem_size = workload->chase ?
+		chase_size(workload->chase, cpu_list.count) :
+		mem_buffer_size(cpu_list.count);
+	cpu_util = cpu_util_alloc(max_cpus);
+	(void)cstate_open(&cpu_list);
 
 #if defined(RAPL_X86)
-	if ((opt_flags & OPT_RAPL) && (rapl_get_domains(&rapl_list) < 1))
-		exit(EXIT_FAILURE);
+	if (opt_flags & OPT_RAPL_MSR) {
+		if (rapl_get_domains_msr(&rapl_list, msr_path, max_cpus) < 1)
+			goto out;
+	} else if ((opt_flags & OPT_RAPL) && (rapl_get_domains(&rapl_list) < 1)) {
+		goto out;
+	}
+	if (sampler_ms) {
+		if (!(opt_flags & OPT_RAPL)) {
+			(void)fprintf(stderr, "High rate energy sampling (-f) requires "
+				"the RAPL option -R.\n");
+			goto out;
+		}
+		energy_sampler = sampler_start(rapl_list, &cpu_list, max_cpus,
+			(uint32_t)sampler_ms);
+		if (!energy_sampler)
+			goto out;
+	}
+#endif
+
+	if (!(opt_flags & (OPT_RAPL | OPT_PERF_POWER | OPT_SIMULATE)) &&
+	    (battery_get_list(&battery_list) < 0))
+		goto out;
+
+#if defined(PERF_ENABLED)
+	if (opt_flags & OPT_PERF_POWER) {
+		perf_power_packages = perf_power_open(&perf_power);
+		if (perf_power_packages < 1) {
+			(void)printf("Cannot open the perf power PMU energy events, cannot "
+				"measure power usage, try running as root.\n");
+			goto out;
+		}
+	}
 #endif
 
 	if (optind < argc) {
@@ -2171,6 +6984,11 @@ int main(int argc, char * const argv[])
 		}
 		(void)fprintf(yaml, "---\n%s:\n", app_name);
 	}
+	if (trace_filename) {
+		trace = trace_open(trace_filename, num_cpus, max_cpus, sample_delay);
+		if (!trace)
+			goto out;
+	}
 
 	(void)memset(&new_action, 0, sizeof(new_action));
 	for (i = 0; signals[i] != -1; i++) {
@@ -2188,25 +7006,48 @@ int main(int argc, char * const argv[])
 	run_duration = opt_run_duration;
 	max_readings = run_duration / sample_delay;
 
-	bogo_ops = mmap(NULL, sizeof(bogo_ops_t) * num_cpus,
+	/* One page of telemetry per load worker */
+	page_size = sysconf(_SC_PAGESIZE);
+	telemetry_size = (page_size > (long)sizeof(telemetry_t)) ?
+		(size_t)page_size : sizeof(telemetry_t);
+	telemetry = mmap(NULL, telemetry_size * num_cpus,
 		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
-	if (bogo_ops == MAP_FAILED) {
+	if (telemetry == MAP_FAILED) {
 		(void)fprintf(stderr, "mmap failed: errno=%d (%s).\n",
 			errno, strerror(errno));
+		telemetry = NULL;
 		goto out;
 	}
 
 	if (not_discharging(rapl_list))
 		goto out;
 
-	if (monitor_cpu_load(yaml, num_cpus, max_cpus, samples_cpu, sample_delay,
-		&cpu_list, rapl_list, start_delay, max_readings, bogo_ops) < 0)
+	if (opt_flags & OPT_IDLE) {
+		if (idle_calibrate(yaml, num_cpus, sample_delay, &cpu_list,
+			rapl_list, start_delay, max_readings, telemetry) < 0)
+			goto out;
+	} else if (opt_flags & OPT_FREQ_SWEEP) {
+		if ((opt_turbo >= 0) && (turbo_set(opt_turbo) < 0))
+			goto out;
+		if (freq_sweep(yaml, num_cpus, max_cpus, samples_cpu, sample_delay,
+			&cpu_list, rapl_list, start_delay, max_readings, load_period_ms,
+			telemetry) < 0)
+			goto out;
+	} else if (monitor_cpu_load(yaml, num_cpus, max_cpus, samples_cpu, sample_delay,
+		&cpu_list, rapl_list, start_delay, max_readings, load_period_ms,
+		telemetry, NULL) < 0) {
 		goto out;
+	}
 
 	ret = EXIT_SUCCESS;
 out:
-	if (bogo_ops)
-		(void)munmap(bogo_ops, sizeof(bogo_ops_t) * num_cpus);
+	/* Also reached when signalled to stop */
+	freq_restore(&cpu_list);
+	cstate_restore(&cpu_list);
+	cstate_close(&cpu_list);
+	trace_close(trace);
+	if (telemetry)
+		(void)munmap(telemetry, telemetry_size * num_cpus);
 	if (yaml) {
 		dump_yaml_misc(yaml);
 
@@ -2217,10 +7058,18 @@ out:
 	}
 	if (cpu_list.head)
 		free_cpu_info(&cpu_list);
+	cpu_util_free(cpu_util);
+	battery_free_list(battery_list);
+	if (sim.fd >= 0)
+		(void)close(sim.fd);
 
 #if defined(RAPL_X86)
+	sampler_stop(energy_sampler);
 	rapl_free_list(rapl_list);
 #endif
+#if defined(PERF_ENABLED)
+	perf_power_close(perf_power, perf_power_packages);
+#endif
 
 	exit(ret);
 }